@@ -0,0 +1,227 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "blockdevice.h"
+#include "status.h"
+
+// Free-space bitmap with a summary level. Level 0 has one bit per block (set =
+// allocated); level 1 has one bit per level-0 word, set when that word is
+// completely allocated, so scans skip full regions 4096 blocks at a time.
+// Allocation is next-fit and prefers a single contiguous extent.
+class BlockAllocator {
+public:
+    explicit BlockAllocator(std::uint64_t capacity = 0) {
+        resize(capacity);
+    }
+
+    std::uint64_t capacity() const { return blocks; }
+    std::uint64_t freeBlocks() const { return blocks - used; }
+
+    // Grows the bitmap; existing allocations are kept.
+    void resize(std::uint64_t capacity) {
+        if (capacity < blocks) {
+            throw std::invalid_argument("Block capacity cannot shrink!");
+        }
+
+        // Blocks past the old capacity were padding and are marked allocated
+        std::uint64_t oldBlocks = blocks;
+        blocks = capacity;
+        words.resize((capacity + 63) / 64, 0);
+        summary.resize((words.size() + 63) / 64, 0);
+        if (oldBlocks < capacity && oldBlocks % 64 != 0) {
+            words[oldBlocks / 64] &= (1ULL << (oldBlocks % 64)) - 1;
+            updateSummary(oldBlocks / 64);
+        }
+        if (capacity % 64 != 0) {
+            words.back() |= ~0ULL << (capacity % 64);
+            updateSummary(words.size() - 1);
+        }
+    }
+
+    bool isAllocated(std::uint64_t block) const {
+        return (words[block / 64] >> (block % 64)) & 1;
+    }
+
+    // Whether all of blocks [start, start + count) exist and are free.
+    bool isFree(std::uint64_t start, std::uint64_t count) const {
+        if (start > blocks || count > blocks - start) {
+            return false;
+        }
+        for (std::uint64_t block = start; block < start + count; ++block) {
+            if (isAllocated(block)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Finds free space for count blocks without reserving it: one extent if a
+    // long enough run exists, otherwise the first free runs after the cursor.
+    ExtentList find(std::uint64_t count) const {
+        ExtentList extents;
+        if (count == 0) {
+            return extents;
+        }
+        if (count > freeBlocks()) {
+            return extents;
+        }
+
+        auto contiguous = [&](std::uint64_t start, std::uint64_t length) {
+            if (length >= count) {
+                extents.push_back({start, count});
+                return true;
+            }
+            return false;
+        };
+        std::uint64_t from = cursor / 64;
+        if (scan(from, words.size(), count, contiguous) || scan(0, from, count, contiguous)) {
+            return extents;
+        }
+
+        std::uint64_t remaining = count;
+        auto gather = [&](std::uint64_t start, std::uint64_t length) {
+            std::uint64_t take = std::min(length, remaining);
+            extents.push_back({start, take});
+            remaining -= take;
+            return remaining == 0;
+        };
+        if (!scan(from, words.size(), count, gather)) {
+            scan(0, from, count, gather);
+        }
+        return extents;
+    }
+
+    ExtentList allocate(std::uint64_t count) {
+        ExtentList extents = find(count);
+        if (count > 0 && extents.empty()) {
+            throw FileSystemError(Status::NoSpace, "Insufficient storage space to allocate file blocks!");
+        }
+        for (const Extent& extent : extents) {
+            reserve(extent);
+        }
+        return extents;
+    }
+
+    void reserve(const Extent& extent) {
+        checkRange(extent);
+        setRange(extent, true);
+        used += extent.length;
+        cursor = extent.start + extent.length;
+    }
+
+    void release(const Extent& extent) {
+        checkRange(extent);
+        setRange(extent, false);
+        used -= extent.length;
+    }
+
+    struct FreeSpace {
+        std::uint64_t runs = 0;        // Maximal runs of free blocks
+        std::uint64_t largestRun = 0;
+    };
+
+    FreeSpace freeSpace() const {
+        FreeSpace space;
+        scan(0, words.size(), ~0ULL, [&space](std::uint64_t, std::uint64_t length) {
+            ++space.runs;
+            space.largestRun = std::max(space.largestRun, length);
+            return false;
+        });
+        return space;
+    }
+
+private:
+    std::vector<std::uint64_t> words;   // Level 0: one bit per block
+    std::vector<std::uint64_t> summary; // Level 1: one bit per full level-0 word
+    std::uint64_t blocks = 0;
+    std::uint64_t used = 0;
+    std::uint64_t cursor = 0;           // Next-fit starting point
+
+    void checkRange(const Extent& extent) const {
+        if (extent.start > blocks || extent.length > blocks - extent.start) {
+            throw std::out_of_range("Extent outside of the block device!");
+        }
+    }
+
+    void updateSummary(std::uint64_t word) {
+        std::uint64_t bit = 1ULL << (word % 64);
+        if (words[word] == ~0ULL) {
+            summary[word / 64] |= bit;
+        } else {
+            summary[word / 64] &= ~bit;
+        }
+    }
+
+    void setRange(const Extent& extent, bool allocated) {
+        std::uint64_t block = extent.start;
+        std::uint64_t end = extent.start + extent.length;
+        while (block < end) {
+            std::uint64_t word = block / 64;
+            std::uint64_t bit = block % 64;
+            std::uint64_t span = std::min<std::uint64_t>(64 - bit, end - block);
+            std::uint64_t mask = (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << bit;
+            if (allocated) {
+                words[word] |= mask;
+            } else {
+                words[word] &= ~mask;
+            }
+            updateSummary(word);
+            block += span;
+        }
+    }
+
+    // Walks maximal free runs in words [begin, end), using ctz to jump between
+    // run boundaries. A run is reported when it ends or reaches want blocks;
+    // the walk stops as soon as onRun returns true.
+    template <typename OnRun>
+    bool scan(std::uint64_t begin, std::uint64_t end, std::uint64_t want, OnRun onRun) const {
+        std::uint64_t runStart = 0;
+        std::uint64_t runLength = 0;
+        auto flush = [&]() {
+            bool stop = runLength > 0 && onRun(runStart, runLength);
+            runLength = 0;
+            return stop;
+        };
+
+        std::uint64_t w = begin;
+        while (w < end) {
+            // Skip words the summary marks as full
+            std::uint64_t open = ~summary[w / 64] >> (w % 64);
+            std::uint64_t skip = open == 0 ? 64 - w % 64 : static_cast<std::uint64_t>(__builtin_ctzll(open));
+            if (skip > 0) {
+                if (flush()) {
+                    return true;
+                }
+                w += skip;
+                continue;
+            }
+
+            std::uint64_t word = words[w];
+            std::uint64_t bit = 0;
+            while (bit < 64) {
+                std::uint64_t rest = word >> bit;
+                if (rest & 1) {
+                    if (flush()) {
+                        return true;
+                    }
+                    std::uint64_t freeBits = ~word >> bit;
+                    bit = freeBits == 0 ? 64 : bit + __builtin_ctzll(freeBits);
+                } else {
+                    std::uint64_t length = rest == 0 ? 64 - bit : static_cast<std::uint64_t>(__builtin_ctzll(rest));
+                    if (runLength == 0) {
+                        runStart = w * 64 + bit;
+                    }
+                    runLength += length;
+                    bit += length;
+                    if (runLength >= want && flush()) {
+                        return true;
+                    }
+                }
+            }
+            ++w;
+        }
+        return flush();
+    }
+};
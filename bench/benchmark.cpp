@@ -0,0 +1,373 @@
+// Microbenchmarks for the core FileSystem operations.
+//
+// Every benchmark runs against a fresh file system in a scratch directory and
+// reports throughput and the p50/p99 latency of single operations. The scale
+// of the workload is set on the command line, so the same binary can catch
+// regressions at a fixed scale or show how an operation grows with it.
+#include "fms.h"
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+
+namespace {
+
+struct Scale {
+    std::size_t files = 1000;         // Files in the benchmark directory
+    std::size_t metadataFiles = 0;    // Files the metadata benchmark creates; 0 uses files
+    std::size_t depth = 16;           // Depth of the directory moved by the mv benchmark
+    std::size_t contentSize = 1024;   // Bytes written per writefile/appendfile
+    double fillRatio = 0.5;           // Fraction of blocks already allocated in the allocator benchmark
+    std::uint64_t blocks = 1 << 20;   // Capacity of the allocator benchmark
+    std::size_t iterations = 10000;   // Operations per benchmark that can repeat
+    std::size_t rounds = 20;          // Saves and loads of the whole image
+    FsyncPolicy fsync = FsyncPolicy::Interval;
+};
+
+using Clock = std::chrono::steady_clock;
+
+void printHeader() {
+    std::cout << std::left << std::setw(20) << "benchmark" << std::right << std::setw(10) << "ops" << std::setw(14) << "ops/s"
+              << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)" << '\n';
+}
+
+// Runs op(i) count times, timing every call.
+template <typename Op>
+void measure(const char* name, std::size_t count, Op op) {
+    std::vector<double> latencies;
+    latencies.reserve(count);
+
+    Clock::time_point start = Clock::now();
+    for (std::size_t i = 0; i < count; ++i) {
+        Clock::time_point begin = Clock::now();
+        op(i);
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    auto percentile = [&latencies](double fraction) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        std::size_t rank = std::min(latencies.size() - 1, static_cast<std::size_t>(fraction * latencies.size()));
+        std::nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+        return latencies[rank];
+    };
+    double p50 = percentile(0.50);
+    double p99 = percentile(0.99);
+
+    std::cout << std::left << std::setw(20) << name << std::right << std::setw(10) << count << std::setw(14) << std::fixed
+              << std::setprecision(0) << (seconds > 0 ? count / seconds : 0.0) << std::setw(12) << std::setprecision(2) << p50
+              << std::setw(12) << p99 << '\n';
+}
+
+// Heap bytes in use, from malloc's own accounting, so the timed benchmarks
+// run on the allocator as it is rather than through a counting wrapper.
+std::int64_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = ::mallinfo2();
+#else
+    struct mallinfo info = ::mallinfo();
+#endif
+    return static_cast<std::int64_t>(info.uordblks) + static_cast<std::int64_t>(info.hblkhd);  // Small chunks plus mmapped ones
+}
+
+std::string fileName(const char* prefix, std::size_t i) {
+    return prefix + std::to_string(i);
+}
+
+void benchmarkFileSystem(const Scale& scale, const std::string& storagePath) {
+    std::uint64_t blocksPerFile = (2 * scale.contentSize + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE;
+    FileSystemOptions options;
+    options.storagePath = storagePath;
+    options.capacityBlocks = scale.files * blocksPerFile + 1024;
+    options.journal.fsyncPolicy = scale.fsync;
+
+    std::ostream discard(nullptr);
+    Session session;
+    session.out = &discard;
+    session.verbose = false;
+
+    std::unique_ptr<FileSystem> fileSystem(new FileSystem(options));
+    FileSystem& fs = *fileSystem;
+
+    // Two parents for the directory that mv moves back and forth: a chain
+    // depth levels deep, and a directory right below the root
+    std::string chain;
+    for (std::size_t level = 0; level + 1 < scale.depth; ++level) {
+        fs.createDirectory(session, fileName("d", level));
+        fs.changeDirectory(session, fileName("d", level));
+        chain += '/' + fileName("d", level);
+    }
+    fs.createDirectory(session, "leaf");
+    fs.changeDirectory(session, "/");
+    fs.createDirectory(session, "other");
+    fs.createDirectory(session, "files");
+    fs.changeDirectory(session, "/files");
+
+    std::string content(scale.contentSize, 'x');
+    int fileSize = static_cast<int>(2 * scale.contentSize);  // Room for one append after a write
+
+    measure("createFile", scale.files, [&](std::size_t i) {
+        fs.createFile(session, fileName("f", i), "rw", fileSize);
+    });
+    measure("writeFile", scale.iterations, [&](std::size_t i) {
+        fs.writeFile(session, fileName("f", i % scale.files), content);
+    });
+    measure("appendFile", scale.files, [&](std::size_t i) {
+        fs.appendFile(session, fileName("f", i), content);
+    });
+    measure("readFile", scale.iterations, [&](std::size_t i) {
+        fs.readFile(session, fileName("f", i % scale.files));
+    });
+
+    // The same content through the library API: handles skip parsing, name
+    // lookup and output
+    std::vector<FileHandle> handles(scale.files);
+    for (std::size_t i = 0; i < scale.files; ++i) {
+        fs.open("/files/" + fileName("f", i), handles[i]);
+    }
+    std::string readBack;
+    measure("handleWrite", scale.iterations, [&](std::size_t i) {
+        fs.replace(handles[i % scale.files], content);
+    });
+    measure("handleRead", scale.iterations, [&](std::size_t i) {
+        fs.read(handles[i % scale.files], 0, content.size(), readBack);
+    });
+    for (FileHandle handle : handles) {
+        fs.close(handle);
+    }
+    measure("listDirectory", scale.iterations, [&](std::size_t) {
+        fs.listDirectory(session);
+    });
+    measure("renameEntry", scale.files, [&](std::size_t i) {
+        fs.renameEntry(session, fileName("f", i), fileName("r", i));
+    });
+
+    // Every move clears the dentry cache, so each one resolves its paths from the root
+    std::string deep = chain + "/leaf";
+    std::string shallow = "/other/leaf";
+    std::string chainParent = chain.empty() ? "/" : chain;
+    measure("moveDirectory", scale.iterations, [&](std::size_t i) {
+        if (i % 2 == 0) {
+            fs.moveDirectory(session, deep, "/other");
+        } else {
+            fs.moveDirectory(session, shallow, chainParent);
+        }
+    });
+
+    measure("saveFileSystem", scale.rounds, [&](std::size_t) {
+        fs.checkpoint();
+    });
+    fileSystem.reset();
+
+    std::vector<std::unique_ptr<FileSystem>> loaded;
+    measure("loadFileSystem", scale.rounds, [&](std::size_t) {
+        loaded.emplace_back(new FileSystem(options));
+    });
+}
+
+// Heap taken by the metadata of scale.metadataFiles files with names that
+// share nothing, as in the createFile benchmark, spread over directories of
+// 1000 files each.
+void benchmarkMetadata(const Scale& scale, const std::string& storagePath) {
+    const std::size_t files = scale.metadataFiles != 0 ? scale.metadataFiles : scale.files;
+    FileSystemOptions options;
+    options.storagePath = storagePath;
+    options.capacityBlocks = files + 1024;
+    options.journal.fsyncPolicy = FsyncPolicy::Never;
+
+    std::ostream discard(nullptr);
+    Session session;
+    session.out = &discard;
+    session.verbose = false;
+
+    const std::size_t filesPerDirectory = 1000;
+    FileSystem fs(options);
+    std::vector<std::string> names;
+    names.reserve(files);
+    for (std::size_t i = 0; i < files; ++i) {
+        if (i % filesPerDirectory == 0) {
+            fs.createDirectory(session, fileName("m", i / filesPerDirectory));
+        }
+        names.push_back(fileName("f", i));
+    }
+    fs.checkpoint();  // Leave the journal buffer empty
+
+    std::int64_t before = heapInUse();
+    for (std::size_t i = 0; i < files; ++i) {
+        if (i % filesPerDirectory == 0) {
+            fs.changeDirectory(session, "/" + fileName("m", i / filesPerDirectory));
+        }
+        fs.createFile(session, names[i], "rw", static_cast<int>(BlockDevice::BLOCK_SIZE));
+    }
+    std::int64_t used = heapInUse() - before;
+    std::cout << std::left << std::setw(20) << "metadata" << std::right << std::setw(10) << files << std::setw(14)
+              << used / static_cast<std::int64_t>(files) << " heap bytes per file\n";
+}
+
+// grep over scale.files files of random words, each holding one token no
+// other file has: a lookup of a token narrows the search to one file, while
+// a term shorter than a trigram reads every file.
+void benchmarkContentSearch(const Scale& scale, const std::string& storagePath) {
+    const std::size_t filesPerDirectory = 1000;
+    FileSystemOptions options;
+    options.storagePath = storagePath;
+    options.capacityBlocks = scale.files * ((scale.contentSize + 64) / BlockDevice::BLOCK_SIZE + 1) + 1024;
+    options.journal.fsyncPolicy = FsyncPolicy::Never;
+
+    std::ostream discard(nullptr);
+    Session session;
+    session.out = &discard;
+    session.verbose = false;
+
+    FileSystem fs(options);
+    std::mt19937_64 random(7);
+    std::string content;
+    for (std::size_t i = 0; i < scale.files; ++i) {
+        if (i % filesPerDirectory == 0) {
+            fs.changeDirectory(session, "/");
+            fs.createDirectory(session, fileName("g", i / filesPerDirectory));
+            fs.changeDirectory(session, fileName("g", i / filesPerDirectory));
+        }
+        content.clear();
+        while (content.size() < scale.contentSize) {
+            content += static_cast<char>('a' + random() % 26);
+            content += static_cast<char>('a' + random() % 26);
+            content += ' ';
+        }
+        content += fileName(" token", i) + " ";
+        fs.createFile(session, fileName("f", i), "rw", content.size());
+        fs.writeFile(session, fileName("f", i), content);
+    }
+    fs.changeDirectory(session, "/");
+
+    measure("grepIndexed", scale.iterations, [&](std::size_t i) {
+        fs.grepContent(session, fileName("token", i % scale.files) + " ", "");
+    });
+    measure("grepScan", std::max<std::size_t>(1, scale.iterations / 100), [&](std::size_t) {
+        fs.grepContent(session, "q", "");
+    });
+}
+
+// allocateFileBlocks and findFreeBlocks are thin wrappers around the
+// allocator; measure it directly at the requested fill ratio.
+void benchmarkAllocator(const Scale& scale) {
+    BlockAllocator allocator(scale.blocks);
+    std::mt19937_64 random(42);
+    std::bernoulli_distribution allocated(scale.fillRatio);
+    for (std::uint64_t block = 0; block < scale.blocks; ++block) {
+        if (allocated(random)) {
+            allocator.reserve({block, 1});
+        }
+    }
+
+    std::uint64_t blocksPerFile = std::max<std::uint64_t>(1, (scale.contentSize + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE);
+    measure("findFreeBlocks", scale.iterations, [&](std::size_t) {
+        allocator.find(blocksPerFile);
+    });
+
+    ExtentList extents;
+    measure("allocateFileBlocks", scale.iterations, [&](std::size_t) {
+        extents = allocator.allocate(blocksPerFile);
+        for (const Extent& extent : extents) {
+            allocator.release(extent);
+        }
+    });
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--files <n>] [--metadata-files <n>] [--depth <n>] [--content <bytes>] [--fill <ratio>] [--blocks <n>]\n"
+              << "       [--iterations <n>] [--rounds <n>] [--fsync always|interval|never] [--dir <path>]\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Scale scale;
+    std::string directory;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            bool hasValue = i + 1 < argc;
+            if (std::strcmp(argv[i], "--files") == 0 && hasValue) {
+                scale.files = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--metadata-files") == 0 && hasValue) {
+                scale.metadataFiles = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--depth") == 0 && hasValue) {
+                scale.depth = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--content") == 0 && hasValue) {
+                scale.contentSize = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--fill") == 0 && hasValue) {
+                scale.fillRatio = std::stod(argv[++i]);
+            } else if (std::strcmp(argv[i], "--blocks") == 0 && hasValue) {
+                scale.blocks = std::stoull(argv[++i]);
+            } else if (std::strcmp(argv[i], "--iterations") == 0 && hasValue) {
+                scale.iterations = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--rounds") == 0 && hasValue) {
+                scale.rounds = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--fsync") == 0 && hasValue) {
+                std::string policy = argv[++i];
+                if (policy == "always") {
+                    scale.fsync = FsyncPolicy::Always;
+                } else if (policy == "interval") {
+                    scale.fsync = FsyncPolicy::Interval;
+                } else if (policy == "never") {
+                    scale.fsync = FsyncPolicy::Never;
+                } else {
+                    throw std::invalid_argument("Unknown fsync policy!");
+                }
+            } else if (std::strcmp(argv[i], "--dir") == 0 && hasValue) {
+                directory = argv[++i];
+            } else {
+                printUsage(argv[0]);
+                return 2;
+            }
+        }
+        if (scale.files == 0 || scale.depth == 0 || scale.contentSize == 0 || scale.fillRatio < 0 || scale.fillRatio >= 1) {
+            throw std::invalid_argument("Scales must be positive and the fill ratio below 1!");
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    bool scratch = directory.empty();
+    if (scratch) {
+        char pattern[] = "/tmp/fms_bench.XXXXXX";
+        if (!::mkdtemp(pattern)) {
+            std::cerr << "Error: Cannot create a scratch directory\n";
+            return 1;
+        }
+        directory = pattern;
+    }
+    std::string storagePath = directory + "/bench";
+
+    std::cout << "files=" << scale.files << " depth=" << scale.depth << " content=" << scale.contentSize << " fill=" << scale.fillRatio
+              << " blocks=" << scale.blocks << " iterations=" << scale.iterations << " rounds=" << scale.rounds << '\n';
+    printHeader();
+
+    int status = 0;
+    try {
+        benchmarkFileSystem(scale, storagePath);
+        benchmarkMetadata(scale, storagePath + "-metadata");
+        benchmarkContentSearch(scale, storagePath + "-grep");
+        benchmarkAllocator(scale);
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        status = 1;
+    }
+
+    for (const char* suffix : {".dat", ".dat.tmp", ".blocks", ".sums", ".journal", ".index", ".index.tmp"}) {
+        for (const char* variant : {"", "-metadata", "-grep"}) {
+            std::remove((storagePath + variant + suffix).c_str());
+        }
+    }
+    if (scratch) {
+        ::rmdir(directory.c_str());
+    }
+    return status;
+}
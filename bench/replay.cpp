@@ -0,0 +1,234 @@
+// Replays a command trace recorded with `file_system --record <trace>`.
+//
+// Every recorded session gets a session of its own, and its commands run in
+// the order they were recorded, either back to back or at the pacing of the
+// original run. With more than one thread the sessions are spread over the
+// threads, so the commands of different sessions run in parallel as they did
+// against a server. The report gives throughput, latency percentiles next to
+// the recorded ones, per-command figures, and every command whose outcome
+// differs from the recording.
+#include "fms.h"
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct ReplayOptions {
+    std::string tracePath;
+    std::string storagePath;    // Empty replays against a fresh file system in a scratch directory
+    std::size_t threads = 1;
+    bool paced = false;         // Keep the recorded gaps between commands
+    double speed = 1.0;         // Divides the recorded gaps when paced
+    std::uint64_t blocks = 0;   // Capacity of a fresh file system; 0 keeps the default
+};
+
+// Outcome of one replayed command, stored at the index of its record.
+struct Result {
+    std::uint64_t latency = 0;  // Nanoseconds
+    bool failed = false;
+    std::string error;
+};
+
+double percentile(std::vector<std::uint64_t>& latencies, double fraction) {
+    if (latencies.empty()) {
+        return 0.0;
+    }
+    std::size_t rank = std::min(latencies.size() - 1, static_cast<std::size_t>(fraction * latencies.size()));
+    std::nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+    return latencies[rank] / 1000.0;
+}
+
+std::string_view commandName(std::string_view command) {
+    std::size_t start = command.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+        return {};
+    }
+    std::size_t end = command.find(' ', start);
+    return command.substr(start, end == std::string_view::npos ? end : end - start);
+}
+
+// Runs the records listed in order, each in the session it was recorded in.
+void replay(FileSystem& fs, const std::vector<TraceRecord>& records, const std::vector<std::size_t>& order,
+            const ReplayOptions& options, Clock::time_point begin, std::vector<Result>& results) {
+    std::ostream discard(nullptr);
+    std::map<std::uint32_t, Session> sessions;
+    for (std::size_t index : order) {
+        const TraceRecord& record = records[index];
+        Session& session = sessions[record.session];
+        session.id = record.session;
+        session.out = &discard;
+        session.verbose = false;
+
+        if (options.paced) {
+            std::this_thread::sleep_until(begin + std::chrono::nanoseconds(static_cast<std::uint64_t>(record.time / options.speed)));
+        }
+        Result& result = results[index];
+        Clock::time_point start = Clock::now();
+        try {
+            fs.executeCommand(session, record.command);
+        } catch (const std::exception& ex) {
+            result.failed = true;
+            result.error = ex.what();
+        }
+        result.latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+}
+
+void report(const std::vector<TraceRecord>& records, const std::vector<Result>& results, double seconds) {
+    std::vector<std::uint64_t> replayed, recorded;
+    std::map<std::string_view, std::vector<std::uint64_t>> byCommand;
+    std::vector<std::size_t> diverged;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        replayed.push_back(results[i].latency);
+        recorded.push_back(records[i].latency);
+        byCommand[commandName(records[i].command)].push_back(results[i].latency);
+        if (results[i].failed != records[i].failed || results[i].error != records[i].error) {
+            diverged.push_back(i);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(0) << records.size() << " commands in " << std::setprecision(3) << seconds << " s, "
+              << std::setprecision(0) << (seconds > 0 ? records.size() / seconds : 0.0) << " ops/s\n\n";
+    std::cout << std::left << std::setw(12) << "latency (us)" << std::right << std::setw(12) << "p50" << std::setw(12) << "p90"
+              << std::setw(12) << "p99" << std::setw(12) << "p99.9" << std::setw(12) << "max" << '\n';
+    for (auto* row : {&replayed, &recorded}) {
+        std::cout << std::left << std::setw(12) << (row == &replayed ? "replayed" : "recorded") << std::right << std::setprecision(2);
+        for (double fraction : {0.5, 0.9, 0.99, 0.999, 1.0}) {
+            std::cout << std::setw(12) << percentile(*row, fraction);
+        }
+        std::cout << '\n';
+    }
+
+    std::cout << '\n' << std::left << std::setw(12) << "command" << std::right << std::setw(10) << "ops" << std::setw(12) << "p50 (us)"
+              << std::setw(12) << "p99 (us)" << '\n';
+    for (auto& entry : byCommand) {
+        std::cout << std::left << std::setw(12) << entry.first << std::right << std::setw(10) << entry.second.size() << std::setw(12)
+                  << percentile(entry.second, 0.5) << std::setw(12) << percentile(entry.second, 0.99) << '\n';
+    }
+
+    std::cout << '\n' << diverged.size() << " diverged\n";
+    const std::size_t shown = 20;
+    for (std::size_t i = 0; i < diverged.size() && i < shown; ++i) {
+        const TraceRecord& record = records[diverged[i]];
+        const Result& result = results[diverged[i]];
+        std::cout << "  #" << diverged[i] + 1 << " session " << record.session << ": " << record.command << "\n"
+                  << "    recorded " << (record.failed ? "ERROR: " + record.error : "OK") << "\n"
+                  << "    replayed " << (result.failed ? "ERROR: " + result.error : "OK") << "\n";
+    }
+    if (diverged.size() > shown) {
+        std::cout << "  ... " << diverged.size() - shown << " more\n";
+    }
+}
+
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <trace> [--threads <n>] [--paced] [--speed <factor>] [--storage <path>] [--blocks <n>]\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    ReplayOptions options;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            bool hasValue = i + 1 < argc;
+            if (std::strcmp(argv[i], "--threads") == 0 && hasValue) {
+                options.threads = std::stoul(argv[++i]);
+            } else if (std::strcmp(argv[i], "--paced") == 0) {
+                options.paced = true;
+            } else if (std::strcmp(argv[i], "--speed") == 0 && hasValue) {
+                options.speed = std::stod(argv[++i]);
+                options.paced = true;
+            } else if (std::strcmp(argv[i], "--storage") == 0 && hasValue) {
+                options.storagePath = argv[++i];
+            } else if (std::strcmp(argv[i], "--blocks") == 0 && hasValue) {
+                options.blocks = std::stoull(argv[++i]);
+            } else if (argv[i][0] != '-' && options.tracePath.empty()) {
+                options.tracePath = argv[i];
+            } else {
+                printUsage(argv[0]);
+                return 2;
+            }
+        }
+        if (options.tracePath.empty() || options.threads == 0 || !(options.speed > 0)) {
+            throw std::invalid_argument("A trace, at least one thread and a positive speed are required!");
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    std::vector<TraceRecord> records;
+    try {
+        records = readTrace(options.tracePath);
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+
+    // Records are written as commands finish; replay them in the order they started
+    std::vector<std::size_t> byTime(records.size());
+    for (std::size_t i = 0; i < byTime.size(); ++i) {
+        byTime[i] = i;
+    }
+    std::stable_sort(byTime.begin(), byTime.end(), [&](std::size_t a, std::size_t b) { return records[a].time < records[b].time; });
+
+    // Deal the sessions out to the threads in the order they first appear
+    std::map<std::uint32_t, std::size_t> threadOf;
+    std::vector<std::vector<std::size_t>> orders(options.threads);
+    for (std::size_t index : byTime) {
+        auto slot = threadOf.emplace(records[index].session, threadOf.size() % options.threads).first;
+        orders[slot->second].push_back(index);
+    }
+
+    std::string directory;
+    if (options.storagePath.empty()) {
+        char pattern[] = "/tmp/fms_replay.XXXXXX";
+        if (!::mkdtemp(pattern)) {
+            std::cerr << "Error: Cannot create a scratch directory\n";
+            return 1;
+        }
+        directory = pattern;
+        options.storagePath = directory + "/replay";
+    }
+
+    int status = 0;
+    try {
+        FileSystemOptions fsOptions;
+        fsOptions.storagePath = options.storagePath;
+        if (options.blocks > 0) {
+            fsOptions.capacityBlocks = options.blocks;
+        }
+        FileSystem fs(fsOptions);
+
+        std::vector<Result> results(records.size());
+        Clock::time_point begin = Clock::now();
+        std::vector<std::thread> workers;
+        for (std::size_t t = 1; t < orders.size(); ++t) {
+            workers.emplace_back([&, t]() { replay(fs, records, orders[t], options, begin, results); });
+        }
+        replay(fs, records, orders[0], options, begin, results);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        report(records, results, seconds);
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        status = 1;
+    }
+
+    if (!directory.empty()) {
+        for (const char* suffix : {".dat", ".dat.tmp", ".blocks", ".sums", ".journal", ".index", ".index.tmp"}) {
+            std::remove((options.storagePath + suffix).c_str());
+        }
+        ::rmdir(directory.c_str());
+    }
+    return status;
+}
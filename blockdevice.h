@@ -0,0 +1,661 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <iterator>
+#include <initializer_list>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include "crc32c.h"
+#include "status.h"
+
+// Run of physically contiguous blocks, or a hole: a run of blocks of a
+// sparse file that were never written, have no device blocks and read as zeros.
+struct Extent {
+    static constexpr std::uint64_t HOLE = ~0ULL;  // Start of a hole
+
+    std::uint64_t start;
+    std::uint64_t length;
+
+    bool hole() const { return start == HOLE; }
+};
+
+// Extents of one file. Next-fit allocation gives most files a single
+// extent, which is stored in place of the heap pointer, so such files need
+// no allocation for their block list and the list is as small as a vector.
+class ExtentList {
+public:
+    ExtentList() = default;
+
+    ExtentList(std::initializer_list<Extent> extents) {
+        assign(extents.begin(), extents.end());
+    }
+
+    ExtentList(const ExtentList& other) {
+        assign(other.begin(), other.end());
+    }
+
+    ExtentList(ExtentList&& other) noexcept {
+        steal(other);
+    }
+
+    ExtentList& operator=(const ExtentList& other) {
+        if (this != &other) {
+            assign(other.begin(), other.end());
+        }
+        return *this;
+    }
+
+    ExtentList& operator=(ExtentList&& other) noexcept {
+        if (this != &other) {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    ~ExtentList() {
+        release();
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    Extent* data() { return capacity > INLINE ? heap : single; }
+    const Extent* data() const { return capacity > INLINE ? heap : single; }
+    Extent* begin() { return data(); }
+    Extent* end() { return data() + count; }
+    const Extent* begin() const { return data(); }
+    const Extent* end() const { return data() + count; }
+    Extent& operator[](std::size_t i) { return data()[i]; }
+    const Extent& operator[](std::size_t i) const { return data()[i]; }
+    Extent& back() { return data()[count - 1]; }
+    const Extent& back() const { return data()[count - 1]; }
+
+    void push_back(const Extent& extent) {
+        if (count == capacity) {
+            grow(capacity * 2);
+        }
+        data()[count++] = extent;
+    }
+
+    template <typename It>
+    void assign(It first, It last) {
+        std::size_t size = static_cast<std::size_t>(std::distance(first, last));
+        count = 0;
+        if (size > capacity) {
+            grow(size);
+        }
+        std::copy(first, last, data());
+        count = static_cast<std::uint32_t>(size);
+    }
+
+    void clear() { count = 0; }
+
+private:
+    static const std::uint32_t INLINE = 1;
+    union {
+        Extent single[INLINE];
+        Extent* heap;
+    };
+    std::uint32_t count = 0;
+    std::uint32_t capacity = INLINE;
+
+    void grow(std::size_t wanted) {
+        Extent* larger = new Extent[wanted];
+        std::copy(begin(), end(), larger);
+        release();
+        heap = larger;
+        capacity = static_cast<std::uint32_t>(wanted);
+    }
+
+    void release() {
+        if (capacity > INLINE) {
+            delete[] heap;
+            capacity = INLINE;
+        }
+    }
+
+    void steal(ExtentList& other) {
+        count = other.count;
+        capacity = other.capacity;
+        if (other.capacity > INLINE) {
+            heap = other.heap;
+        } else {
+            std::copy(other.single, other.single + other.count, single);
+        }
+        other.count = 0;
+        other.capacity = INLINE;
+    }
+};
+
+// Logical blocks covered by extents, holes included.
+inline std::uint64_t blockCount(const ExtentList& extents) {
+    std::uint64_t blocks = 0;
+    for (const Extent& extent : extents) {
+        blocks += extent.length;
+    }
+    return blocks;
+}
+
+// Appends run to extents, merged into the last extent when both are holes or
+// the run continues it on the device.
+inline void appendRun(ExtentList& extents, const Extent& run) {
+    if (run.length == 0) {
+        return;
+    }
+    if (!extents.empty()) {
+        Extent& last = extents.back();
+        if (last.hole() ? run.hole() : !run.hole() && last.start + last.length == run.start) {
+            last.length += run.length;
+            return;
+        }
+    }
+    extents.push_back(run);
+}
+
+// Logical blocks [first, end) of extents, cut off at their end.
+inline ExtentList sliceExtents(const ExtentList& extents, std::uint64_t first, std::uint64_t end) {
+    ExtentList slice;
+    std::uint64_t logical = 0;
+    for (const Extent& extent : extents) {
+        std::uint64_t from = std::max(first, logical);
+        std::uint64_t to = std::min(end, logical + extent.length);
+        if (from < to) {
+            appendRun(slice, {extent.hole() ? Extent::HOLE : extent.start + (from - logical), to - from});
+        }
+        logical += extent.length;
+    }
+    return slice;
+}
+
+// Runs of logical blocks in [first, end) without a device block, as
+// (first block, count); blocks past the end of extents count as holes.
+inline std::vector<Extent> holesIn(const ExtentList& extents, std::uint64_t first, std::uint64_t end) {
+    std::vector<Extent> holes;
+    std::uint64_t logical = 0;
+    for (const Extent& extent : extents) {
+        std::uint64_t from = std::max(first, logical);
+        std::uint64_t to = std::min(end, logical + extent.length);
+        if (extent.hole() && from < to) {
+            holes.push_back({from, to - from});
+        }
+        logical += extent.length;
+    }
+    if (logical < end) {
+        std::uint64_t from = std::max(first, logical);
+        if (!holes.empty() && holes.back().start + holes.back().length == from) {
+            holes.back().length += end - from;
+        } else {
+            holes.push_back({from, end - from});
+        }
+    }
+    return holes;
+}
+
+// Extents with the holes in logical blocks [first, end) filled, in order,
+// by the device blocks of fresh, which must hold exactly as many blocks.
+// The result covers at least end blocks.
+inline ExtentList fillHoles(const ExtentList& extents, std::uint64_t first, std::uint64_t end, const ExtentList& fresh) {
+    ExtentList filled;
+    std::size_t next = 0;       // Extent of fresh being used
+    std::uint64_t used = 0;     // Blocks of it already used
+    auto take = [&](std::uint64_t count) {
+        while (count > 0) {
+            std::uint64_t run = std::min(count, fresh[next].length - used);
+            appendRun(filled, {fresh[next].start + used, run});
+            count -= run;
+            used += run;
+            if (used == fresh[next].length) {
+                ++next;
+                used = 0;
+            }
+        }
+    };
+
+    std::uint64_t logical = 0;
+    for (const Extent& extent : extents) {
+        std::uint64_t extentEnd = logical + extent.length;
+        if (!extent.hole() || extentEnd <= first || logical >= end) {
+            appendRun(filled, extent);
+        } else {
+            std::uint64_t from = std::max(first, logical);
+            std::uint64_t to = std::min(end, extentEnd);
+            appendRun(filled, {Extent::HOLE, from - logical});
+            take(to - from);
+            appendRun(filled, {Extent::HOLE, extentEnd - to});
+        }
+        logical = extentEnd;
+    }
+    if (logical < end) {
+        appendRun(filled, {Extent::HOLE, first > logical ? first - logical : 0});
+        take(end - std::max(first, logical));
+    }
+    return filled;
+}
+
+// Backing store made of fixed-size blocks. Block n lives at byte offset
+// n * BLOCK_SIZE of the device file; blocks that were never written read as zeros.
+//
+// Every block written has a CRC32C in the checksum file, checked whenever
+// the block is read. An entry holds the checksums of the last two contents
+// of its block and is written before the block, so a write cut short
+// between the two still verifies: the block matches one or the other.
+// Blocks without an entry, never written or not yet resealed after a
+// copy, are not checked.
+class BlockDevice {
+public:
+    static const std::size_t BLOCK_SIZE = 1024;
+
+    BlockDevice(const std::string& path, const std::string& checksumPath) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open the block device!");
+        }
+        sumsFd = ::open(checksumPath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (sumsFd < 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to open the block checksums!");
+        }
+    }
+
+    ~BlockDevice() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (sumsFd >= 0) {
+            ::close(sumsFd);
+        }
+    }
+
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+
+    // Loads the checksums of blocks [0, blocks). Runs at startup, once the
+    // capacity is known and before the device is shared between threads;
+    // the capacity only grows.
+    void setCapacity(std::uint64_t blocks) {
+        if (blocks <= sumCount) {
+            return;
+        }
+        std::unique_ptr<std::atomic<std::uint64_t>[]> grown(new std::atomic<std::uint64_t>[blocks]);
+        std::vector<std::uint64_t> stored(blocks, 0);
+        readFully(sumsFd, 0, reinterpret_cast<char*>(stored.data()), blocks * sizeof(std::uint64_t));
+        for (std::uint64_t i = 0; i < blocks; ++i) {
+            grown[i].store(stored[i], std::memory_order_relaxed);
+        }
+        sums = std::move(grown);
+        sumCount = blocks;
+    }
+
+    // Reads length bytes starting at byte offset of the data stored in extents.
+    // Each extent is read with a single call; holes read as zeros. The
+    // blocks at the edges of the range are read whole to verify them.
+    void read(const ExtentList& extents, std::size_t offset, char* out, std::size_t length) const {
+        forEachRun(extents, offset, length, [&](off_t position, std::size_t size) {
+            if (position == NO_POSITION) {
+                std::memset(out, 0, size);
+            } else if (position % BLOCK_SIZE == 0 && size % BLOCK_SIZE == 0) {
+                readBlocks(static_cast<std::uint64_t>(position) / BLOCK_SIZE, size / BLOCK_SIZE, out);
+            } else {
+                std::uint64_t first = static_cast<std::uint64_t>(position) / BLOCK_SIZE;
+                std::uint64_t end = (static_cast<std::uint64_t>(position) + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                std::vector<char> blocks((end - first) * BLOCK_SIZE);
+                readBlocks(first, end - first, blocks.data());
+                std::memcpy(out, blocks.data() + (position - first * BLOCK_SIZE), size);
+            }
+            out += size;
+        });
+    }
+
+    // The range must not touch a hole; blocks are allocated before they are written.
+    void write(const ExtentList& extents, std::size_t offset, const char* data, std::size_t length) {
+        resealing(extents, offset, length, [&]() {
+            forEachRun(extents, offset, length, [&](off_t position, std::size_t size) {
+                writeAt(checkAllocated(position), data, size);
+                data += size;
+            });
+        });
+    }
+
+    // Reads count whole blocks starting at block start. Throws a Corrupted
+    // FileSystemError when a block does not match its checksum.
+    void readBlocks(std::uint64_t start, std::uint64_t count, char* out) const {
+        std::uint64_t valid = readValidBlocks(start, count, out);
+        if (valid < count) {
+            throw corruptBlock(start + valid);
+        }
+    }
+
+    // Reads count whole blocks starting at block start and returns how many
+    // of them, from the first, match their checksums.
+    std::uint64_t readValidBlocks(std::uint64_t start, std::uint64_t count, char* out) const {
+        readAt(static_cast<off_t>(start * BLOCK_SIZE), out, count * BLOCK_SIZE);
+        for (std::uint64_t i = 0; i < count; ++i) {
+            if (!verify(start + i, out + i * BLOCK_SIZE)) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    static FileSystemError corruptBlock(std::uint64_t block) {
+        return FileSystemError(Status::Corrupted, "Checksum mismatch in block " + std::to_string(block) + "!");
+    }
+
+    // Reads blocks [start, start + count) into buffer, which is resized to
+    // fit, and returns the ones that do not match their checksums.
+    std::vector<std::uint64_t> scrubBlocks(std::uint64_t start, std::uint64_t count, std::vector<char>& buffer) const {
+        buffer.resize(count * BLOCK_SIZE);
+        readAt(static_cast<off_t>(start * BLOCK_SIZE), buffer.data(), count * BLOCK_SIZE);
+        std::vector<std::uint64_t> bad;
+        for (std::uint64_t i = 0; i < count; ++i) {
+            if (!verify(start + i, buffer.data() + i * BLOCK_SIZE)) {
+                bad.push_back(start + i);
+            }
+        }
+        return bad;
+    }
+
+    // Whether block has a checksum to verify against.
+    bool hasChecksum(std::uint64_t block) const {
+        return block < sumCount && static_cast<std::uint32_t>(sums[block].load(std::memory_order_relaxed)) != 0;
+    }
+
+    // Writes contiguous blocks starting at block start, gathered from one
+    // buffer per block. Their checksums are written first.
+    void writeBlocks(std::uint64_t start, const std::vector<const char*>& blocks) {
+        if (start < sumCount) {
+            std::size_t covered = static_cast<std::size_t>(std::min<std::uint64_t>(blocks.size(), sumCount - start));
+            std::vector<std::uint64_t> entries(covered);
+            for (std::size_t i = 0; i < covered; ++i) {
+                std::uint64_t previous = sums[start + i].load(std::memory_order_relaxed);
+                std::uint64_t current = static_cast<std::uint32_t>(previous);
+                entries[i] = (current == 0 ? zeroChecksum() : current) << 32 | checksum(blocks[i]);
+            }
+            storeSums(start, entries);
+        }
+
+        std::vector<iovec> vectors;
+        std::size_t done = 0;
+        while (done < blocks.size()) {
+            std::size_t count = std::min<std::size_t>(blocks.size() - done, IOV_LIMIT);
+            vectors.resize(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                vectors[i].iov_base = const_cast<char*>(blocks[done + i]);
+                vectors[i].iov_len = BLOCK_SIZE;
+            }
+
+            off_t position = static_cast<off_t>((start + done) * BLOCK_SIZE);
+            std::size_t remaining = count * BLOCK_SIZE;
+            iovec* vector = vectors.data();
+            while (remaining > 0) {
+                ssize_t n = ::pwritev(fd, vector, static_cast<int>(count - (vector - vectors.data())), position);
+                if (n < 0) {
+                    throw std::runtime_error("Failed to write to the block device!");
+                }
+                position += n;
+                remaining -= static_cast<std::size_t>(n);
+                // Skip the buffers written in full and trim a partly written one
+                while (n > 0 && static_cast<std::size_t>(n) >= vector->iov_len) {
+                    n -= vector->iov_len;
+                    ++vector;
+                }
+                if (n > 0) {
+                    vector->iov_base = static_cast<char*>(vector->iov_base) + n;
+                    vector->iov_len -= n;
+                }
+            }
+            done += count;
+        }
+    }
+
+    // Copies length bytes from position source of the host file in, into the
+    // data stored in extents starting at byte offset. The kernel moves the
+    // bytes with copy_file_range where both files allow it; otherwise they go
+    // through a bounded buffer.
+    void copyFrom(int in, off_t source, const ExtentList& extents, std::size_t offset, std::size_t length) {
+        resealing(extents, offset, length, [&]() {
+            forEachRun(extents, offset, length, [&](off_t position, std::size_t size) {
+                copyRange(in, source, fd, checkAllocated(position), size);
+                source += static_cast<off_t>(size);
+            });
+        });
+    }
+
+    // Copies a byte range of the data stored in extents to the host file out,
+    // starting at position target. Holes are written out as zeros.
+    void copyTo(const ExtentList& extents, std::size_t offset, std::size_t length, int out, off_t target) const {
+        forEachRun(extents, offset, length, [&](off_t position, std::size_t size) {
+            if (position == NO_POSITION) {
+                std::vector<char> zeros(std::min(size, COPY_BUFFER_SIZE));
+                for (std::size_t done = 0; done < size;) {
+                    std::size_t chunk = std::min(size - done, zeros.size());
+                    ssize_t n = ::pwrite(out, zeros.data(), chunk, target + static_cast<off_t>(done));
+                    if (n < 0) {
+                        throw std::runtime_error("Failed to copy file content!");
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+            } else {
+                copyRange(fd, position, out, target, size);
+            }
+            target += static_cast<off_t>(size);
+        });
+    }
+
+    void sync() {
+        if (::fdatasync(fd) != 0 || ::fdatasync(sumsFd) != 0) {
+            throw std::runtime_error("Failed to sync the block device!");
+        }
+    }
+
+private:
+    static constexpr std::size_t IOV_LIMIT = 1024;  // Buffers per pwritev call
+    static constexpr std::size_t COPY_BUFFER_SIZE = 1024 * 1024;  // Chunk size when the kernel cannot copy for us
+    static constexpr std::size_t RESEAL_BLOCKS = 1024;  // Blocks read back at a time to checksum a copy
+    static constexpr off_t NO_POSITION = -1;  // Passed by forEachRun for a hole
+    int fd = -1;
+    int sumsFd = -1;
+    // Per block, the checksum of its previous content in the high half and
+    // of its current content in the low half; 0 when it has none
+    std::unique_ptr<std::atomic<std::uint64_t>[]> sums;
+    std::uint64_t sumCount = 0;
+
+    // Checksum of a block as stored; 0 is kept to mean "none".
+    static std::uint64_t checksum(const char* block) {
+        std::uint32_t sum = crc32c::compute(block, BLOCK_SIZE);
+        return sum == 0 ? 1 : sum;
+    }
+
+    // A block without a checksum was never written and reads as zeros.
+    static std::uint64_t zeroChecksum() {
+        static const char zeros[BLOCK_SIZE] = {};
+        static const std::uint64_t sum = checksum(zeros);
+        return sum;
+    }
+
+    bool verify(std::uint64_t block, const char* data) const {
+        if (block >= sumCount) {
+            return true;
+        }
+        std::uint64_t entry = sums[block].load(std::memory_order_relaxed);
+        std::uint64_t current = static_cast<std::uint32_t>(entry);
+        if (current == 0) {
+            return true;
+        }
+        std::uint64_t sum = checksum(data);
+        return sum == current || sum == entry >> 32;
+    }
+
+    // Records entries for blocks [start, start + entries.size()) in memory
+    // and in the checksum file.
+    void storeSums(std::uint64_t start, const std::vector<std::uint64_t>& entries) {
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            sums[start + i].store(entries[i], std::memory_order_relaxed);
+        }
+        const char* bytes = reinterpret_cast<const char*>(entries.data());
+        std::size_t size = entries.size() * sizeof(std::uint64_t);
+        off_t position = static_cast<off_t>(start * sizeof(std::uint64_t));
+        for (std::size_t done = 0; done < size;) {
+            ssize_t n = ::pwrite(sumsFd, bytes + done, size - done, position + static_cast<off_t>(done));
+            if (n < 0) {
+                throw std::runtime_error("Failed to write the block checksums!");
+            }
+            done += static_cast<std::size_t>(n);
+        }
+    }
+
+    // Runs a write that bypasses writeBlocks. The checksums of the blocks it
+    // touches are dropped first, so a crash during the write leaves them
+    // unchecked rather than wrong, and computed again from the device after.
+    template <typename Write>
+    void resealing(const ExtentList& extents, std::size_t offset, std::size_t length, Write doWrite) {
+        std::vector<Extent> runs;
+        forEachRun(extents, offset, length, [&](off_t position, std::size_t size) {
+            std::uint64_t first = static_cast<std::uint64_t>(checkAllocated(position)) / BLOCK_SIZE;
+            std::uint64_t end = (static_cast<std::uint64_t>(position) + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            end = std::min(end, sumCount);
+            if (first < end) {
+                runs.push_back({first, end - first});
+            }
+        });
+        for (const Extent& run : runs) {
+            storeSums(run.start, std::vector<std::uint64_t>(run.length, 0));
+        }
+
+        doWrite();
+
+        std::vector<char> buffer;
+        for (const Extent& run : runs) {
+            for (std::uint64_t done = 0; done < run.length;) {
+                std::uint64_t count = std::min<std::uint64_t>(run.length - done, RESEAL_BLOCKS);
+                buffer.resize(count * BLOCK_SIZE);
+                readAt(static_cast<off_t>((run.start + done) * BLOCK_SIZE), buffer.data(), buffer.size());
+                std::vector<std::uint64_t> entries(count);
+                for (std::uint64_t i = 0; i < count; ++i) {
+                    entries[i] = zeroChecksum() << 32 | checksum(buffer.data() + i * BLOCK_SIZE);
+                }
+                storeSums(run.start + done, entries);
+                done += count;
+            }
+        }
+    }
+
+    // Reads up to size bytes of file fd at position; the rest is zeros.
+    static void readFully(int file, off_t position, char* out, std::size_t size) {
+        std::size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::pread(file, out + done, size - done, position + static_cast<off_t>(done));
+            if (n < 0) {
+                throw std::runtime_error("Failed to read from the block device!");
+            }
+            if (n == 0) {
+                std::memset(out + done, 0, size - done);
+                break;
+            }
+            done += static_cast<std::size_t>(n);
+        }
+    }
+
+    static off_t checkAllocated(off_t position) {
+        if (position == NO_POSITION) {
+            throw std::out_of_range("Write to blocks that are not allocated!");
+        }
+        return position;
+    }
+
+    void readAt(off_t position, char* out, std::size_t size) const {
+        readFully(fd, position, out, size);  // Past the end of the device file reads as zeros
+    }
+
+    void writeAt(off_t position, const char* data, std::size_t size) {
+        std::size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::pwrite(fd, data + done, size - done, position + static_cast<off_t>(done));
+            if (n < 0) {
+                throw std::runtime_error("Failed to write to the block device!");
+            }
+            done += static_cast<std::size_t>(n);
+        }
+    }
+
+    // Copies size bytes between two files at explicit positions. A source
+    // that ends early is padded with zeros, as if the device file were longer.
+    static void copyRange(int in, off_t from, int out, off_t to, std::size_t size) {
+        while (size > 0) {
+            loff_t inPosition = from, outPosition = to;
+            ssize_t n = ::copy_file_range(in, &inPosition, out, &outPosition, size, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;  // Not supported between these files
+            }
+            if (n < 0) {
+                throw std::runtime_error("Failed to copy file content!");
+            }
+            if (n == 0) {
+                break;  // End of the source; the buffered copy pads the rest
+            }
+            from += n;
+            to += n;
+            size -= static_cast<std::size_t>(n);
+        }
+
+        std::vector<char> buffer(std::min(size, COPY_BUFFER_SIZE));
+        while (size > 0) {
+            std::size_t chunk = std::min(size, buffer.size());
+            std::size_t done = 0;
+            while (done < chunk) {
+                ssize_t n = ::pread(in, buffer.data() + done, chunk - done, from + static_cast<off_t>(done));
+                if (n < 0) {
+                    throw std::runtime_error("Failed to copy file content!");
+                }
+                if (n == 0) {
+                    std::memset(buffer.data() + done, 0, chunk - done);
+                    break;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            for (done = 0; done < chunk;) {
+                ssize_t n = ::pwrite(out, buffer.data() + done, chunk - done, to + static_cast<off_t>(done));
+                if (n < 0) {
+                    throw std::runtime_error("Failed to copy file content!");
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            from += static_cast<off_t>(chunk);
+            to += static_cast<off_t>(chunk);
+            size -= chunk;
+        }
+    }
+
+    // Splits a byte range of the data stored in extents into device
+    // positions, with NO_POSITION for the parts that fall in a hole.
+    template <typename Io>
+    static void forEachRun(const ExtentList& extents, std::size_t offset, std::size_t length, Io io) {
+        for (const Extent& extent : extents) {
+            if (length == 0) {
+                break;
+            }
+            std::size_t extentBytes = extent.length * BLOCK_SIZE;
+            if (offset >= extentBytes) {
+                offset -= extentBytes;
+                continue;
+            }
+
+            std::size_t size = std::min(length, extentBytes - offset);
+            io(extent.hole() ? NO_POSITION : static_cast<off_t>(extent.start * BLOCK_SIZE + offset), size);
+            offset = 0;
+            length -= size;
+        }
+
+        if (length > 0) {
+            throw std::out_of_range("Access beyond the allocated blocks!");
+        }
+    }
+};
@@ -0,0 +1,446 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "blockdevice.h"
+
+struct BufferCacheOptions {
+    std::size_t capacityBytes = 8 * 1024 * 1024;  // Memory for cached blocks; rounded to whole blocks, at least one per shard
+    std::size_t readAheadBlocks = 32;             // Blocks loaded past a sequential read that misses
+};
+
+// Bounded write-back cache of device blocks in front of a BlockDevice.
+//
+// Blocks are cached whole and evicted with the CLOCK algorithm. Writes only
+// change the cached copy and mark it dirty; dirty blocks reach the device when
+// they are evicted or when flush() runs, which the file system does before
+// journal records are written and at every checkpoint. A read that misses
+// loads the rest of the requested range within the extent with a single
+// read, plus a read-ahead window when the access looks sequential.
+//
+// The cache is split into shards by block number, each with its own lock,
+// frames and clock hand, so threads touching different blocks rarely meet.
+class BufferCache {
+public:
+    static const std::size_t BLOCK_SIZE = BlockDevice::BLOCK_SIZE;
+
+    struct Counters {
+        std::uint64_t capacityBlocks = 0;
+        std::uint64_t cachedBlocks = 0;
+        std::uint64_t dirtyBlocks = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;         // Blocks read from the device for a request
+        std::uint64_t evictions = 0;
+        std::uint64_t writeBacks = 0;     // Dirty blocks written to the device
+        std::uint64_t readAheadBlocks = 0;
+    };
+
+    BufferCache(BlockDevice& device, const BufferCacheOptions& options) : device(device) {
+        std::size_t blocks = std::max<std::size_t>(1, options.capacityBytes / BLOCK_SIZE);
+        shardCount = std::min(MAX_SHARDS, blocks);
+        shards.reset(new Shard[shardCount]);
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            std::size_t frames = blocks / shardCount + (i < blocks % shardCount ? 1 : 0);
+            shards[i].frames.resize(frames);
+            shards[i].data.reset(new char[frames * BLOCK_SIZE]);
+        }
+        // A read-ahead window larger than a fraction of the cache would evict itself
+        readAhead = std::min(options.readAheadBlocks, blocks / 4);
+    }
+
+    BufferCache(const BufferCache&) = delete;
+    BufferCache& operator=(const BufferCache&) = delete;
+
+    // Same contract as BlockDevice::read, served from the cache where possible.
+    void read(const ExtentList& extents, std::size_t offset, char* out, std::size_t length) {
+        if (length == 0) {
+            return;
+        }
+        checkRange(extents, offset, length);
+        Cursor cursor(extents, offset / BLOCK_SIZE);
+        std::uint64_t endBlock = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        while (cursor.logical < endBlock) {
+            if (cursor.hole()) {
+                std::uint64_t count = std::min(cursor.left(), endBlock - cursor.logical);
+                for (std::uint64_t i = 0; i < count; ++i) {
+                    copyOut(cursor.logical + i, ZEROS, offset, out, length);
+                }
+                cursor.advance(count);
+                continue;
+            }
+            std::uint64_t physical = cursor.physical();
+            if (lookup(physical, [&](const char* cached) { copyOut(cursor.logical, cached, offset, out, length); })) {
+                cursor.advance(1);
+                continue;
+            }
+
+            // Load the rest of the request within this extent with one read
+            std::uint64_t wanted = std::min(cursor.left(), endBlock - cursor.logical);
+            std::uint64_t count = wanted;
+            if (cursor.logical == 0 || contains(cursor.previous)) {
+                count = std::min(cursor.left(), wanted + readAhead);
+            }
+            count = std::min<std::uint64_t>(count, MAX_RUN_BLOCKS);
+            wanted = std::min(wanted, count);
+
+            // A corrupt block fails the request only if it was asked for
+            std::vector<char> run(count * BLOCK_SIZE);
+            std::uint64_t valid = device.readValidBlocks(physical, count, run.data());
+            if (valid < wanted) {
+                throw BlockDevice::corruptBlock(physical + valid);
+            }
+            count = valid;
+            for (std::uint64_t i = 0; i < count; ++i) {
+                std::uint64_t logical = cursor.logical + i;
+                install(physical + i, run.data() + i * BLOCK_SIZE, i >= wanted, [&](const char* cached) {
+                    if (i < wanted) {
+                        copyOut(logical, cached, offset, out, length);
+                    }
+                });
+            }
+            cursor.advance(wanted);
+        }
+    }
+
+    // Same contract as BlockDevice::write, holes included. Only the cached
+    // copies change.
+    void write(const ExtentList& extents, std::size_t offset, const char* data, std::size_t length) {
+        if (length == 0) {
+            return;
+        }
+        checkRange(extents, offset, length);
+        Cursor cursor(extents, offset / BLOCK_SIZE);
+        std::uint64_t endBlock = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        for (; cursor.logical < endBlock; cursor.advance(1)) {
+            std::uint64_t blockStart = cursor.logical * BLOCK_SIZE;
+            std::size_t from = std::max<std::uint64_t>(offset, blockStart) - blockStart;
+            std::size_t to = std::min<std::uint64_t>(offset + length, blockStart + BLOCK_SIZE) - blockStart;
+            if (cursor.hole()) {
+                throw std::out_of_range("Write to blocks that are not allocated!");
+            }
+            std::uint64_t physical = cursor.physical();
+
+            Shard& shard = shardOf(physical);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            auto found = shard.index.find(physical);
+            std::size_t frame;
+            if (found != shard.index.end()) {
+                frame = found->second;
+                ++shard.hits;
+            } else {
+                frame = claim(shard, physical);
+                if (from > 0 || to < BLOCK_SIZE) {
+                    // A partial write needs the rest of the block
+                    device.readBlocks(physical, 1, shard.block(frame));
+                    ++shard.misses;
+                }
+            }
+
+            std::memcpy(shard.block(frame) + from, data + (blockStart + from - offset), to - from);
+            Frame& entry = shard.frames[frame];
+            entry.referenced = true;
+            if (!entry.dirty) {
+                entry.dirty = true;
+                shard.dirty.push_back(frame);
+                ++shard.dirtyCount;
+            }
+        }
+    }
+
+    // Writes every dirty block to the device, coalescing adjacent blocks into
+    // one write. Waits for all shards, so it sees a consistent set of blocks.
+    void flush() {
+        std::vector<std::unique_lock<std::mutex>> guards;
+        guards.reserve(shardCount);
+        std::vector<std::pair<std::uint64_t, const char*>> blocks;
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            Shard& shard = shards[i];
+            guards.emplace_back(shard.mutex);
+            for (std::size_t frame : shard.dirty) {
+                Frame& entry = shard.frames[frame];
+                if (entry.dirty) {  // Eviction may have written it back already
+                    blocks.emplace_back(entry.block, shard.block(frame));
+                }
+            }
+        }
+
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());  // A frame may be listed twice
+        std::vector<const char*> run;
+        for (std::size_t i = 0; i <= blocks.size(); ++i) {
+            if (!run.empty() && (i == blocks.size() || blocks[i].first != blocks[i - 1].first + 1)) {
+                device.writeBlocks(blocks[i - run.size()].first, run);
+                run.clear();
+            }
+            if (i < blocks.size()) {
+                run.push_back(blocks[i].second);
+            }
+        }
+
+        // Only forget the dirty frames once they are all on the device
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            Shard& shard = shards[i];
+            for (std::size_t frame : shard.dirty) {
+                shard.frames[frame].dirty = false;
+            }
+            shard.writeBacks += shard.dirtyCount;
+            shard.dirty.clear();
+            shard.dirtyCount = 0;
+        }
+    }
+
+    // Writes the dirty blocks of a byte range to the device, so the caller
+    // can read the range from the device directly.
+    void writeBack(const ExtentList& extents, std::size_t offset, std::size_t length) {
+        forEachCached(extents, offset, length, [&](Shard& shard, std::size_t frame) {
+            Frame& entry = shard.frames[frame];
+            if (entry.dirty) {
+                device.writeBlocks(entry.block, {shard.block(frame)});
+                entry.dirty = false;
+                --shard.dirtyCount;
+                ++shard.writeBacks;
+            }
+        });
+    }
+
+    // Forgets the cached copies of a byte range, dirty or not, because the
+    // caller is about to overwrite the range on the device directly.
+    void discard(const ExtentList& extents, std::size_t offset, std::size_t length) {
+        forEachCached(extents, offset, length, [&](Shard& shard, std::size_t frame) {
+            Frame& entry = shard.frames[frame];
+            if (entry.dirty) {
+                --shard.dirtyCount;
+            }
+            shard.index.erase(entry.block);
+            entry = Frame();
+            shard.freeFrames.push_back(frame);
+        });
+    }
+
+    // Flushes, then makes the device durable.
+    void sync() {
+        flush();
+        device.sync();
+    }
+
+    Counters counters() const {
+        Counters total;
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            const Shard& shard = shards[i];
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            total.capacityBlocks += shard.frames.size();
+            total.cachedBlocks += shard.index.size();
+            total.dirtyBlocks += shard.dirtyCount;
+            total.hits += shard.hits;
+            total.misses += shard.misses;
+            total.evictions += shard.evictions;
+            total.writeBacks += shard.writeBacks;
+            total.readAheadBlocks += shard.readAheadBlocks;
+        }
+        return total;
+    }
+
+private:
+    static constexpr std::size_t MAX_SHARDS = 16;
+    static constexpr std::uint64_t MAX_RUN_BLOCKS = 256;  // Largest single read on a miss
+    static const std::uint64_t NO_BLOCK = ~0ULL;
+    static constexpr char ZEROS[BLOCK_SIZE] = {};  // What a block of a hole reads as
+
+    struct Frame {
+        std::uint64_t block = NO_BLOCK;
+        bool referenced = false;  // Second chance for the clock hand
+        bool dirty = false;
+    };
+
+    // Counters live in the shard and change under its lock, so they cost no
+    // extra atomic operations.
+    struct Shard {
+        mutable std::mutex mutex;
+        std::vector<Frame> frames;
+        std::unique_ptr<char[]> data;  // BLOCK_SIZE bytes per frame, touched only once used
+        std::unordered_map<std::uint64_t, std::size_t> index;  // Block -> frame
+        std::vector<std::size_t> dirty;  // Frames dirtied since the last flush; may hold stale entries
+        std::size_t used = 0;            // Frames handed out so far
+        std::vector<std::size_t> freeFrames;  // Frames emptied by discard()
+        std::size_t hand = 0;
+        std::uint64_t dirtyCount = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t writeBacks = 0;
+        std::uint64_t readAheadBlocks = 0;
+
+        char* block(std::size_t frame) { return data.get() + frame * BLOCK_SIZE; }
+    };
+
+    // Walks the blocks of a file in logical order, tracking where each lives.
+    struct Cursor {
+        const ExtentList& extents;
+        std::size_t extent = 0;
+        std::uint64_t inExtent = 0;
+        std::uint64_t logical;
+        std::uint64_t previous = NO_BLOCK;  // Device block of logical - 1
+
+        Cursor(const ExtentList& extents, std::uint64_t logical) : extents(extents), logical(logical) {
+            std::uint64_t skip = logical;
+            while (extent < extents.size() && skip >= extents[extent].length) {
+                skip -= extents[extent].length;
+                previous = extents[extent].hole() ? NO_BLOCK : extents[extent].start + extents[extent].length - 1;
+                ++extent;
+            }
+            inExtent = skip;
+            if (skip > 0) {
+                previous = hole() ? NO_BLOCK : extents[extent].start + skip - 1;
+            }
+        }
+
+        bool hole() const { return extents[extent].hole(); }
+        std::uint64_t physical() const { return extents[extent].start + inExtent; }
+        std::uint64_t left() const { return extents[extent].length - inExtent; }  // Blocks to the end of the extent
+
+        void advance(std::uint64_t blocks) {
+            previous = hole() ? NO_BLOCK : physical() + blocks - 1;
+            logical += blocks;
+            inExtent += blocks;
+            if (inExtent == extents[extent].length) {
+                ++extent;
+                inExtent = 0;
+            }
+        }
+    };
+
+    BlockDevice& device;
+    std::unique_ptr<Shard[]> shards;
+    std::size_t shardCount = 0;
+    std::size_t readAhead = 0;
+
+    static void checkRange(const ExtentList& extents, std::size_t offset, std::size_t length) {
+        std::uint64_t blocks = 0;
+        for (const Extent& extent : extents) {
+            blocks += extent.length;
+        }
+        if (offset + length > blocks * BLOCK_SIZE) {
+            throw std::out_of_range("Access beyond the allocated blocks!");
+        }
+    }
+
+    // Calls visit with the frame of every cached block in a byte range, while
+    // the block's shard is locked. Holes have nothing cached.
+    template <typename Visit>
+    void forEachCached(const ExtentList& extents, std::size_t offset, std::size_t length, Visit visit) {
+        if (length == 0) {
+            return;
+        }
+        checkRange(extents, offset, length);
+        std::uint64_t endBlock = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (Cursor cursor(extents, offset / BLOCK_SIZE); cursor.logical < endBlock; cursor.advance(1)) {
+            if (cursor.hole()) {
+                continue;
+            }
+            Shard& shard = shardOf(cursor.physical());
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            auto found = shard.index.find(cursor.physical());
+            if (found != shard.index.end()) {
+                visit(shard, found->second);
+            }
+        }
+    }
+
+    Shard& shardOf(std::uint64_t block) {
+        return shards[block % shardCount];
+    }
+
+    // Calls use with the cached block while its shard is locked.
+    template <typename Use>
+    bool lookup(std::uint64_t block, Use use) {
+        Shard& shard = shardOf(block);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        auto found = shard.index.find(block);
+        if (found == shard.index.end()) {
+            return false;
+        }
+        shard.frames[found->second].referenced = true;
+        ++shard.hits;
+        use(shard.block(found->second));
+        return true;
+    }
+
+    bool contains(std::uint64_t block) {
+        if (block == NO_BLOCK) {
+            return false;
+        }
+        Shard& shard = shardOf(block);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        return shard.index.count(block) > 0;
+    }
+
+    // Caches a block just read from the device, then calls use with the
+    // cached bytes while the shard is still locked. A block cached in the
+    // meantime may be newer than the device copy, so it wins.
+    template <typename Use>
+    void install(std::uint64_t block, const char* data, bool readAheadBlock, Use use) {
+        Shard& shard = shardOf(block);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        auto found = shard.index.find(block);
+        if (found != shard.index.end()) {
+            use(shard.block(found->second));
+            return;
+        }
+        std::size_t frame = claim(shard, block);
+        std::memcpy(shard.block(frame), data, BLOCK_SIZE);
+        if (readAheadBlock) {
+            ++shard.readAheadBlocks;
+        } else {
+            ++shard.misses;
+        }
+        use(shard.block(frame));
+    }
+
+    // Finds a frame for block, evicting the first one the clock hand finds
+    // unreferenced. Caller holds the shard lock.
+    std::size_t claim(Shard& shard, std::uint64_t block) {
+        std::size_t frame;
+        if (!shard.freeFrames.empty()) {
+            frame = shard.freeFrames.back();
+            shard.freeFrames.pop_back();
+        } else if (shard.used < shard.frames.size()) {
+            frame = shard.used++;
+        } else {
+            while (true) {
+                frame = shard.hand;
+                shard.hand = (shard.hand + 1) % shard.frames.size();
+                Frame& entry = shard.frames[frame];
+                if (entry.referenced) {
+                    entry.referenced = false;
+                    continue;
+                }
+                if (entry.dirty) {
+                    device.writeBlocks(entry.block, {shard.block(frame)});
+                    entry.dirty = false;
+                    --shard.dirtyCount;
+                    ++shard.writeBacks;
+                }
+                shard.index.erase(entry.block);
+                ++shard.evictions;
+                break;
+            }
+        }
+        shard.frames[frame] = Frame{block, false, false};
+        shard.index[block] = frame;
+        return frame;
+    }
+
+    void copyOut(std::uint64_t logical, const char* block, std::size_t offset, char* out, std::size_t length) {
+        std::uint64_t blockStart = logical * BLOCK_SIZE;
+        std::size_t from = std::max<std::uint64_t>(offset, blockStart) - blockStart;
+        std::size_t to = std::min<std::uint64_t>(offset + length, blockStart + BLOCK_SIZE) - blockStart;
+        std::memcpy(out + (blockStart + from - offset), block + from, to - from);
+    }
+};
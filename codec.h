@@ -0,0 +1,148 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Byte-oriented LZ77 codec in the spirit of LZ4: no entropy coding, one hash
+// probe per position when compressing, and plain copies when decompressing.
+//
+// A compressed stream is a series of sequences:
+//   token      u8: literal count << 4 | (match length - MIN_MATCH)
+//   [u8...]    more literal count when its nibble is 15
+//   literals
+//   offset     u16, distance back to the start of the match
+//   [u8...]    more match length when its nibble is 15
+// The last sequence stops after its literals. Longer counts add up bytes of
+// 255 and end with the first byte below 255.
+namespace codec {
+
+const std::size_t MIN_MATCH = 4;
+const std::size_t MAX_OFFSET = 65535;
+const int HASH_BITS = 14;
+
+inline std::uint32_t read32(const char* data) {
+    std::uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline void putCount(std::string& out, std::size_t count) {
+    for (; count >= 255; count -= 255) {
+        out.push_back(static_cast<char>(255));
+    }
+    out.push_back(static_cast<char>(count));
+}
+
+inline std::string compress(const char* data, std::size_t size) {
+    std::string out;
+    out.reserve(size / 2 + 16);
+    std::vector<std::uint32_t> table(1 << HASH_BITS, 0);  // Position + 1 of the last four bytes with each hash
+
+    auto emit = [&](std::size_t anchor, std::size_t literals, std::size_t matchLength, std::size_t offset) {
+        std::size_t extra = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+        out.push_back(static_cast<char>(std::min<std::size_t>(literals, 15) << 4 | std::min<std::size_t>(extra, 15)));
+        if (literals >= 15) {
+            putCount(out, literals - 15);
+        }
+        out.append(data + anchor, literals);
+        if (matchLength > 0) {
+            out.push_back(static_cast<char>(offset & 0xff));
+            out.push_back(static_cast<char>(offset >> 8));
+            if (extra >= 15) {
+                putCount(out, extra - 15);
+            }
+        }
+    };
+
+    std::size_t anchor = 0;
+    std::size_t position = 0;
+    while (position + MIN_MATCH <= size) {
+        std::uint32_t word = read32(data + position);
+        std::uint32_t slot = (word * 2654435761u) >> (32 - HASH_BITS);
+        std::size_t candidate = table[slot];
+        table[slot] = static_cast<std::uint32_t>(position + 1);
+        if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET || read32(data + candidate - 1) != word) {
+            ++position;
+            continue;
+        }
+
+        std::size_t match = candidate - 1;
+        std::size_t length = MIN_MATCH;
+        while (position + length < size && data[match + length] == data[position + length]) {
+            ++length;
+        }
+        emit(anchor, position - anchor, length, position - match);
+        position += length;
+        anchor = position;
+    }
+    emit(anchor, size - anchor, 0, 0);
+    return out;
+}
+
+// Throws on a stream that is malformed or does not expand to exactly size bytes.
+inline std::string decompress(const char* data, std::size_t compressedSize, std::size_t size) {
+    std::string out(size, '\0');
+    std::size_t in = 0;
+    std::size_t written = 0;
+    auto corrupt = []() { return std::runtime_error("Corrupt compressed data!"); };
+    auto count = [&](std::size_t value) {
+        while (true) {
+            if (in >= compressedSize) {
+                throw corrupt();
+            }
+            std::uint8_t byte = static_cast<std::uint8_t>(data[in++]);
+            value += byte;
+            if (byte < 255) {
+                return value;
+            }
+        }
+    };
+
+    while (in < compressedSize) {
+        std::uint8_t token = static_cast<std::uint8_t>(data[in++]);
+        std::size_t literals = token >> 4;
+        if (literals == 15) {
+            literals = count(literals);
+        }
+        if (literals > compressedSize - in || literals > size - written) {
+            throw corrupt();
+        }
+        std::memcpy(&out[written], data + in, literals);
+        in += literals;
+        written += literals;
+        if (in == compressedSize) {
+            break;
+        }
+
+        if (compressedSize - in < 2) {
+            throw corrupt();
+        }
+        std::size_t offset = static_cast<std::uint8_t>(data[in]) | static_cast<std::size_t>(static_cast<std::uint8_t>(data[in + 1])) << 8;
+        in += 2;
+        std::size_t length = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15) {
+            length = count(length);
+        }
+        if (offset == 0 || offset > written || length > size - written) {
+            throw corrupt();
+        }
+        if (offset >= length) {
+            std::memcpy(&out[written], &out[written - offset], length);
+        } else {
+            for (std::size_t i = 0; i < length; ++i) {  // Overlapping copy repeats the last offset bytes
+                out[written + i] = out[written - offset + i];
+            }
+        }
+        written += length;
+    }
+
+    if (written != size) {
+        throw corrupt();
+    }
+    return out;
+}
+
+} // namespace codec
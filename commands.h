@@ -0,0 +1,173 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <stdexcept>
+
+// Commands understood by FileSystem::executeCommand. COMMAND_NAMES and the
+// handler table in fms.h follow this order.
+enum class Command : std::uint8_t {
+    ChangeDirectory,
+    CreateFile,
+    WriteFile,
+    ReadFile,
+    DeleteFile,
+    List,
+    Find,
+    DiskUsage,
+    Tree,
+    Grep,
+    MakeDirectory,
+    Move,
+    Rename,
+    AppendFile,
+    Truncate,
+    Fallocate,
+    Import,
+    Export,
+    Dedup,
+    Scrub,
+    Snapshot,
+    Watch,
+    Stats,
+    Help,
+    Exit,
+    Unknown
+};
+
+constexpr std::size_t COMMAND_COUNT = static_cast<std::size_t>(Command::Unknown);
+
+constexpr std::array<std::string_view, COMMAND_COUNT> COMMAND_NAMES = {
+    "cd", "createfile", "writefile", "readfile", "deletefile", "ls", "find", "du", "tree", "grep", "mkdir", "mv", "rename", "appendfile", "truncate", "fallocate", "import", "export", "dedup", "scrub", "snapshot", "watch", "stats", "help", "exit"};
+
+// Command names are looked up through a perfect hash: the seed is searched at
+// compile time so that every name lands in its own slot.
+constexpr std::size_t COMMAND_SLOTS = 128;
+
+constexpr std::uint32_t commandHash(std::string_view name, std::uint32_t seed) {
+    std::uint32_t hash = 2166136261u ^ seed; // FNV-1a
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+constexpr bool isPerfectSeed(std::uint32_t seed) {
+    std::array<bool, COMMAND_SLOTS> used = {};
+    for (std::string_view name : COMMAND_NAMES) {
+        std::size_t slot = commandHash(name, seed) % COMMAND_SLOTS;
+        if (used[slot]) {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr std::uint32_t findCommandSeed() {
+    for (std::uint32_t seed = 1; seed < 100000; ++seed) {
+        if (isPerfectSeed(seed)) {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+constexpr std::uint32_t COMMAND_SEED = findCommandSeed();
+static_assert(COMMAND_SEED != 0, "No perfect hash for the command names; increase COMMAND_SLOTS");
+
+constexpr std::array<Command, COMMAND_SLOTS> buildCommandSlots() {
+    std::array<Command, COMMAND_SLOTS> slots = {};
+    for (std::size_t i = 0; i < COMMAND_SLOTS; ++i) {
+        slots[i] = Command::Unknown;
+    }
+    for (std::size_t i = 0; i < COMMAND_COUNT; ++i) {
+        slots[commandHash(COMMAND_NAMES[i], COMMAND_SEED) % COMMAND_SLOTS] = static_cast<Command>(i);
+    }
+    return slots;
+}
+
+constexpr std::array<Command, COMMAND_SLOTS> COMMAND_TABLE = buildCommandSlots();
+
+// One hash and one string compare.
+inline Command lookupCommand(std::string_view name) {
+    Command command = COMMAND_TABLE[commandHash(name, COMMAND_SEED) % COMMAND_SLOTS];
+    if (command == Command::Unknown || COMMAND_NAMES[static_cast<std::size_t>(command)] != name) {
+        return Command::Unknown;
+    }
+    return command;
+}
+
+// Splits a command line into views of the line itself, without copying.
+// Tokens are separated by spaces or tabs; a token may be wrapped in double or
+// single quotes to include whitespace, and either quote can appear inside a
+// token quoted with the other. The line must outlive the CommandLine.
+class CommandLine {
+public:
+    static const std::size_t MAX_TOKENS = 8;  // Later text is only reachable through rest()
+
+    explicit CommandLine(std::string_view line) : line(line) {
+        std::size_t position = skipBlanks(0);
+        while (position < line.size() && count < MAX_TOKENS) {
+            starts[count] = position;
+            char quote = line[position];
+            if (quote == '"' || quote == '\'') {
+                std::size_t close = line.find(quote, position + 1);
+                if (close == std::string_view::npos) {
+                    throw std::invalid_argument("Unterminated quote!");
+                }
+                tokens[count] = line.substr(position + 1, close - position - 1);
+                quoted[count] = true;
+                position = close + 1;
+            } else {
+                std::size_t end = position;
+                while (end < line.size() && !isBlank(line[end])) {
+                    ++end;
+                }
+                tokens[count] = line.substr(position, end - position);
+                position = end;
+            }
+            ++count;
+            position = skipBlanks(position);
+        }
+        complete = position >= line.size();
+    }
+
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+    std::string_view operator[](std::size_t index) const { return tokens[index]; }
+
+    // The text from token index to the end of the line, for arguments such as
+    // file content that may contain spaces: the token itself when it is a
+    // single quoted one, otherwise the raw rest of the line.
+    std::string_view rest(std::size_t index) const {
+        if (quoted[index] && index + 1 == count && complete) {
+            return tokens[index];
+        }
+        std::size_t end = line.size();
+        while (end > starts[index] && isBlank(line[end - 1])) {
+            --end;
+        }
+        return line.substr(starts[index], end - starts[index]);
+    }
+
+private:
+    std::string_view line;
+    std::array<std::string_view, MAX_TOKENS> tokens;
+    std::array<std::size_t, MAX_TOKENS> starts = {};  // Offset of each token in line, including its opening quote
+    std::array<bool, MAX_TOKENS> quoted = {};
+    std::size_t count = 0;
+    bool complete = true;  // Every token of the line was parsed
+
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    std::size_t skipBlanks(std::size_t position) const {
+        while (position < line.size() && isBlank(line[position])) {
+            ++position;
+        }
+        return position;
+    }
+};
@@ -0,0 +1,402 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Offset of the first occurrence of needle in haystack, or npos. Positions
+// are screened 16 bytes at a time (32 with AVX2) by comparing the first and
+// the last byte of the needle at once, and only the positions where both
+// match are compared in full, so a scan moves at close to memory speed.
+inline std::size_t findSubstring(std::string_view haystack, std::string_view needle) {
+    const std::size_t npos = std::string_view::npos;
+    std::size_t n = needle.size();
+    if (n == 0) {
+        return 0;
+    }
+    if (n > haystack.size()) {
+        return npos;
+    }
+    if (n == 1) {
+        const void* found = std::memchr(haystack.data(), needle[0], haystack.size());
+        return found ? static_cast<const char*>(found) - haystack.data() : npos;
+    }
+
+    const char* data = haystack.data();
+    std::size_t last = haystack.size() - n;  // Last position a match can start at
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i first32 = _mm256_set1_epi8(needle[0]);
+    const __m256i last32 = _mm256_set1_epi8(needle[n - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + n - 1));
+        std::uint32_t mask = static_cast<std::uint32_t>(
+            _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first32), _mm256_cmpeq_epi8(tail, last32))));
+        while (mask != 0) {
+            std::size_t at = i + static_cast<std::size_t>(__builtin_ctz(mask));
+            if (std::memcmp(data + at + 1, needle.data() + 1, n - 2) == 0) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i first16 = _mm_set1_epi8(needle[0]);
+    const __m128i last16 = _mm_set1_epi8(needle[n - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1));
+        std::uint32_t mask = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first16), _mm_cmpeq_epi8(tail, last16))));
+        while (mask != 0) {
+            std::size_t at = i + static_cast<std::size_t>(__builtin_ctz(mask));
+            if (std::memcmp(data + at + 1, needle.data() + 1, n - 2) == 0) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // The positions left over, or all of them without SIMD
+    for (; i <= last; ++i) {
+        const void* found = std::memchr(data + i, needle[0], last + 1 - i);
+        if (!found) {
+            break;
+        }
+        i = static_cast<const char*>(found) - data;
+        if (data[i + n - 1] == needle[n - 1] && std::memcmp(data + i + 1, needle.data() + 1, n - 2) == 0) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+// Distinct trigrams (runs of three bytes, packed into 24 bits) of a byte
+// stream fed in pieces. Small inputs collect them in a list that is sorted
+// once at the end; past BITMAP_THRESHOLD trigrams they move to a bitmap of
+// every possible trigram, so even gigabytes of content are counted in one
+// pass and 2 MiB of memory.
+class TrigramSet {
+public:
+    // Adds the trigrams that lie wholly inside bytes. Callers that feed a
+    // stream in windows overlap them by two bytes.
+    void add(std::string_view bytes) {
+        if (bytes.size() < 3) {
+            return;
+        }
+        std::uint32_t trigram = (byte(bytes[0]) << 8) | byte(bytes[1]);
+        for (std::size_t i = 2; i < bytes.size(); ++i) {
+            trigram = ((trigram << 8) | byte(bytes[i])) & MASK;
+            if (bitmap.empty()) {
+                if (!list.empty() && list.back() == trigram) {
+                    continue;  // Runs of one byte repeat a trigram
+                }
+                list.push_back(trigram);
+                if (list.size() >= BITMAP_THRESHOLD) {
+                    switchToBitmap();
+                }
+            } else {
+                bitmap[trigram >> 6] |= std::uint64_t(1) << (trigram & 63);
+            }
+        }
+    }
+
+    // Sorted distinct trigrams added so far; leaves the set empty.
+    std::vector<std::uint32_t> take() {
+        std::vector<std::uint32_t> result;
+        if (bitmap.empty()) {
+            std::sort(list.begin(), list.end());
+            list.erase(std::unique(list.begin(), list.end()), list.end());
+            result.swap(list);
+        } else {
+            for (std::size_t word = 0; word < bitmap.size(); ++word) {
+                for (std::uint64_t bits = bitmap[word]; bits != 0; bits &= bits - 1) {
+                    result.push_back(static_cast<std::uint32_t>(word * 64 + __builtin_ctzll(bits)));
+                }
+            }
+            bitmap.clear();
+        }
+        return result;
+    }
+
+    static std::vector<std::uint32_t> of(std::string_view bytes) {
+        TrigramSet set;
+        set.add(bytes);
+        return set.take();
+    }
+
+private:
+    static const std::uint32_t MASK = 0xffffff;
+    static const std::size_t BITMAP_THRESHOLD = 64 * 1024;  // Trigrams at which the list becomes a bitmap
+
+    std::vector<std::uint32_t> list;
+    std::vector<std::uint64_t> bitmap;
+
+    static std::uint32_t byte(char c) { return static_cast<unsigned char>(c); }
+
+    void switchToBitmap() {
+        bitmap.assign((MASK + 1) / 64, 0);
+        for (std::uint32_t trigram : list) {
+            bitmap[trigram >> 6] |= std::uint64_t(1) << (trigram & 63);
+        }
+        list.clear();
+        list.shrink_to_fit();
+    }
+};
+
+// Inverted index from the trigrams of file content to the files that hold
+// them. Every file keeps its own sorted trigram list as well, so a file is
+// updated or removed without scanning the postings of other files. The set
+// of a file may hold trigrams its content has lost since (ranged writes only
+// add), which costs a wasted check of that file but never a missed match.
+//
+// Saved next to the image, so a restart does not have to read every file:
+//   u64 magic | u64 checkpoint lsn | u64 trigram count |
+//   (u32 trigram, u32 file count, u64 file*)* | u64 checksum of the postings
+class ContentIndex {
+public:
+    // Files whose content may hold term, sorted. Returns false when the term
+    // is shorter than a trigram and every file has to be checked.
+    bool candidates(std::string_view term, std::vector<std::uint64_t>& files) const {
+        files.clear();
+        if (term.size() < 3) {
+            return false;
+        }
+        std::vector<const std::vector<std::uint64_t>*> lists;
+        for (std::uint32_t trigram : TrigramSet::of(term)) {
+            auto posting = postings.find(trigram);
+            if (posting == postings.end()) {
+                return true;
+            }
+            lists.push_back(&posting->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+
+        // Intersect starting from the rarest trigram, which bounds the result
+        files = *lists[0];
+        std::vector<std::uint64_t> narrowed;
+        for (std::size_t i = 1; i < lists.size() && !files.empty(); ++i) {
+            narrowed.clear();
+            std::set_intersection(files.begin(), files.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(narrowed));
+            files.swap(narrowed);
+        }
+        return true;
+    }
+
+    // Sets the trigrams of file to exactly trigrams, which must be sorted.
+    void replace(std::uint64_t file, std::vector<std::uint32_t> trigrams) {
+        std::vector<std::uint32_t>& current = byFile[file];
+        std::vector<std::uint32_t> gone;
+        std::set_difference(current.begin(), current.end(), trigrams.begin(), trigrams.end(), std::back_inserter(gone));
+        for (std::uint32_t trigram : gone) {
+            unlink(trigram, file);
+        }
+        std::vector<std::uint32_t> added;
+        std::set_difference(trigrams.begin(), trigrams.end(), current.begin(), current.end(), std::back_inserter(added));
+        for (std::uint32_t trigram : added) {
+            link(trigram, file);
+        }
+        if (trigrams.empty()) {
+            byFile.erase(file);
+        } else {
+            current.swap(trigrams);
+        }
+        modified = true;
+    }
+
+    // Adds sorted trigrams to those of file.
+    void add(std::uint64_t file, const std::vector<std::uint32_t>& trigrams) {
+        if (trigrams.empty()) {
+            return;
+        }
+        std::vector<std::uint32_t>& current = byFile[file];
+        std::vector<std::uint32_t> added;
+        std::set_difference(trigrams.begin(), trigrams.end(), current.begin(), current.end(), std::back_inserter(added));
+        if (added.empty()) {
+            return;
+        }
+        for (std::uint32_t trigram : added) {
+            link(trigram, file);
+        }
+        std::vector<std::uint32_t> merged;
+        merged.reserve(current.size() + added.size());
+        std::merge(current.begin(), current.end(), added.begin(), added.end(), std::back_inserter(merged));
+        current.swap(merged);
+        modified = true;
+    }
+
+    void remove(std::uint64_t file) {
+        auto entry = byFile.find(file);
+        if (entry == byFile.end()) {
+            return;
+        }
+        for (std::uint32_t trigram : entry->second) {
+            unlink(trigram, file);
+        }
+        byFile.erase(entry);
+        modified = true;
+    }
+
+    void clear() {
+        postings.clear();
+        byFile.clear();
+        modified = true;
+    }
+
+    std::size_t files() const { return byFile.size(); }
+    std::size_t trigrams() const { return postings.size(); }
+
+    // Whether the index changed since it was last saved or loaded.
+    bool dirty() const { return modified; }
+
+    // Writes the index to path through a temporary file, tagged with the
+    // journal position the image it belongs to was checkpointed at.
+    void save(const std::string& path, std::uint64_t lsn) {
+        std::vector<std::uint32_t> order;
+        order.reserve(postings.size());
+        for (const auto& entry : postings) {
+            order.push_back(entry.first);
+        }
+        std::sort(order.begin(), order.end());
+
+        std::string tempPath = path + ".tmp";
+        std::ofstream out(tempPath, std::ios::binary);
+        std::uint64_t header[3] = {MAGIC, lsn, order.size()};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        std::uint64_t sum = CHECKSUM_SEED;
+        auto put = [&](const void* data, std::size_t size) {
+            out.write(static_cast<const char*>(data), size);
+            sum = checksum(sum, static_cast<const char*>(data), size);
+        };
+        for (std::uint32_t trigram : order) {
+            const std::vector<std::uint64_t>& files = postings.at(trigram);
+            std::uint32_t count = static_cast<std::uint32_t>(files.size());
+            put(&trigram, sizeof(trigram));
+            put(&count, sizeof(count));
+            put(files.data(), files.size() * sizeof(std::uint64_t));
+        }
+        out.write(reinterpret_cast<const char*>(&sum), sizeof(sum));
+        out.close();
+
+        int fd = ::open(tempPath.c_str(), O_RDONLY);
+        if (!out || fd < 0 || ::fsync(fd) != 0 || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            throw std::runtime_error("Failed to save the content index!");
+        }
+        ::close(fd);
+        modified = false;
+    }
+
+    // Moves the saved index forward to a later checkpoint without rewriting
+    // it; only valid while the index is unchanged since it was saved.
+    void stamp(const std::string& path, std::uint64_t lsn) {
+        int fd = ::open(path.c_str(), O_WRONLY);
+        bool stamped = fd >= 0 && ::pwrite(fd, &lsn, sizeof(lsn), sizeof(std::uint64_t)) == sizeof(lsn) && ::fdatasync(fd) == 0;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (!stamped) {
+            save(path, lsn);
+        }
+    }
+
+    // Loads the index saved at path if it belongs to the checkpoint at lsn.
+    // Returns false, leaving the index empty, when it is missing, stale or
+    // damaged and has to be rebuilt from the content.
+    bool load(const std::string& path, std::uint64_t lsn) {
+        clear();
+        std::ifstream in(path, std::ios::binary);
+        std::uint64_t header[3];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != MAGIC || header[1] != lsn) {
+            return false;
+        }
+
+        std::uint64_t sum = CHECKSUM_SEED;
+        auto get = [&](void* data, std::size_t size) {
+            if (!in.read(static_cast<char*>(data), size)) {
+                return false;
+            }
+            sum = checksum(sum, static_cast<const char*>(data), size);
+            return true;
+        };
+        for (std::uint64_t i = 0; i < header[2]; ++i) {
+            std::uint32_t trigram, count;
+            if (!get(&trigram, sizeof(trigram)) || !get(&count, sizeof(count))) {
+                clear();
+                return false;
+            }
+            std::vector<std::uint64_t>& files = postings[trigram];
+            files.resize(count);
+            if (!get(files.data(), count * sizeof(std::uint64_t))) {
+                clear();
+                return false;
+            }
+            // Trigrams are stored in order, so every file's list comes out sorted
+            for (std::uint64_t file : files) {
+                byFile[file].push_back(trigram);
+            }
+        }
+        std::uint64_t stored;
+        if (!in.read(reinterpret_cast<char*>(&stored), sizeof(stored)) || stored != sum) {
+            clear();
+            return false;
+        }
+        modified = false;
+        return true;
+    }
+
+private:
+    static constexpr std::uint64_t MAGIC = 0x3149525453464d46ULL;  // "FMFSTRI1"
+    static constexpr std::uint64_t CHECKSUM_SEED = 14695981039346656037ULL;
+
+    std::unordered_map<std::uint32_t, std::vector<std::uint64_t>> postings;  // Trigram -> sorted files holding it
+    std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> byFile;    // File -> its sorted trigrams
+    bool modified = false;
+
+    void link(std::uint32_t trigram, std::uint64_t file) {
+        std::vector<std::uint64_t>& files = postings[trigram];
+        // New files have the highest inodes, so this is usually an append
+        if (files.empty() || files.back() < file) {
+            files.push_back(file);
+        } else {
+            files.insert(std::lower_bound(files.begin(), files.end(), file), file);
+        }
+    }
+
+    void unlink(std::uint32_t trigram, std::uint64_t file) {
+        auto entry = postings.find(trigram);
+        if (entry == postings.end()) {
+            return;
+        }
+        std::vector<std::uint64_t>& files = entry->second;
+        auto slot = std::lower_bound(files.begin(), files.end(), file);
+        if (slot != files.end() && *slot == file) {
+            files.erase(slot);
+        }
+        if (files.empty()) {
+            postings.erase(entry);
+        }
+    }
+
+    static std::uint64_t checksum(std::uint64_t hash, const char* data, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i) {  // FNV-1a
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+};
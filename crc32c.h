@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// CRC32C (Castagnoli), the checksum of block contents, image tables and
+// journal records. x86-64 processors with SSE4.2 compute it with the crc32
+// instruction, 8 bytes per step; others use slicing-by-8 tables. Both give
+// the same value, so files move freely between machines.
+namespace crc32c {
+
+namespace detail {
+
+const std::uint32_t POLYNOMIAL = 0x82f63b78u;  // Reversed Castagnoli polynomial
+
+struct Tables {
+    std::uint32_t entries[8][256];
+
+    Tables() {
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+            }
+            entries[0][i] = crc;
+        }
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                entries[slice][i] = (entries[slice - 1][i] >> 8) ^ entries[0][entries[slice - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+inline const Tables& tables() {
+    static const Tables instance;
+    return instance;
+}
+
+inline std::uint32_t portable(std::uint32_t crc, const char* data, std::size_t size) {
+    const auto& t = tables().entries;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    while (size >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));  // Little-endian, as on every supported target
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FMS_CRC32C_HARDWARE 1
+
+__attribute__((target("sse4.2"))) inline std::uint32_t hardware(std::uint32_t crc, const char* data, std::size_t size) {
+    std::uint64_t crc64 = crc;
+    while (size >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, static_cast<unsigned char>(*data++));
+    }
+    return crc;
+}
+
+inline bool hasHardware() {
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#else
+inline bool hasHardware() { return false; }
+#endif
+
+} // namespace detail
+
+// Continues a checksum over more bytes; start from 0.
+inline std::uint32_t extend(std::uint32_t crc, const void* data, std::size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    crc = ~crc;
+#ifdef FMS_CRC32C_HARDWARE
+    if (detail::hasHardware()) {
+        return ~detail::hardware(crc, bytes, size);
+    }
+#endif
+    return ~detail::portable(crc, bytes, size);
+}
+
+inline std::uint32_t compute(const void* data, std::size_t size) {
+    return extend(0, data, size);
+}
+
+// Whether compute runs on the crc32 instruction, for stats and benchmarks.
+inline bool hardwareAccelerated() {
+    return detail::hasHardware();
+}
+
+} // namespace crc32c
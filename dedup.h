@@ -0,0 +1,140 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include "blockdevice.h"
+
+// Owners of blocks shared between files, or between places in one file.
+// Only blocks with more than one owner are listed, so the table stays empty
+// until deduplication shares something and costs nothing before that.
+class BlockRefs {
+public:
+    bool empty() const { return extra.empty(); }
+    bool isShared(std::uint64_t block) const { return extra.count(block) > 0; }
+
+    void addOwner(std::uint64_t block) {
+        ++extra[block];
+        ++saved;
+    }
+
+    // Returns true when the block had no other owner and is now unused.
+    bool dropOwner(std::uint64_t block) {
+        auto entry = extra.find(block);
+        if (entry == extra.end()) {
+            return true;
+        }
+        if (--entry->second == 0) {
+            extra.erase(entry);
+        }
+        --saved;
+        return false;
+    }
+
+    std::uint64_t sharedBlocks() const { return extra.size(); }
+    std::uint64_t savedBlocks() const { return saved; }  // References that need no block of their own
+
+private:
+    std::unordered_map<std::uint64_t, std::uint32_t> extra;  // Block -> owners beyond the first
+    std::uint64_t saved = 0;
+};
+
+// Stored blocks by the hash of their bytes, so a write can share a block
+// that already holds what it writes. A block is listed only while its bytes
+// are settled: writers forget their blocks before changing them and list
+// them again once written, and freed blocks are forgotten. A match is still
+// confirmed byte by byte.
+class BlockHashIndex {
+public:
+    bool empty() const { return blockByHash.empty(); }
+
+    bool find(std::uint64_t hash, std::uint64_t& block) const {
+        auto entry = blockByHash.find(hash);
+        if (entry == blockByHash.end()) {
+            return false;
+        }
+        block = entry->second;
+        return true;
+    }
+
+    void add(std::uint64_t block, std::uint64_t hash) {
+        forget(block);
+        auto entry = blockByHash.find(hash);
+        if (entry != blockByHash.end()) {
+            hashOfBlock.erase(entry->second);  // One block per hash is enough to share
+        }
+        blockByHash[hash] = block;
+        hashOfBlock[block] = hash;
+    }
+
+    void forget(std::uint64_t block) {
+        auto entry = hashOfBlock.find(block);
+        if (entry != hashOfBlock.end()) {
+            blockByHash.erase(entry->second);
+            hashOfBlock.erase(entry);
+        }
+    }
+
+    void clear() {
+        blockByHash.clear();
+        hashOfBlock.clear();
+    }
+
+private:
+    std::unordered_map<std::uint64_t, std::uint64_t> blockByHash;
+    std::unordered_map<std::uint64_t, std::uint64_t> hashOfBlock;
+};
+
+// 64-bit hash of a whole block, eight bytes per step. Equal hashes are
+// confirmed by comparing the blocks, so it only has to spread well.
+inline std::uint64_t hashBlock(const char* data) {
+    const std::uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    std::uint64_t hash = BlockDevice::BLOCK_SIZE;
+    for (std::size_t i = 0; i < BlockDevice::BLOCK_SIZE; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ (word * multiplier)) * multiplier;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Device block of every logical block of a file, Extent::HOLE in holes.
+inline std::vector<std::uint64_t> expandExtents(const ExtentList& extents) {
+    std::vector<std::uint64_t> blocks;
+    for (const Extent& extent : extents) {
+        for (std::uint64_t i = 0; i < extent.length; ++i) {
+            blocks.push_back(extent.hole() ? Extent::HOLE : extent.start + i);
+        }
+    }
+    return blocks;
+}
+
+// Inverse of expandExtents, merging consecutive blocks into one extent.
+inline ExtentList compactExtents(const std::vector<std::uint64_t>& blocks) {
+    ExtentList extents;
+    for (std::uint64_t block : blocks) {
+        appendRun(extents, {block, 1});
+    }
+    return extents;
+}
+
+// Calls visit(logical, physical) for the allocated logical blocks in
+// [first, end) of a file.
+template <typename Visit>
+void forEachBlock(const ExtentList& extents, std::uint64_t first, std::uint64_t end, Visit visit) {
+    std::uint64_t logical = 0;
+    for (const Extent& extent : extents) {
+        if (logical >= end) {
+            break;
+        }
+        if (extent.hole()) {
+            logical += extent.length;
+            continue;
+        }
+        for (std::uint64_t i = first > logical ? first - logical : 0; i < extent.length && logical + i < end; ++i) {
+            visit(logical + i, extent.start + i);
+        }
+        logical += extent.length;
+    }
+}
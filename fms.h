@@ -5,513 +5,4126 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <stdexcept>
-#include <bitset>
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <charconv>
+#include <string_view>
+#include <optional>
+#include "journal.h"
+#include "image.h"
+#include "blockdevice.h"
+#include "buffercache.h"
+#include "allocator.h"
+#include "dedup.h"
+#include "codec.h"
+#include "stats.h"
+#include "commands.h"
+#include "workstealing.h"
+#include "sortedindex.h"
+#include "names.h"
+#include "contentindex.h"
+#include "trace.h"
+#include "status.h"
+#include "crc32c.h"
+#include "watch.h"
 
+using InodeId = std::uint64_t;
+
+// Reader-writer lock that can live inside copyable metadata. A copy gets its
+// own unlocked mutex.
+struct EntryLock {
+    mutable std::shared_mutex mutex;
+
+    EntryLock() = default;
+    EntryLock(const EntryLock&) {}
+    EntryLock& operator=(const EntryLock&) { return *this; }
+};
+
+// Set when a directory or one of its files changes, so the next snapshot
+// knows the directory's frozen version is out of date. Commands that hold the
+// directory shared set it too, hence atomic; a copy starts with the same value.
+struct ChangeFlag {
+    mutable std::atomic<bool> value{true};
+
+    ChangeFlag() = default;
+    ChangeFlag(const ChangeFlag& other) : value(other.value.load()) {}
+    ChangeFlag& operator=(const ChangeFlag& other) {
+        value = other.value.load();
+        return *this;
+    }
+};
+
+// Snapshot epoch up to which a directory has given the open snapshots its
+// state. Commands that hold the directory shared advance it, hence atomic
+// and copyable like ChangeFlag.
+struct CaptureEpoch {
+    mutable std::atomic<std::uint64_t> value{0};
+
+    CaptureEpoch() = default;
+    CaptureEpoch(const CaptureEpoch& other) : value(other.value.load()) {}
+    CaptureEpoch& operator=(const CaptureEpoch& other) {
+        value = other.value.load();
+        return *this;
+    }
+};
+
+// Access bits of a file, packed into one byte. Commands take a combination
+// of r, w and x, optionally padded with - as in "r-x", or one octal digit.
+struct Permissions {
+    static const std::uint8_t READ = 4;
+    static const std::uint8_t WRITE = 2;
+    static const std::uint8_t EXECUTE = 1;
+
+    std::uint8_t bits = 0;
+
+    static Permissions parse(std::string_view text) {
+        Permissions permissions;
+        if (text.size() == 1 && text[0] >= '0' && text[0] <= '7') {
+            permissions.bits = static_cast<std::uint8_t>(text[0] - '0');
+            return permissions;
+        }
+        if (text.empty() || text.size() > 3) {
+            throw std::invalid_argument("Invalid permissions! Use r, w and x, or an octal digit.");
+        }
+        for (char c : text) {
+            std::uint8_t bit = c == 'r' ? READ : c == 'w' ? WRITE : c == 'x' ? EXECUTE : 0;
+            if ((bit == 0 && c != '-') || (permissions.bits & bit)) {
+                throw std::invalid_argument("Invalid permissions! Use r, w and x, or an octal digit.");
+            }
+            permissions.bits |= bit;
+        }
+        return permissions;
+    }
+
+    // Reads permissions stored before they were validated, keeping the
+    // letters it knows.
+    static Permissions parseStored(std::string_view text) {
+        try {
+            return parse(text);
+        } catch (const std::invalid_argument&) {
+            Permissions permissions;
+            for (char c : text) {
+                permissions.bits |= c == 'r' ? READ : c == 'w' ? WRITE : c == 'x' ? EXECUTE : 0;
+            }
+            return permissions;
+        }
+    }
+
+    std::string str() const {
+        std::string text;
+        if (bits & READ) {
+            text += 'r';
+        }
+        if (bits & WRITE) {
+            text += 'w';
+        }
+        if (bits & EXECUTE) {
+            text += 'x';
+        }
+        return text.empty() ? "-" : text;
+    }
+
+    bool operator==(const Permissions& other) const { return bits == other.bits; }
+};
+
+// Immutable copy of a file's metadata, shared by every snapshot taken while
+// the file stayed the same. Until the live file changes, the blocks belong to
+// the live file alone; its first change pins them, giving the version a
+// reference of its own to every block.
+struct FileVersion {
+    InodeId inode;
+    Permissions permissions;
+    std::uint64_t fileSize;
+    std::uint64_t contentSize;
+    ExtentList extents;
+    mutable bool pinned = false;  // Guarded by the allocator lock
+};
+
+using FileVersionPtr = std::shared_ptr<const FileVersion>;
+
+// Immutable copy of a directory. Child directories are found through their
+// own parent inodes, so adding one does not change this version.
+struct DirectoryVersion {
+    InodeId inode;
+    InodeId parent;
+    std::string name;
+    std::vector<std::pair<std::string, FileVersionPtr>> files;
+};
+
+using DirectoryVersionPtr = std::shared_ptr<const DirectoryVersion>;
+
+// A snapshot starts open: it only records its epoch, and each directory keeps
+// the state it had at that epoch when it first changes afterwards. The next
+// checkpoint, restore or listing gathers them into directories.
+struct Snapshot {
+    std::string name;
+    std::int64_t createdAt;  // Seconds since the epoch
+    std::uint64_t epoch = 0;  // Snapshots created before this one since startup
+    bool open = false;        // directories is empty until materializeSnapshots
+    std::vector<DirectoryVersionPtr> directories;
+};
+
+// Metadata of one file, 136 bytes on x86-64. With its node in the directory
+// map, its entries in the three directory indexes and its interned name, a
+// file takes about 400 heap bytes (the metadata line of fms_bench); equal
+// names share one copy. Files of more than one extent add 16 bytes per extent.
 struct File {
+    InodeId inode = 0;
+    Name name;                     // Also the key of the file in its directory
+    Permissions permissions;
+    std::uint64_t fileSize = 0;     // Declared size; content can grow up to it
+    std::uint64_t contentSize = 0;  // Bytes of content; parts in holes read as zeros
+    ExtentList extents;            // Disk blocks as contiguous runs and holes, covering the content; one is kept inline
+    mutable FileVersionPtr frozen;  // Equal to the file while it is unchanged; set by captures too
+    EntryLock lock;                // Shared to read the content, exclusive to change it
+};
+
+struct FileSystemOptions {
+    std::string storagePath = "filesystem";  // Files are <storagePath>.dat, .blocks, .sums and .journal
+    JournalOptions journal;
+    BufferCacheOptions cache;
+    std::uint64_t capacityBlocks = 10000;  // Storage capacity in blocks; an existing image can grow but never shrink
+    std::size_t maxFilesPerDirectory = 10000000;  // Files one directory may hold
+    std::size_t maxDirectories = 1000000;         // Directories in the live tree, the root included
+    bool compressImage = false;              // Write the image compressed; it is then decompressed in memory at startup
+    bool dedupWrites = false;                // Share each whole block written with a stored block holding the same bytes
+    std::string statsPath;                   // When set, stats are written here periodically: JSON for a ".json" path, Prometheus text otherwise
+    std::chrono::milliseconds statsInterval{10000};
+    std::string tracePath;                   // When set, every command is recorded here with its timing and outcome, for fms_replay
+    std::size_t watchEvents = 4096;          // Latest changes kept for watchers; a watcher further behind loses events
+    std::string watchPath;                   // When set, every change is streamed here as a line of text: a file, or a Unix socket to connect to
+};
+
+// Page of a directory listing. Entries are listed from the one after the
+// cursor in the chosen order; only names starting with prefix are listed.
+struct ListOptions {
+    enum class Order { Name, Size, Permissions };
+    Order order = Order::Name;
+    std::string prefix;
+    std::size_t limit = 0;  // 0 lists every entry
+    std::string after;      // Name of the last entry of the previous page
+    bool hasAfter = false;
+};
+
+// Names an open file for the library API. A handle follows its file through
+// renames, moves of its directory and snapshot restores, until it is closed
+// or the file is deleted.
+struct FileHandle {
+    std::uint64_t id = 0;  // 0 is never handed out
+};
+
+// Metadata returned by stat and readdir.
+struct FileStat {
+    Status status = Status::Ok;     // Outcome for this entry of a batched stat
+    InodeId inode = 0;
+    bool directory = false;         // Directories only fill in inode
+    Permissions permissions;
+    std::uint64_t fileSize = 0;     // Declared size
+    std::uint64_t contentSize = 0;
+    std::uint64_t blocks = 0;       // Allocated blocks; holes take none
+};
+
+struct DirectoryEntry {
     std::string name;
-    std::string content;
-    std::string permissions;
-    int fileSize;
-    std::vector<int> blockIndices; // Track allocated disk blocks
+    FileStat stat;
+};
+
+// Position of a watcher in the stream of changes, set up by watch.
+struct Watcher {
+    InodeId directory = 0;     // Watched directory
+    std::uint64_t cursor = 0;  // Sequence number of the next change to look at
+    std::uint64_t lost = 0;    // Changes overwritten before the last readEvents reached them
+};
+
+// A running watch command, advanced by FileSystem::continueWatch.
+struct WatchRequest {
+    Watcher watcher;
+    std::uint64_t count = 0;    // Changes to print; 0 prints them all until the deadline
+    std::uint64_t printed = 0;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+struct BatchOptions {
+    std::size_t syncEvery = 0;  // Commit the journal every N commands; 0 commits once at the end
+    bool transactional = false; // Undo the whole batch on the first error
+    bool quiet = false;         // Skip confirmations of successful commands
+};
+
+// Names of the files and subdirectories of a directory in each order ls
+// can list them, so a page costs a lookup plus the page instead of a sort.
+// Subdirectories sort as size 0 with no permissions. Names are views of the
+// interned names of the entries, so an entry must be added with its own name.
+struct DirectoryIndex {
+    SortedIndex<std::string_view> byName;
+    SortedIndex<std::pair<std::uint64_t, std::string_view>> bySize;  // Declared size, then name
+    SortedIndex<std::pair<std::uint8_t, std::string_view>> byPermissions;
+
+    void addFile(const File& file) {
+        byName.insert(file.name);
+        bySize.insert({file.fileSize, file.name});
+        byPermissions.insert({file.permissions.bits, file.name});
+    }
+
+    void removeFile(const File& file) {
+        byName.erase(file.name);
+        bySize.erase({file.fileSize, file.name});
+        byPermissions.erase({file.permissions.bits, file.name});
+    }
+
+    void addDirectory(const Name& name) {
+        byName.insert(name);
+        bySize.insert({0, name});
+        byPermissions.insert({0, name});
+    }
+
+    void removeDirectory(std::string_view name) {
+        byName.erase(name);
+        bySize.erase({0, name});
+        byPermissions.erase({0, name});
+    }
 };
 
+// Map keys are views of the interned names held by the files and by the
+// child directories, so entries go in through FileSystem::addFile and
+// addSubdirectory rather than operator[].
 struct Directory {
-    std::unordered_map<std::string, File> files;
-    std::vector<std::string> subdirectories;
+    InodeId inode = 0;
+    InodeId parent = 0;  // The root is its own parent
+    Name name;
+    std::unordered_map<std::string_view, File> files;
+    std::unordered_map<std::string_view, InodeId> subdirectories;  // Child directory name -> inode
+    DirectoryIndex index;  // Ordered names of files and subdirectories; changes with the maps above
+    mutable DirectoryVersionPtr frozen;  // Equal to the directory unless changed is set
+    ChangeFlag changed;
+    std::uint64_t born = 0;  // Snapshot epoch when the directory was created; earlier snapshots lack it
+    CaptureEpoch captured;   // Snapshots from this epoch on still see the directory as it is now
+    mutable std::vector<std::pair<std::uint64_t, DirectoryVersionPtr>> history;  // States kept for open snapshots, by last epoch they serve
+    EntryLock lock;  // Shared to look up entries, exclusive to add or remove them
+};
+
+// State of one client. Every command runs on behalf of a session, so clients
+// of a server each keep their own working directory and output.
+struct Session {
+    std::uint32_t id = 0;          // Tells the sessions of a trace apart; the console is 0
+    InodeId currentDirectory = 1;  // Starts at the root directory
+    std::ostream* out = &std::cout;
+    bool verbose = true;           // Print confirmations for successful commands
+    bool detachWatch = false;      // watch leaves its request in watchRequest and returns instead of waiting
+    std::optional<WatchRequest> watchRequest;
+};
+
+// Collects output in memory and hands it to the stream in large writes, so
+// commands that print many lines do not pay for a stream call per line.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream& out) : out(out) {}
+    ~BufferedWriter() { flush(); }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    BufferedWriter& operator<<(std::string_view text) {
+        buffer.append(text.data(), text.size());
+        if (buffer.size() >= FLUSH_SIZE) {
+            flush();
+        }
+        return *this;
+    }
+
+    BufferedWriter& operator<<(char c) {
+        return *this << std::string_view(&c, 1);
+    }
+
+    BufferedWriter& operator<<(std::uint64_t value) {
+        char digits[24];
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, result.ptr - digits);
+    }
+
+    void flush() {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+
+private:
+    static const std::size_t FLUSH_SIZE = 64 * 1024;
+    std::ostream& out;
+    std::string buffer;
 };
 
 class FileSystem {
 private:
-    static const int MAX_FILES = 1000;  // Maximum number of files in the file system
-    static const int MAX_DIRS = 100;    // Maximum number of directories in the file system
-    static const int MAX_CAPACITY = 10000;  // Maximum storage capacity of the file system
+    static constexpr std::size_t READ_CHUNK_SIZE = 64 * 1024;  // Buffer used to stream file content
+    static constexpr std::size_t SCAN_CHUNK_SIZE = 1024 * 1024;  // Window read at a time when whole files are searched or indexed
+    static constexpr InodeId ROOT_INODE = 1;
+    static const std::size_t DENTRY_CACHE_LIMIT = 4096;  // Resolved paths kept before the cache starts over
+    static const std::size_t BATCH_READ_SIZE = 1024 * 1024;  // Chunk size for reading batch scripts
+    static const std::size_t DIRECTORIES_PER_WALK_THREAD = 32;  // Tree walks add a thread per this many directories, up to the core count
+    static const std::uint64_t SCRUB_CHUNK_BLOCKS = 1024;  // Blocks scrub reads and verifies per task
+    static constexpr std::chrono::milliseconds WATCH_STREAM_INTERVAL{10};  // How often changes are written to --watch-to
+    static constexpr std::chrono::milliseconds WATCH_POLL_MAX{50};         // Longest sleep of a watcher waiting for changes
+    static const std::uint64_t WATCH_DEFAULT_TIMEOUT = 10;                 // Seconds the watch command runs without --timeout
+    static constexpr std::uint64_t WATCH_MAX_TIMEOUT = 1000000;                // Longer timeouts are cut to this
+    static constexpr std::size_t WATCH_BATCH = 1024;                           // Changes the watch command prints per write
+    static constexpr Permissions IMPORT_PERMISSIONS = {Permissions::READ | Permissions::WRITE};
+
+    // Owns a descriptor of a file on the host.
+    struct HostFile {
+        int fd;
+
+        explicit HostFile(int fd) : fd(fd) {}
+        ~HostFile() {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        HostFile(const HostFile&) = delete;
+        HostFile& operator=(const HostFile&) = delete;
+    };
+
+    // File behind an open handle. Files keep their address in the map of
+    // their directory until they are deleted, or until a restore or rollback
+    // replaces the tree and the handles are bound again by inode.
+    struct OpenFile {
+        InodeId directory;
+        InodeId inode;
+        File* file;  // Null once the file is gone
+    };
+
+    struct Transaction {
+        struct Undo {
+            ExtentList extents;
+            std::size_t offset;
+            std::string bytes;
+        };
+
+        // A transaction belongs to a batch, which has the file system to itself
+        std::unordered_map<InodeId, Directory> directories;
+        BlockAllocator allocator;
+        BlockRefs refs;
+        ContentIndex contentIndex;
+        InodeId currentDirectory;
+        InodeId nextInode;
+        Journal::Mark journalMark;
+        std::vector<Undo> undo;
+        std::vector<Extent> deferredFrees;
+        std::vector<FileVersionPtr> pinned;  // Versions that took block references inside the transaction
+    };
+
+    // Gives back the block references of a pinned version once neither a
+    // snapshot nor a file refers to it.
+    struct VersionReleaser {
+        FileSystem* fileSystem;
+
+        void operator()(FileVersion* version) const {
+            if (version->pinned) {
+                fileSystem->releaseVersion(*version);
+            }
+            delete version;
+        }
+    };
+
+    using ReadLock = std::shared_lock<std::shared_mutex>;
+    using WriteLock = std::unique_lock<std::shared_mutex>;
 
-    std::unordered_map<std::string, Directory> directoryStructure;
-    std::unordered_map<std::string, std::bitset<1024>> fileAllocationMap;
-    std::bitset<1024> diskBlockMap; // Bitmap to track disk block allocation
-    std::string currentDirectory;  // Track the current directory
+    // Lock order: namespaceLock, then a directory, then a file in it. The
+    // table, dentry, handle, allocator, content index and journal locks are
+    // leaves held only briefly.
+    // Every command holds namespaceLock shared; only changes to the shape of
+    // the tree (mv, renaming a directory) and checkpoints take it exclusively.
+    std::shared_mutex namespaceLock;
+    std::shared_mutex tableLock;      // Guards inserts into directoryStructure
+    std::shared_mutex dentryLock;
+    std::mutex allocatorLock;         // Also guards blockRefs
+    std::mutex contentIndexLock;      // Guards contentIndex
+    std::shared_mutex handleLock;     // Guards openFiles, handlesByInode and nextHandle
+
+    std::unordered_map<InodeId, Directory> directoryStructure;  // Directory inode table
+    BlockAllocator blockAllocator;  // Tracks disk block allocation
+    BlockRefs blockRefs;            // Blocks shared by deduplication
+    std::atomic<bool> sharingActive{false};  // Whether blockRefs has entries, readable without the allocator lock
+    BlockHashIndex blockHashes;     // Blocks written since startup, for dedupWrites; guarded by allocatorLock
+    bool compressImage;
+    bool dedupWrites;
+    std::size_t maxFilesPerDirectory;
+    std::size_t maxDirectories;
+    Session console;                // Session of the interactive CLI and batches; its directory is saved in the image
+    std::atomic<InodeId> nextInode{ROOT_INODE + 1};
+    std::unordered_map<std::string, InodeId> dentryCache;  // Absolute directory path -> inode
+    std::map<std::string, Snapshot> snapshots;  // Guarded by namespaceLock
+    std::uint64_t snapshotEpoch = 0;            // Snapshots created since startup; guarded by namespaceLock
+    std::size_t openSnapshots = 0;              // Snapshots not materialized yet; guarded by namespaceLock
+    std::mutex captureLock;                     // Serializes captures of directories for open snapshots
+    ContentIndex contentIndex;                  // Trigrams of file content, for grep
+    std::unordered_set<InodeId> staleContent;   // Files whose index entries replay or a restore must rebuild from their blocks
+    std::unordered_map<std::uint64_t, OpenFile> openFiles;  // Handle id -> file
+    std::unordered_multimap<InodeId, std::uint64_t> handlesByInode;
+    std::uint64_t nextHandle = 1;
+
+    std::string imagePath;
+    std::string contentIndexPath;
+    BlockDevice blockDevice;          // Holds file content in the blocks listed by each file
+    BufferCache blockCache;           // All content I/O goes through it
+    Journal journal;
+    std::uint64_t checkpointLsn = 0;  // Last journal record contained in the image
+    std::unique_ptr<Transaction> transaction;  // Open while a transactional batch runs
+    std::atomic<bool> checkpointDue{false};    // Set by a mutation, run once its command has released its locks
+    Stats stats;
+    std::unique_ptr<TraceWriter> trace;        // Set while commands are being recorded
+    EventRing changes;                         // Every change, for watchers
+    std::unique_ptr<EventStream> changeStream; // Set while changes are streamed out
+    std::unique_ptr<PeriodicTask> changePump;  // Writes changeStream; stops before it goes away
+    std::unique_ptr<PeriodicTask> statsDump;   // Declared last so it stops before anything it reads goes away
 
 public:
-    FileSystem() {
+    explicit FileSystem(const FileSystemOptions& options = FileSystemOptions())
+        : blockAllocator(options.capacityBlocks), compressImage(options.compressImage), dedupWrites(options.dedupWrites),
+          maxFilesPerDirectory(options.maxFilesPerDirectory), maxDirectories(options.maxDirectories), imagePath(options.storagePath + ".dat"),
+          contentIndexPath(options.storagePath + ".index"), blockDevice(options.storagePath + ".blocks", options.storagePath + ".sums"),
+          blockCache(blockDevice, options.cache),
+          journal(options.storagePath + ".journal", options.journal), changes(options.watchEvents) {
+        // Dirty blocks are written before the records that refer to them, so
+        // replay after a crash never sees a size whose content was lost
+        journal.setWriteBarrier([this]() { blockCache.flush(); });
+        journal.setSyncBarrier([this]() { blockDevice.sync(); });
         loadFileSystem();
+
+        if (!options.tracePath.empty()) {
+            trace.reset(new TraceWriter(options.tracePath));
+        }
+        if (!options.watchPath.empty()) {
+            changeStream.reset(new EventStream(changes, options.watchPath));
+            changePump.reset(new PeriodicTask(WATCH_STREAM_INTERVAL, [this]() { changeStream->pump(); }));
+        }
+        if (!options.statsPath.empty()) {
+            std::string path = options.statsPath;
+            statsDump.reset(new PeriodicTask(options.statsInterval, [this, path]() { dumpStats(path); }));
+        }
     }
 
     ~FileSystem() {
+        checkpoint();
+        changePump.reset();
+        if (changeStream) {
+            changeStream->pump();
+        }
+        // Versions give back their blocks as they go, so drop them while the allocator still exists
+        snapshots.clear();
+        directoryStructure.clear();
+    }
+
+    void runCLI() {
+        std::cout << "Welcome to the CLI File System!\n";
+        printHelp(console);
+
+        std::string command;
+        while (true) {
+            std::cout << "\n";
+            std::cout << workingDirectory(console) << "> ";
+            if (!std::getline(std::cin, command)) {
+                break;
+            }
+
+            if (command.empty()) {
+                continue;
+            }
+
+            try {
+                if (!executeCommand(console, command)) {
+                    break;
+                }
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << "\n";
+            }
+        }
+    }
+
+    // Runs the commands in input without prompts. Output stays buffered, and
+    // the journal is committed every options.syncEvery commands or once at the
+    // end. A transactional batch stops at the first error and undoes every
+    // change it made. Returns the number of failed commands.
+    int runBatch(std::istream& input, const BatchOptions& options) {
+        console.verbose = !options.quiet;
+        journal.setDeferred(true);
+        if (options.transactional) {
+            beginTransaction();
+        }
+
+        int failures = 0;
+        std::size_t lineNumber = 0;
+        std::size_t sinceSync = 0;
+        std::string command;
+        std::vector<char> buffer(BATCH_READ_SIZE);
+        std::string pendingLine;
+        bool done = false;
+
+        // Read the script in large chunks rather than one getline per command
+        while (!done && (input.read(buffer.data(), buffer.size()) || input.gcount() > 0)) {
+            std::size_t size = static_cast<std::size_t>(input.gcount());
+            std::size_t start = 0;
+            while (!done) {
+                const char* newline = static_cast<const char*>(std::memchr(buffer.data() + start, '\n', size - start));
+                if (!newline) {
+                    pendingLine.append(buffer.data() + start, size - start);
+                    break;
+                }
+                std::size_t end = newline - buffer.data();
+                if (pendingLine.empty()) {
+                    command.assign(buffer.data() + start, end - start);
+                } else {
+                    command = pendingLine;
+                    command.append(buffer.data() + start, end - start);
+                    pendingLine.clear();
+                }
+                start = end + 1;
+                done = !runBatchCommand(command, ++lineNumber, options, failures, sinceSync);
+            }
+        }
+        if (!done && !pendingLine.empty()) {
+            runBatchCommand(pendingLine, ++lineNumber, options, failures, sinceSync);
+        }
+
+        if (transaction) {
+            commitTransaction();
+        }
+        persistBatch();
+        journal.setDeferred(false);
+        console.verbose = true;
+        console.out->flush();
+        return failures;
+    }
+
+    // Parses and executes one command line for session. Safe to call from
+    // several threads at once, each with its own session. Returns false when
+    // the command asks to exit.
+    bool executeCommand(Session& session, std::string_view command) {
+        CommandLine arguments(command);
+        if (arguments.empty()) {
+            return true;
+        }
+
+        Command name = lookupCommand(arguments[0]);
+        std::uint64_t start = Stats::now();
+        std::uint64_t traceStart = trace ? trace->now() : 0;
+        bool keepRunning;
+        try {
+            keepRunning = runCommand(session, name, arguments);
+        } catch (const std::exception& ex) {
+            stats.recordCommand(name, start, true);
+            if (trace) {
+                trace->record(session.id, traceStart, command, true, ex.what());
+            }
+            throw;
+        } catch (...) {
+            stats.recordCommand(name, start, true);
+            throw;
+        }
+        stats.recordCommand(name, start, false);
+        if (trace) {
+            trace->record(session.id, traceStart, command, false, {});
+        }
+
+        if (checkpointDue.exchange(false)) {
+            checkpoint();
+        }
+        return keepRunning;
+    }
+
+    bool executeCommand(std::string_view command) {
+        return executeCommand(console, command);
+    }
+
+    // Absolute path of the session's working directory.
+    std::string workingDirectory(const Session& session) {
+        ReadLock namespaceGuard(namespaceLock);
+        return pathOf(session.currentDirectory);
+    }
+
+    // Prints the changes to the directory at path, or the current one, as
+    // they happen, until count of them were printed or timeout passed. Holds
+    // no locks while it waits, so it never delays the changes it reports.
+    // A session with detachWatch set gets the request to run with
+    // continueWatch instead, so the command returns at once.
+    void watchDirectory(Session& session, const std::string& path, std::uint64_t count, std::chrono::milliseconds timeout) {
+        WatchRequest request;
+        {
+            ReadLock namespaceGuard(namespaceLock);
+            request.watcher.directory = path.empty() ? session.currentDirectory : resolveDirectory(session, path);
+            request.watcher.cursor = changes.head();
+        }
+        request.count = count;
+        request.deadline = std::chrono::steady_clock::now() + timeout;
+        if (session.detachWatch) {
+            session.watchRequest = request;
+            return;
+        }
+
+        std::string text;
+        for (bool running = true; running;) {
+            text.clear();
+            running = continueWatch(request, text, true);
+            *session.out << text << std::flush;
+        }
+    }
+
+    // Appends the next changes a watch has to print to text, waiting for them
+    // until its deadline when wait is set and taking only those published
+    // so far otherwise. Returns false once the watch is over.
+    bool continueWatch(WatchRequest& request, std::string& text, bool wait = false) const {
+        auto finished = [&request]() {
+            return (request.count != 0 && request.printed >= request.count) || std::chrono::steady_clock::now() >= request.deadline;
+        };
+        if (finished()) {
+            return false;
+        }
+        std::vector<WatchEvent> events;
+        std::uint64_t max = request.count == 0 ? WATCH_BATCH : std::min<std::uint64_t>(request.count - request.printed, WATCH_BATCH);
+        collectEvents(request.watcher, events, max, wait ? request.deadline : std::chrono::steady_clock::now());
+        if (request.watcher.lost > 0) {
+            text += "lost " + std::to_string(request.watcher.lost) + "\n";
+        }
+        for (const WatchEvent& event : events) {
+            formatEvent(event, text);
+        }
+        request.printed += events.size();
+        return !finished();
+    }
+
+    // Compacts the journal into the base image. Waits for every running
+    // command, so the image is a consistent snapshot.
+    void checkpoint() {
+        WriteLock namespaceGuard(namespaceLock);
+        journal.commit();
+        blockCache.sync();
         saveFileSystem();
+        journal.reset();
+    }
+
+private:
+    struct CommandHandler {
+        std::size_t arguments;  // Tokens required after the command name
+        const char* usage;
+        bool (*run)(FileSystem&, Session&, const CommandLine&);  // Returns false to exit
+    };
+
+    // Indexed by Command. Names are converted to std::string only where the
+    // directory maps need a key; short names fit in the string itself.
+    static const CommandHandler& handlerFor(Command command) {
+        static constexpr CommandHandler HANDLERS[] = {
+            {1, "cd <path>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.changeDirectory(session, std::string(args[1]));
+                return true;
+            }},
+            {3, "createfile <name> <permissions> <size>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.createFile(session, std::string(args[1]), std::string(args[2]), parseSize(args[3]));
+                return true;
+            }},
+            {2, "writefile [--at <offset>] <name> <content>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                if (args[1] != "--at") {
+                    fs.writeFile(session, std::string(args[1]), args.rest(2));
+                } else if (args.size() > 4) {
+                    fs.writeRange(session, std::string(args[3]), parseOffset(args[2]), args.rest(4));
+                } else {
+                    throw std::invalid_argument("Invalid command syntax! Usage: writefile [--at <offset>] <name> <content>");
+                }
+                return true;
+            }},
+            {1, "readfile <name> [<offset> <length>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                if (args.size() == 2) {
+                    fs.readFile(session, std::string(args[1]));
+                } else if (args.size() == 4) {
+                    fs.readRange(session, std::string(args[1]), parseOffset(args[2]), parseOffset(args[3]));
+                } else {
+                    throw std::invalid_argument("Invalid command syntax! Usage: readfile <name> [<offset> <length>]");
+                }
+                return true;
+            }},
+            {1, "deletefile <name>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.deleteFile(session, std::string(args[1]));
+                return true;
+            }},
+            {0, "ls [--sort name|size|permissions] [--prefix <prefix>] [--limit <n>] [--after <name>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.listDirectory(session, parseListOptions(args));
+                return true;
+            }},
+            {1, "find <pattern>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.findEntries(session, args[1]);
+                return true;
+            }},
+            {0, "du [<path>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.diskUsage(session, args.size() > 1 ? std::string(args[1]) : std::string());
+                return true;
+            }},
+            {0, "tree [<path>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.printTree(session, args.size() > 1 ? std::string(args[1]) : std::string());
+                return true;
+            }},
+            {1, "grep <term> [<path>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.grepContent(session, args[1], args.size() > 2 ? std::string(args[2]) : std::string());
+                return true;
+            }},
+            {1, "mkdir <name>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.createDirectory(session, std::string(args[1]));
+                return true;
+            }},
+            {2, "mv <source> <destination>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.moveDirectory(session, std::string(args[1]), std::string(args[2]));
+                return true;
+            }},
+            {2, "rename <old name> <new name>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.renameEntry(session, std::string(args[1]), std::string(args[2]));
+                return true;
+            }},
+            {2, "appendfile <name> <content>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.appendFile(session, std::string(args[1]), args.rest(2));
+                return true;
+            }},
+            {2, "truncate <name> <size>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.truncateFile(session, std::string(args[1]), parseSize(args[2]));
+                return true;
+            }},
+            {2, "fallocate <name> <size>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.fallocateFile(session, std::string(args[1]), parseSize(args[2]));
+                return true;
+            }},
+            {2, "import <host path> <name>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.importFile(session, std::string(args[1]), std::string(args[2]));
+                return true;
+            }},
+            {2, "export <name> <host path>", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.exportFile(session, std::string(args[1]), std::string(args[2]));
+                return true;
+            }},
+            {0, "dedup", [](FileSystem& fs, Session& session, const CommandLine&) {
+                fs.deduplicate(session);
+                return true;
+            }},
+            {0, "scrub", [](FileSystem& fs, Session& session, const CommandLine&) {
+                fs.scrub(session);
+                return true;
+            }},
+            {1, "snapshot create|list|restore|delete [<name>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                if (args[1] == "list" && args.size() == 2) {
+                    fs.listSnapshots(session);
+                } else if (args.size() != 3) {
+                    throw std::invalid_argument("Invalid command syntax! Usage: snapshot create|list|restore|delete [<name>]");
+                } else if (args[1] == "create") {
+                    fs.createSnapshot(session, std::string(args[2]));
+                } else if (args[1] == "restore") {
+                    fs.restoreSnapshot(session, std::string(args[2]));
+                } else if (args[1] == "delete") {
+                    fs.deleteSnapshot(session, std::string(args[2]));
+                } else {
+                    throw std::invalid_argument("Invalid command syntax! Usage: snapshot create|list|restore|delete [<name>]");
+                }
+                return true;
+            }},
+            {0, "watch [<path>] [--count <n>] [--timeout <seconds>]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                std::size_t i = 1;
+                std::string path;
+                if (i < args.size() && args[i].substr(0, 2) != "--") {
+                    path = std::string(args[i++]);
+                }
+                std::uint64_t count = 0;
+                std::uint64_t timeout = WATCH_DEFAULT_TIMEOUT;
+                for (; i < args.size(); i += 2) {
+                    if (i + 1 < args.size() && args[i] == "--count") {
+                        count = parseNumber(args[i + 1], "Invalid count!");
+                    } else if (i + 1 < args.size() && args[i] == "--timeout") {
+                        timeout = std::min(parseNumber(args[i + 1], "Invalid timeout!"), WATCH_MAX_TIMEOUT);
+                    } else {
+                        throw std::invalid_argument("Invalid command syntax! Usage: watch [<path>] [--count <n>] [--timeout <seconds>]");
+                    }
+                }
+                fs.watchDirectory(session, path, count, std::chrono::seconds(timeout));
+                return true;
+            }},
+            {0, "stats [json|prometheus]", [](FileSystem& fs, Session& session, const CommandLine& args) {
+                fs.printStats(session, args.size() > 1 ? args[1] : std::string_view());
+                return true;
+            }},
+            {0, "help", [](FileSystem& fs, Session& session, const CommandLine&) {
+                fs.printHelp(session);
+                return true;
+            }},
+            {0, "exit", [](FileSystem&, Session&, const CommandLine&) {
+                return false;
+            }},
+        };
+        static_assert(sizeof(HANDLERS) / sizeof(HANDLERS[0]) == COMMAND_COUNT, "Every command needs a handler");
+        return HANDLERS[static_cast<std::size_t>(command)];
+    }
+
+    bool runCommand(Session& session, Command command, const CommandLine& arguments) {
+        if (command == Command::Unknown) {
+            throw std::invalid_argument("Invalid command! Type 'help' to see the available commands.");
+        }
+        const CommandHandler& handler = handlerFor(command);
+        if (arguments.size() <= handler.arguments) {
+            throw std::invalid_argument(std::string("Invalid command syntax! Usage: ") + handler.usage);
+        }
+        return handler.run(*this, session, arguments);
+    }
+
+    static std::uint64_t parseNumber(std::string_view text, const char* error) {
+        std::uint64_t value = 0;
+        std::from_chars_result result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (text.empty() || result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+            throw std::invalid_argument(error);
+        }
+        return value;
+    }
+
+    static ListOptions parseListOptions(const CommandLine& args) {
+        ListOptions options;
+        for (std::size_t i = 1; i < args.size(); i += 2) {
+            if (i + 1 >= args.size()) {
+                throw std::invalid_argument("Invalid command syntax! Usage: ls [--sort name|size|permissions] [--prefix <prefix>] [--limit <n>] [--after <name>]");
+            }
+            std::string_view flag = args[i];
+            std::string_view value = args[i + 1];
+            if (flag == "--sort" && value == "name") {
+                options.order = ListOptions::Order::Name;
+            } else if (flag == "--sort" && value == "size") {
+                options.order = ListOptions::Order::Size;
+            } else if (flag == "--sort" && value == "permissions") {
+                options.order = ListOptions::Order::Permissions;
+            } else if (flag == "--prefix") {
+                options.prefix = std::string(value);
+            } else if (flag == "--limit") {
+                options.limit = parseNumber(value, "Invalid listing limit!");
+            } else if (flag == "--after") {
+                options.after = std::string(value);
+                options.hasAfter = true;
+            } else {
+                throw std::invalid_argument("Invalid command syntax! Usage: ls [--sort name|size|permissions] [--prefix <prefix>] [--limit <n>] [--after <name>]");
+            }
+        }
+        return options;
+    }
+
+    static std::uint64_t parseSize(std::string_view text) {
+        return parseNumber(text, "Invalid file size!");
+    }
+
+    static std::uint64_t parseOffset(std::string_view text) {
+        return parseNumber(text, "Invalid offset or length!");
+    }
+
+    // Runs one line of a batch. Returns false once the batch has to stop.
+    bool runBatchCommand(std::string& command, std::size_t lineNumber, const BatchOptions& options, int& failures, std::size_t& sinceSync) {
+        if (!command.empty() && command.back() == '\r') {
+            command.pop_back();
+        }
+        if (command.empty()) {
+            return true;
+        }
+
+        try {
+            if (!executeCommand(console, command)) {
+                return false;
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "Error (line " << lineNumber << "): " << ex.what() << "\n";
+            ++failures;
+            if (transaction) {
+                rollbackTransaction();
+                std::cerr << "Batch rolled back.\n";
+                return false;
+            }
+        }
+
+        if (!transaction && options.syncEvery > 0 && ++sinceSync >= options.syncEvery) {
+            persistBatch();
+            sinceSync = 0;
+        }
+        return true;
+    }
+
+    void persistBatch() {
+        journal.commit();
+        journal.sync();
+        if (journal.needsCheckpoint()) {
+            checkpoint();
+        }
+    }
+
+    // A transaction keeps a copy of the metadata, the journal position and the
+    // previous bytes of every overwritten range, so it can be undone without
+    // touching the image. Blocks freed inside it stay reserved until commit.
+    void beginTransaction() {
+        ReadLock namespaceGuard(namespaceLock);
+        transaction.reset(new Transaction());
+        transaction->directories = directoryStructure;
+        transaction->allocator = blockAllocator;
+        transaction->refs = blockRefs;
+        transaction->contentIndex = contentIndex;
+        transaction->currentDirectory = console.currentDirectory;
+        transaction->nextInode = nextInode;
+        transaction->journalMark = journal.mark();
+    }
+
+    void commitTransaction() {
+        std::unique_ptr<Transaction> finished = std::move(transaction);
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        for (const Extent& extent : finished->deferredFrees) {
+            blockAllocator.release(extent);
+            stats.add(Stats::Counter::BlocksFreed, extent.length);
+        }
+    }
+
+    void rollbackTransaction() {
+        WriteLock namespaceGuard(namespaceLock);
+        std::unique_ptr<Transaction> finished = std::move(transaction);
+        for (auto undo = finished->undo.rbegin(); undo != finished->undo.rend(); ++undo) {
+            blockCache.write(undo->extents, undo->offset, undo->bytes.data(), undo->bytes.size());
+        }
+
+        for (const FileVersionPtr& version : finished->pinned) {
+            version->pinned = false;  // The references it took are undone with blockRefs
+        }
+        directoryStructure = std::move(finished->directories);
+        blockAllocator = std::move(finished->allocator);
+        blockRefs = std::move(finished->refs);
+        contentIndex = std::move(finished->contentIndex);
+        sharingActive = !blockRefs.empty();
+        blockHashes.clear();  // Listed blocks may hold the old bytes again, or be free
+        console.currentDirectory = finished->currentDirectory;
+        nextInode = finished->nextInode;
+        journal.rollback(finished->journalMark);
+        dentryCache.clear();
+        rebindHandles();
+        changes.publish(WatchOp::Restore, ROOT_INODE, ROOT_INODE, 0, 0, "");
+    }
+
+    // Writes file content in place, saving the visible bytes it replaces when
+    // a transaction may need to restore them. Shared blocks in the range are
+    // copied first, so the other owners keep their content. With dedupWrites,
+    // whole blocks whose bytes are already stored share that block instead.
+    void writeContent(const Directory& dir, File& file, std::size_t offset, std::string_view content) {
+        if (dedupWrites) {
+            forgetBlockHashes(file, offset, content.size());
+        }
+        unshareBlocks(dir, file, offset, content.size());
+        if (transaction && offset < file.contentSize) {
+            std::size_t length = std::min(content.size(), file.contentSize - offset);
+            Transaction::Undo undo = {file.extents, offset, std::string(length, '\0')};
+            blockCache.read(file.extents, offset, &undo.bytes[0], length);
+            transaction->undo.push_back(std::move(undo));
+        }
+        if (!dedupWrites) {
+            blockCache.write(file.extents, offset, content.data(), content.size());
+            return;
+        }
+
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> written;  // Hash and block of each whole block written
+        std::vector<std::uint64_t> shared = shareStoredBlocks(dir, file, offset, content, written);
+        std::size_t at = 0;
+        for (std::uint64_t logical : shared) {
+            std::size_t from = logical * BlockDevice::BLOCK_SIZE - offset;
+            blockCache.write(file.extents, offset + at, content.data() + at, from - at);
+            at = from + BlockDevice::BLOCK_SIZE;
+        }
+        blockCache.write(file.extents, offset + at, content.data() + at, content.size() - at);
+
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        for (const auto& block : written) {
+            blockHashes.add(block.second, block.first);
+        }
+    }
+
+    // Unlists the blocks a write is about to change, before their copies are
+    // made, so no other file starts sharing one once it has been checked.
+    // Caller holds the file exclusively.
+    void forgetBlockHashes(const File& file, std::uint64_t offset, std::uint64_t length) {
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        if (length == 0 || blockHashes.empty()) {
+            return;
+        }
+        forEachBlock(file.extents, offset / BlockDevice::BLOCK_SIZE, blocksFor(offset + length),
+                     [&](std::uint64_t, std::uint64_t physical) { blockHashes.forget(physical); });
+    }
+
+    // Points each whole block of content at a listed block holding the same
+    // bytes, confirmed byte by byte, and gives back the file's own block.
+    // Returns the logical blocks now shared, which are not written; the hash
+    // of every other whole block goes in written, to be listed once its bytes
+    // are in place. Caller holds the file exclusively, with the range
+    // allocated and unshared.
+    std::vector<std::uint64_t> shareStoredBlocks(const Directory& dir, File& file, std::uint64_t offset, std::string_view content,
+                                                 std::vector<std::pair<std::uint64_t, std::uint64_t>>& written) {
+        std::uint64_t first = blocksFor(offset);
+        std::uint64_t end = (offset + content.size()) / BlockDevice::BLOCK_SIZE;
+        std::vector<std::uint64_t> shared;
+        if (first >= end) {
+            return shared;
+        }
+        std::vector<std::uint64_t> hashes;  // Hashed before taking the lock
+        for (std::uint64_t logical = first; logical < end; ++logical) {
+            hashes.push_back(hashBlock(content.data() + (logical * BlockDevice::BLOCK_SIZE - offset)));
+        }
+
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            std::vector<std::uint64_t> matches;  // Stored block for each shared logical block
+            std::vector<char> stored(BlockDevice::BLOCK_SIZE);
+            forEachBlock(file.extents, first, end, [&](std::uint64_t logical, std::uint64_t physical) {
+                std::uint64_t hash = hashes[logical - first];
+                std::uint64_t candidate;
+                if (blockHashes.find(hash, candidate) && candidate != physical && blockAllocator.isAllocated(candidate)) {
+                    blockCache.read({{candidate, 1}}, 0, stored.data(), stored.size());
+                    if (std::memcmp(stored.data(), content.data() + (logical * BlockDevice::BLOCK_SIZE - offset), stored.size()) == 0) {
+                        shared.push_back(logical);
+                        matches.push_back(candidate);
+                        return;
+                    }
+                }
+                written.emplace_back(hash, physical);
+            });
+            if (shared.empty()) {
+                return shared;
+            }
+
+            std::vector<std::uint64_t> blocks = expandExtents(file.extents);
+            for (std::size_t i = 0; i < shared.size(); ++i) {
+                std::uint64_t old = blocks[shared[i]];
+                blocks[shared[i]] = matches[i];
+                blockRefs.addOwner(matches[i]);
+                releaseExtent({old, 1});
+            }
+            file.extents = compactExtents(blocks);
+            sharingActive = true;
+        }
+
+        logBlocks(dir, file);
+        stats.add(Stats::Counter::DedupedBlocks, shared.size());
+        return shared;
+    }
+
+    static std::uint64_t blocksFor(std::uint64_t bytes) {
+        return (bytes + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE;
+    }
+
+    // Device block right after the last allocated block before logical block
+    // first, or Extent::HOLE when there is none.
+    static std::uint64_t blockAfter(const ExtentList& extents, std::uint64_t first) {
+        std::uint64_t goal = Extent::HOLE;
+        std::uint64_t logical = 0;
+        for (const Extent& extent : extents) {
+            if (logical >= first) {
+                break;
+            }
+            if (!extent.hole()) {
+                goal = extent.start + std::min(extent.length, first - logical);
+            }
+            logical += extent.length;
+        }
+        return goal;
+    }
+
+    // Gives device blocks to the holes among the blocks of bytes
+    // [offset, offset + length). The blocks right after the ones before the
+    // range are preferred, so a file written front to back stays in one
+    // extent. Fresh blocks are zeroed where they hold content, except for
+    // the range itself when the caller is about to write it, so holes keep
+    // reading as zeros. Returns false when every block was allocated
+    // already; otherwise the caller logs the new block list. Caller holds
+    // the file exclusively.
+    bool allocateRange(File& file, std::uint64_t offset, std::uint64_t length, bool writing) {
+        std::uint64_t first = offset / BlockDevice::BLOCK_SIZE;
+        std::uint64_t end = blocksFor(offset + length);
+        std::vector<Extent> holes = holesIn(file.extents, first, end);
+        if (holes.empty()) {
+            return false;
+        }
+        std::uint64_t count = 0;
+        for (const Extent& hole : holes) {
+            count += hole.length;
+        }
+
+        std::uint64_t start = Stats::now();
+        ExtentList fresh;
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            if (count > blockAllocator.freeBlocks()) {
+                throw FileSystemError(Status::NoSpace, "Insufficient storage space to allocate file blocks!");
+            }
+            std::uint64_t goal = blockAfter(file.extents, holes.front().start);
+            if (goal != Extent::HOLE && blockAllocator.isFree(goal, count)) {
+                fresh.push_back({goal, count});
+            } else {
+                fresh = findFreeBlocks(count);
+            }
+            for (const Extent& extent : fresh) {
+                blockAllocator.reserve(extent);
+            }
+        }
+        stats.add(Stats::Counter::BlocksAllocated, count);
+        stats.recordOperation(Stats::Operation::Allocate, start);
+        file.extents = fillHoles(file.extents, first, end, fresh);
+
+        std::uint64_t keepFrom = writing ? offset : 0;
+        std::uint64_t keepTo = writing ? offset + length : 0;
+        for (const Extent& hole : holes) {
+            std::uint64_t from = hole.start * BlockDevice::BLOCK_SIZE;
+            std::uint64_t to = std::min((hole.start + hole.length) * BlockDevice::BLOCK_SIZE, file.contentSize);
+            writeZeros(file.extents, from, std::min(to, std::max(from, keepFrom)));
+            writeZeros(file.extents, std::max(from, keepTo), to);
+        }
+        return true;
+    }
+
+    // Zeroes bytes [from, to) of allocated blocks, bypassing copy-on-write
+    // and undo; only for blocks nothing else can see yet.
+    void writeZeros(const ExtentList& extents, std::uint64_t from, std::uint64_t to) {
+        static const std::vector<char> zeros(READ_CHUNK_SIZE);
+        while (from < to) {
+            std::size_t chunk = std::min<std::uint64_t>(to - from, zeros.size());
+            blockCache.write(extents, from, zeros.data(), chunk);
+            from += chunk;
+        }
+    }
+
+    // Grows the content to size with zeros. Allocated blocks past the old
+    // end, such as those reserved by fallocate or kept by a shorter write,
+    // are cleared; the rest of the new range is a hole. Returns whether the
+    // block list changed, for the caller to log along with the new size.
+    // Caller holds the file exclusively and has called fileChanged.
+    bool extendContent(const Directory& dir, File& file, std::uint64_t size) {
+        std::uint64_t from = file.contentSize;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> allocated;  // Byte ranges to clear
+        std::uint64_t logical = 0;
+        for (const Extent& extent : file.extents) {
+            std::uint64_t begin = std::max(from, logical * BlockDevice::BLOCK_SIZE);
+            std::uint64_t end = std::min(size, (logical + extent.length) * BlockDevice::BLOCK_SIZE);
+            if (!extent.hole() && begin < end) {
+                allocated.emplace_back(begin, end);
+            }
+            logical += extent.length;
+        }
+        static const std::string zeros(READ_CHUNK_SIZE, '\0');
+        for (const auto& range : allocated) {
+            for (std::uint64_t at = range.first; at < range.second; at += zeros.size()) {
+                std::size_t chunk = std::min<std::uint64_t>(range.second - at, zeros.size());
+                writeContent(dir, file, at, std::string_view(zeros.data(), chunk));
+            }
+        }
+
+        bool padded = logical < blocksFor(size);
+        if (padded) {
+            appendRun(file.extents, {Extent::HOLE, blocksFor(size) - logical});
+        }
+        file.contentSize = size;
+        indexWrite(file, from, std::string_view(zeros.data(), std::min<std::uint64_t>(size - from, 3)));
+        return padded;
+    }
+
+    // Records a file's new block list. Blocks it dropped are freed only
+    // afterwards, so replay never sees them owned twice.
+    void logBlocks(const Directory& dir, const File& file) {
+        logMutation(JournalOp::RemapBlocks, {std::to_string(dir.inode), file.name.str(), encodeExtents(file.extents)});
+    }
+
+    // Writes a byte range of the content to out through a bounded buffer.
+    void streamContent(const File& file, std::uint64_t offset, std::uint64_t length, std::ostream& out) {
+        std::vector<char> buffer(std::min<std::uint64_t>(length, READ_CHUNK_SIZE));
+        for (std::uint64_t done = 0; done < length; done += buffer.size()) {
+            std::size_t chunk = std::min<std::uint64_t>(buffer.size(), length - done);
+            blockCache.read(file.extents, offset + done, buffer.data(), chunk);
+            out.write(buffer.data(), chunk);
+        }
+    }
+
+    // Passes the content of file to visit in windows, each starting with the
+    // last overlap bytes of the one before, so a run of up to overlap + 1
+    // bytes is always seen whole; visit returns false to stop. Content larger
+    // than one read chunk is read from the device once its dirty blocks are
+    // written back, so scanning a big file does not push the rest out of the
+    // cache. Caller holds the file at least shared.
+    template <typename Visit>
+    void scanContent(const File& file, std::size_t overlap, Visit visit) {
+        if (file.contentSize <= READ_CHUNK_SIZE) {
+            std::string content(file.contentSize, '\0');
+            blockCache.read(file.extents, 0, &content[0], content.size());
+            visit(std::string_view(content));
+            return;
+        }
+        blockCache.writeBack(file.extents, 0, file.contentSize);
+        std::vector<char> buffer(SCAN_CHUNK_SIZE + overlap);
+        std::size_t kept = 0;
+        for (std::uint64_t done = 0; done < file.contentSize;) {
+            std::size_t chunk = std::min<std::uint64_t>(SCAN_CHUNK_SIZE, file.contentSize - done);
+            blockDevice.read(file.extents, done, buffer.data() + kept, chunk);
+            done += chunk;
+            std::size_t size = kept + chunk;
+            if (!visit(std::string_view(buffer.data(), size))) {
+                return;
+            }
+            kept = std::min(overlap, size);
+            std::memmove(buffer.data(), buffer.data() + size - kept, kept);
+        }
+    }
+
+    bool contentHolds(const File& file, std::string_view term) {
+        bool found = false;
+        scanContent(file, term.size() - 1, [&](std::string_view window) {
+            found = findSubstring(window, term) != std::string_view::npos;
+            return !found;
+        });
+        return found;
+    }
+
+    // Rebuilds the index entry of file from its whole content.
+    void indexContent(const File& file) {
+        TrigramSet trigrams;
+        scanContent(file, 2, [&trigrams](std::string_view window) {
+            trigrams.add(window);
+            return true;
+        });
+        std::vector<std::uint32_t> found = trigrams.take();
+        std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+        contentIndex.replace(file.inode, std::move(found));
+    }
+
+    // Adds the trigrams of content just written at offset to the index entry
+    // of file, with the ones that span the edges of the range. Caller holds
+    // the file exclusively and has already updated its content size.
+    void indexWrite(const File& file, std::uint64_t offset, std::string_view content) {
+        std::uint64_t end = offset + content.size();
+        std::size_t before = std::min<std::uint64_t>(offset, 2);
+        std::size_t after = std::min<std::uint64_t>(file.contentSize - end, 2);
+        std::string window(before, '\0');
+        blockCache.read(file.extents, offset - before, &window[0], before);
+        window.append(content.data(), content.size());
+        window.resize(before + content.size() + after);
+        blockCache.read(file.extents, end, &window[before + content.size()], after);
+
+        std::vector<std::uint32_t> trigrams = TrigramSet::of(window);
+        std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+        contentIndex.add(file.inode, trigrams);
+    }
+
+    // Rebuilds the index entries of the files in staleContent; entries of
+    // files that no longer exist were removed with them.
+    void indexStaleContent() {
+        if (staleContent.empty()) {
+            return;
+        }
+        for (auto& entry : directoryStructure) {
+            for (const auto& fileEntry : entry.second.files) {
+                if (staleContent.count(fileEntry.second.inode)) {
+                    indexContent(fileEntry.second);
+                }
+            }
+        }
+        staleContent.clear();
+    }
+
+    // Checks that name can be added to dir and sets up a new file. Files
+    // start without blocks; they are allocated as content is written. The
+    // caller holds dir exclusively and inserts the file.
+    File prepareFile(const Directory& dir, const std::string& name, Permissions permissions, std::uint64_t size) {
+        if (dir.files.find(name) != dir.files.end()) {
+            throw FileSystemError(Status::AlreadyExists, "File already exists in the current directory!");
+        }
+        validateEntrynonExistence(dir, name);
+        if (dir.files.size() >= maxFilesPerDirectory) {
+            throw FileSystemError(Status::LimitReached, "Maximum number of files in the directory reached!");
+        }
+
+        File newFile;
+        newFile.name = Name(name);
+        newFile.permissions = permissions;
+        newFile.fileSize = size;
+        newFile.inode = nextInode++;
+        return newFile;
+    }
+
+    void report(Session& session, const char* message) {
+        if (session.verbose) {
+            *session.out << message << '\n';
+        }
+    }
+
+    // Changes shared by the commands and the library API, which differ only
+    // in how they find the file and report the outcome. The caller holds the
+    // directory at least shared and the file exclusively.
+    void replaceContent(const Directory& dir, File& file, std::string_view content) {
+        if (content.size() > file.fileSize) {
+            throw FileSystemError(Status::FileTooLarge, "File size exceeded!");
+        }
+
+        // Content goes to the blocks first; the journal only records the new size.
+        // Blocks past the new content are given back as truncate does
+        fileChanged(dir, file);
+        std::int64_t sizeDelta = static_cast<std::int64_t>(content.size()) - static_cast<std::int64_t>(file.contentSize);
+        if (allocateRange(file, 0, content.size(), true)) {
+            logBlocks(dir, file);
+        }
+        writeContent(dir, file, 0, content);
+        file.contentSize = content.size();
+        std::uint64_t blocks = blocksFor(content.size());
+        std::uint64_t oldBlocks = blockCount(file.extents);
+        ExtentList dropped = sliceExtents(file.extents, blocks, oldBlocks);
+        if (oldBlocks > blocks) {
+            file.extents = sliceExtents(file.extents, 0, blocks);
+        }
+        {
+            std::vector<std::uint32_t> trigrams = TrigramSet::of(content);
+            std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+            contentIndex.replace(file.inode, std::move(trigrams));
+        }
+
+        logMutation(JournalOp::WriteFile, {std::to_string(dir.inode), file.name.str()}, content.size());
+        if (oldBlocks > blocks) {
+            logBlocks(dir, file);
+        }
+        deallocateFileBlocks(dropped);
+        changes.publish(WatchOp::Write, dir.inode, file.inode, 0, sizeDelta, file.name.view());
+    }
+
+    // Overwrites length bytes at offset and keeps the content after them.
+    // The range may extend the content. A range that starts past the end
+    // leaves a hole, which reads as zeros and takes no blocks.
+    void writeAt(const Directory& dir, File& file, std::uint64_t offset, std::string_view content) {
+        if (offset > file.fileSize || content.size() > file.fileSize - offset) {
+            throw FileSystemError(Status::FileTooLarge, "File size exceeded!");
+        }
+
+        fileChanged(dir, file);
+        std::uint64_t oldSize = file.contentSize;
+        bool remapped = offset > file.contentSize && extendContent(dir, file, offset);
+        remapped = allocateRange(file, offset, content.size(), true) || remapped;
+        if (remapped) {
+            logBlocks(dir, file);
+        }
+        writeContent(dir, file, offset, content);
+        file.contentSize = std::max<std::size_t>(file.contentSize, offset + content.size());
+        indexWrite(file, offset, content);
+
+        logMutation(JournalOp::WriteFile, {std::to_string(dir.inode), file.name.str()}, file.contentSize);
+        changes.publish(WatchOp::Write, dir.inode, file.inode, 0, static_cast<std::int64_t>(file.contentSize - oldSize), file.name.view());
+    }
+
+    void appendContent(const Directory& dir, File& file, std::string_view content) {
+        std::size_t newSize = file.contentSize + content.size();
+        if (newSize > file.fileSize) {
+            throw FileSystemError(Status::FileTooLarge, "File size exceeded!");
+        }
+
+        fileChanged(dir, file);
+        std::uint64_t offset = file.contentSize;
+        if (allocateRange(file, offset, content.size(), true)) {
+            logBlocks(dir, file);
+        }
+        writeContent(dir, file, offset, content);
+        file.contentSize = newSize;
+        indexWrite(file, offset, content);
+
+        logMutation(JournalOp::AppendFile, {std::to_string(dir.inode), file.name.str()}, newSize);
+        changes.publish(WatchOp::Append, dir.inode, file.inode, 0, static_cast<std::int64_t>(content.size()), file.name.view());
+    }
+
+    // Sets the content size. Content past size is dropped and the blocks
+    // wholly past it are freed, fallocated ones included; growing adds zeros
+    // as a hole. The declared size stays the limit.
+    void resizeContent(const Directory& dir, File& file, std::uint64_t size) {
+        if (size > file.fileSize) {
+            throw FileSystemError(Status::FileTooLarge, "File size exceeded!");
+        }
+
+        fileChanged(dir, file);
+        std::int64_t sizeDelta = static_cast<std::int64_t>(size) - static_cast<std::int64_t>(file.contentSize);
+        std::uint64_t blocks = blocksFor(size);
+        std::uint64_t oldBlocks = blockCount(file.extents);
+        ExtentList dropped = sliceExtents(file.extents, blocks, oldBlocks);
+        if (oldBlocks > blocks) {
+            file.extents = sliceExtents(file.extents, 0, blocks);
+        }
+
+        // Replay must never see content without blocks: a growing file logs
+        // its blocks first, a shrinking one its size
+        if (size > file.contentSize) {
+            bool padded = extendContent(dir, file, size);
+            if (padded || oldBlocks > blocks) {
+                logBlocks(dir, file);
+            }
+            logMutation(JournalOp::WriteFile, {std::to_string(dir.inode), file.name.str()}, size);
+        } else {
+            file.contentSize = size;
+            logMutation(JournalOp::WriteFile, {std::to_string(dir.inode), file.name.str()}, size);
+            if (oldBlocks > blocks) {
+                logBlocks(dir, file);
+            }
+        }
+        deallocateFileBlocks(dropped);
+        changes.publish(WatchOp::Truncate, dir.inode, file.inode, 0, sizeDelta, file.name.view());
+    }
+
+    // Reserves blocks for bytes [0, size) in one extent where free space
+    // allows, without changing the content, so later writes there allocate
+    // nothing. truncate and writefile give back what the content does not reach.
+    void reserveContent(const Directory& dir, File& file, std::uint64_t size) {
+        if (size > file.fileSize) {
+            throw FileSystemError(Status::FileTooLarge, "File size exceeded!");
+        }
+
+        fileChanged(dir, file);
+        if (allocateRange(file, 0, size, false)) {
+            logBlocks(dir, file);
+        }
+    }
+
+    // The caller holds dir exclusively.
+    const File& addNewFile(Directory& dir, const std::string& name, Permissions permissions, std::uint64_t size) {
+        File prepared = prepareFile(dir, name, permissions, size);
+        directoryChanged(dir);
+        const File& newFile = addFile(dir, std::move(prepared));
+
+        logMutation(JournalOp::CreateFile, {std::to_string(dir.inode), std::to_string(newFile.inode), name, permissions.str(),
+                                            encodeExtents(newFile.extents)}, size);
+        changes.publish(WatchOp::Create, dir.inode, newFile.inode, 0, 0, name);
+        return newFile;
+    }
+
+    // The caller holds dir exclusively.
+    void removeFile(Directory& dir, const std::string& name) {
+        const File& file = findFile(dir, name);
+        InodeId inode = file.inode;
+        std::int64_t sizeDelta = -static_cast<std::int64_t>(file.contentSize);
+
+        // Log before the blocks are freed, so a later record can never claim
+        // blocks that replay still sees as owned by this file
+        logMutation(JournalOp::DeleteFile, {std::to_string(dir.inode), name});
+        applyDeleteFile(dir.inode, name);
+        changes.publish(WatchOp::Delete, dir.inode, inode, 0, sizeDelta, name);
+    }
+
+    // The caller holds parent exclusively.
+    InodeId makeDirectory(Directory& parent, const std::string& name) {
+        validateEntrynonExistence(parent, name);
+        {
+            // Checked here rather than in replay, so a journal never fails to apply under a lower limit
+            ReadLock tableGuard(tableLock);
+            if (directoryStructure.size() >= maxDirectories) {
+                throw FileSystemError(Status::LimitReached, "File system reached maximum directory limit!");
+            }
+        }
+
+        InodeId inode = nextInode++;
+        applyCreateDirectory(parent.inode, inode, name);
+
+        logMutation(JournalOp::CreateDirectory, {std::to_string(parent.inode), std::to_string(inode), name});
+        changes.publish(WatchOp::MakeDirectory, parent.inode, inode, 0, 0, name);
+        return inode;
+    }
+
+    // Caller holds file at least shared.
+    static FileStat statFile(const File& file) {
+        FileStat stat;
+        stat.inode = file.inode;
+        stat.permissions = file.permissions;
+        stat.fileSize = file.fileSize;
+        stat.contentSize = file.contentSize;
+        for (const Extent& extent : file.extents) {
+            stat.blocks += extent.hole() ? 0 : extent.length;
+        }
+        return stat;
+    }
+
+public:
+    // Commands, callable directly without parsing a command line. Each one
+    // takes the locks it needs, so several threads may call them at once as
+    // long as each uses its own session.
+    void changeDirectory(Session& session, const std::string& path) {
+        ReadLock namespaceGuard(namespaceLock);
+        session.currentDirectory = resolveDirectory(session, path);
+        *session.out << "Changed directory to: " << pathOf(session.currentDirectory) << '\n';
+    }
+
+    void createFile(Session& session, const std::string& name, const std::string& permissions, std::uint64_t size) {
+        validateFileName(name);
+        validateFileSize(size);
+        Permissions mode = Permissions::parse(permissions);
+
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        WriteLock directoryGuard(currentDir.lock.mutex);
+        addNewFile(currentDir, name, mode, size);
+        report(session, "File created successfully.");
+    }
+
+    void writeFile(Session& session, const std::string& name, std::string_view content) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        File& file = findFile(currentDir, name);
+        WriteLock fileGuard(file.lock.mutex);
+        replaceContent(currentDir, file, content);
+        report(session, "File written successfully.");
+    }
+
+    void writeRange(Session& session, const std::string& name, std::uint64_t offset, std::string_view content) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        File& file = findFile(currentDir, name);
+        WriteLock fileGuard(file.lock.mutex);
+        writeAt(currentDir, file, offset, content);
+        report(session, "File written successfully.");
+    }
+
+    void readFile(Session& session, const std::string& name) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        const File& file = findFile(currentDir, name);
+        ReadLock fileGuard(file.lock.mutex);
+        *session.out << "File content:\n";
+        streamContent(file, 0, file.contentSize, *session.out);
+        *session.out << '\n';
+    }
+
+    // Prints up to length bytes starting at offset; the range is cut off at
+    // the end of the content.
+    void readRange(Session& session, const std::string& name, std::uint64_t offset, std::uint64_t length) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        const File& file = findFile(currentDir, name);
+        ReadLock fileGuard(file.lock.mutex);
+
+        if (offset > file.contentSize) {
+            throw std::invalid_argument("Offset is past the end of the file!");
+        }
+        *session.out << "File content:\n";
+        streamContent(file, offset, std::min<std::uint64_t>(length, file.contentSize - offset), *session.out);
+        *session.out << '\n';
+    }
+
+    // Creates a file holding a copy of a host file. The copy goes from file
+    // to device in the kernel where it can, and the new file only becomes
+    // visible once all of it is stored.
+    void importFile(Session& session, const std::string& hostPath, const std::string& name) {
+        validateFileName(name);
+        HostFile in(::open(hostPath.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (in.fd < 0 || ::fstat(in.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            throw std::runtime_error("Cannot read " + hostPath + "!");
+        }
+        std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        WriteLock directoryGuard(currentDir.lock.mutex);
+        File newFile = prepareFile(currentDir, name, IMPORT_PERMISSIONS, std::max<std::uint64_t>(size, 1));
+        allocateFileBlocks(newFile, size);
+        try {
+            // The blocks may still be cached from a deleted file
+            blockCache.discard(newFile.extents, 0, size);
+            blockDevice.copyFrom(in.fd, 0, newFile.extents, 0, size);
+        } catch (...) {
+            deallocateFileBlocks(newFile.extents);
+            throw;
+        }
+        newFile.contentSize = size;
+        indexContent(newFile);
+        directoryChanged(currentDir);
+        const File& added = addFile(currentDir, std::move(newFile));
+
+        logMutation(JournalOp::CreateFile, {std::to_string(currentDir.inode), std::to_string(added.inode), name, added.permissions.str(),
+                                            encodeExtents(added.extents)}, added.fileSize);
+        logMutation(JournalOp::WriteFile, {std::to_string(currentDir.inode), name}, size);
+        changes.publish(WatchOp::Create, currentDir.inode, added.inode, 0, static_cast<std::int64_t>(size), name);
+        report(session, "File imported successfully.");
+    }
+
+    // Copies the content of a file to a host file, replacing it.
+    void exportFile(Session& session, const std::string& name, const std::string& hostPath) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        const File& file = findFile(currentDir, name);
+        ReadLock fileGuard(file.lock.mutex);
+
+        HostFile out(::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (out.fd < 0) {
+            throw std::runtime_error("Cannot write " + hostPath + "!");
+        }
+        blockCache.writeBack(file.extents, 0, file.contentSize);
+        blockDevice.copyTo(file.extents, 0, file.contentSize, out.fd, 0);
+        report(session, "File exported successfully.");
+    }
+
+    void deleteFile(Session& session, const std::string& name) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        WriteLock directoryGuard(currentDir.lock.mutex);
+        removeFile(currentDir, name);
+        report(session, "File deleted successfully.");
+    }
+
+    // Prints the paths of files and directories below the current directory
+    // whose names match pattern, where * matches any run of characters and ?
+    // any one character.
+    void findEntries(Session& session, std::string_view pattern) {
+        ReadLock namespaceGuard(namespaceLock);
+        auto found = walkTree<std::vector<std::string>>(session.currentDirectory, [pattern](const Directory& dir, const std::string& path) {
+            std::vector<std::string> matches;
+            for (const auto& fileEntry : dir.files) {
+                if (globMatch(pattern, fileEntry.first)) {
+                    matches.push_back(childPath(path, fileEntry.first));
+                }
+            }
+            for (const auto& subdir : dir.subdirectories) {
+                if (globMatch(pattern, subdir.first)) {
+                    matches.push_back(childPath(path, subdir.first));
+                }
+            }
+            return matches;
+        });
+        printPaths(session, found);
+    }
+
+    // Prints the paths of files below path, or below the current directory,
+    // whose content holds term. The trigram index narrows the search to the
+    // files that hold every trigram of the term, and only those are read;
+    // terms shorter than three bytes read every file.
+    void grepContent(Session& session, std::string_view term, const std::string& path) {
+        if (term.empty()) {
+            throw std::invalid_argument("Search term cannot be empty!");
+        }
+        ReadLock namespaceGuard(namespaceLock);
+        InodeId root = path.empty() ? session.currentDirectory : resolveDirectory(session, path);
+        std::vector<InodeId> candidates;
+        bool filtered;
+        {
+            std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+            filtered = contentIndex.candidates(term, candidates);
+        }
+        if (filtered && candidates.empty()) {
+            return;
+        }
+
+        auto found = walkTree<std::vector<std::string>>(root, [&](const Directory& dir, const std::string& dirPath) {
+            std::vector<std::string> matches;
+            for (const auto& fileEntry : dir.files) {
+                const File& file = fileEntry.second;
+                if (filtered && !std::binary_search(candidates.begin(), candidates.end(), file.inode)) {
+                    continue;
+                }
+                ReadLock fileGuard(file.lock.mutex);
+                if (contentHolds(file, term)) {
+                    matches.push_back(childPath(dirPath, fileEntry.first));
+                }
+            }
+            return matches;
+        });
+        printPaths(session, found);
+    }
+
+    // Prints the content bytes and blocks of every directory below path,
+    // each including its subdirectories.
+    void diskUsage(Session& session, const std::string& path) {
+        ReadLock namespaceGuard(namespaceLock);
+        InodeId root = path.empty() ? session.currentDirectory : resolveDirectory(session, path);
+        struct Usage {
+            std::uint64_t bytes = 0;
+            std::uint64_t blocks = 0;
+        };
+        auto usage = walkTree<Usage>(root, [](const Directory& dir, const std::string&) {
+            Usage own;
+            for (const auto& fileEntry : dir.files) {
+                const File& file = fileEntry.second;
+                ReadLock fileGuard(file.lock.mutex);
+                own.bytes += file.contentSize;
+                own.blocks += statFile(file).blocks;
+            }
+            return own;
+        });
+
+        // Children sort after their parent, so walking backwards finishes
+        // every total before it is added to the parent's
+        std::unordered_map<std::string_view, std::size_t> index;
+        for (std::size_t i = 0; i < usage.size(); ++i) {
+            index[usage[i].first] = i;
+        }
+        for (std::size_t i = usage.size(); i-- > 1;) {
+            Usage& parent = usage[index.at(parentPath(usage[i].first))].second;
+            parent.bytes += usage[i].second.bytes;
+            parent.blocks += usage[i].second.blocks;
+        }
+
+        BufferedWriter out(*session.out);
+        out << "Bytes\tBlocks\tPath\n";
+        for (const auto& entry : usage) {
+            out << entry.second.bytes << '\t' << entry.second.blocks << '\t' << entry.first << '\n';
+        }
+    }
+
+    // Prints the hierarchy below path, files before subdirectories and each
+    // group sorted by name.
+    void printTree(Session& session, const std::string& path) {
+        ReadLock namespaceGuard(namespaceLock);
+        InodeId root = path.empty() ? session.currentDirectory : resolveDirectory(session, path);
+        struct Listing {
+            std::vector<std::string_view> files;
+            std::vector<std::string_view> directories;
+        };
+        // Names point into the directories, which cannot go away while namespaceLock is held
+        auto listings = walkTree<Listing>(root, [](const Directory& dir, const std::string&) {
+            Listing listing;
+            listing.files.reserve(dir.files.size());
+            for (const auto& fileEntry : dir.files) {
+                listing.files.push_back(fileEntry.first);
+            }
+            for (const auto& subdir : dir.subdirectories) {
+                listing.directories.push_back(subdir.first);
+            }
+            std::sort(listing.files.begin(), listing.files.end());
+            std::sort(listing.directories.begin(), listing.directories.end());
+            return listing;
+        });
+        std::unordered_map<std::string_view, std::size_t> index;
+        for (std::size_t i = 0; i < listings.size(); ++i) {
+            index[listings[i].first] = i;
+        }
+
+        struct Frame {
+            std::size_t listing;
+            std::string prefix;
+            std::size_t next;
+        };
+        std::uint64_t directories = 0;
+        std::uint64_t files = 0;
+        BufferedWriter out(*session.out);
+        out << listings[0].first << '\n';
+        std::vector<Frame> stack = {{0, std::string(), 0}};
+        while (!stack.empty()) {
+            std::size_t current = stack.back().listing;
+            const Listing& listing = listings[current].second;
+            std::size_t entries = listing.files.size() + listing.directories.size();
+            if (stack.back().next == entries) {
+                stack.pop_back();
+                continue;
+            }
+            std::size_t i = stack.back().next++;
+            bool last = i + 1 == entries;
+            out << stack.back().prefix << (last ? "`-- " : "|-- ");
+            if (i < listing.files.size()) {
+                out << listing.files[i] << '\n';
+                ++files;
+                continue;
+            }
+
+            std::string_view name = listing.directories[i - listing.files.size()];
+            out << name << "/\n";
+            ++directories;
+            std::size_t child = index.at(childPath(listings[current].first, name));
+            stack.push_back({child, stack.back().prefix + (last ? "    " : "|   "), 0});
+        }
+        out << '\n' << directories << " directories, " << files << " files\n";
+    }
+
+    // Lists a page of the current directory in name, size or permission
+    // order.
+    void listDirectory(Session& session, const ListOptions& options = ListOptions()) {
+        ReadLock namespaceGuard(namespaceLock);
+        const Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        BufferedWriter out(*session.out);
+        out << "Directory: " << pathOf(currentDir.inode) << '\n';
+
+        std::string_view last;
+        bool more = forEachListed(currentDir, options, [&](std::string_view name, const File* file) {
+            if (file) {
+                out << "- " << name << " [" << file->permissions.str() << "]\n";
+            } else {
+                out << "> " << name << '\n';
+            }
+            last = name;
+        });
+        if (more) {
+            out << "More entries follow; continue with --after " << last << '\n';
+        }
+    }
+
+    // Passes each entry of a page of dir to visit, with its file or null for
+    // a subdirectory, and returns whether more entries follow. In name order
+    // a page costs a lookup in the directory index plus the entries listed;
+    // the other orders skip names without the prefix as they go. Caller
+    // holds dir at least shared.
+    template <typename Visit>
+    static bool forEachListed(const Directory& dir, const ListOptions& options, Visit visit) {
+        std::size_t listed = 0;
+        bool more = false;
+        // Returns false once the page is full
+        auto list = [&](std::string_view name) {
+            if (name.compare(0, options.prefix.size(), options.prefix) != 0) {
+                return true;
+            }
+            if (options.limit != 0 && listed == options.limit) {
+                more = true;
+                return false;
+            }
+            auto file = dir.files.find(name);
+            visit(name, file != dir.files.end() ? &file->second : nullptr);
+            ++listed;
+            return true;
+        };
+
+        const DirectoryIndex& index = dir.index;
+        if (options.order == ListOptions::Order::Name) {
+            auto entry = options.hasAfter && options.after >= options.prefix ? index.byName.upperBound(options.after)
+                                                                              : index.byName.lowerBound(options.prefix);
+            for (; entry != index.byName.end() && entry->compare(0, options.prefix.size(), options.prefix) == 0; ++entry) {
+                if (!list(*entry)) {
+                    break;
+                }
+            }
+        } else if (options.order == ListOptions::Order::Size) {
+            auto entry = index.bySize.begin();
+            if (options.hasAfter) {
+                auto file = dir.files.find(options.after);
+                entry = index.bySize.upperBound({file != dir.files.end() ? file->second.fileSize : cursorDirectory(dir, options.after, 0),
+                                                 options.after});
+            }
+            for (; entry != index.bySize.end() && list(entry->second); ++entry) {
+            }
+        } else {
+            auto entry = index.byPermissions.begin();
+            if (options.hasAfter) {
+                auto file = dir.files.find(options.after);
+                entry = index.byPermissions.upperBound({file != dir.files.end() ? file->second.permissions.bits : cursorDirectory(dir, options.after, std::uint8_t(0)),
+                                                        options.after});
+            }
+            for (; entry != index.byPermissions.end() && list(entry->second); ++entry) {
+            }
+        }
+        return more;
+    }
+
+    // Sort key of a subdirectory used as a cursor outside name order, which
+    // has to name an entry that still exists.
+    template <typename Key>
+    static Key cursorDirectory(const Directory& dir, const std::string& name, Key key) {
+        if (!dir.subdirectories.count(name)) {
+            throw FileSystemError(Status::NotFound, "File or directory not found!");
+        }
+        return key;
+    }
+
+    void createDirectory(Session& session, const std::string& name) {
+        validateDirectoryName(name);
+
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        WriteLock directoryGuard(currentDir.lock.mutex);
+        makeDirectory(currentDir, name);
+        report(session, "Directory created successfully.");
+    }
+
+    void moveDirectory(Session& session, const std::string& source, const std::string& destination) {
+        WriteLock namespaceGuard(namespaceLock);
+        InodeId sourceInode = resolveDirectory(session, source);
+        InodeId destinationInode = resolveDirectory(session, destination);
+
+        if (sourceInode == destinationInode) {
+            throw std::invalid_argument("Source and destination directories are the same!");
+        }
+
+        if (sourceInode == ROOT_INODE) {
+            throw std::invalid_argument("Cannot move the root directory!");
+        }
+
+        if (isAncestor(sourceInode, destinationInode)) {
+            throw std::invalid_argument("Cannot move directory inside its subdirectory!");
+        }
+
+        validateEntrynonExistence(directory(destinationInode), directory(sourceInode).name);
+
+        InodeId oldParent = directory(sourceInode).parent;
+        applyMoveDirectory(sourceInode, destinationInode);
+
+        logMutation(JournalOp::MoveDirectory, {std::to_string(sourceInode), std::to_string(destinationInode)});
+        changes.publish(WatchOp::Move, destinationInode, sourceInode, oldParent, 0, directory(sourceInode).name);
+        report(session, "Directory moved successfully.");
+    }
+
+void renameEntry(Session& session, const std::string& oldName, const std::string& newName) {
+    if (newName.empty()) {
+        throw std::invalid_argument("New name cannot be empty!");
+    }
+
+    if (newName.find('/') != std::string::npos) {
+        throw std::invalid_argument("New name cannot contain '/' character!");
+    }
+
+    {
+        // Renaming a file only touches its directory
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        WriteLock directoryGuard(currentDir.lock.mutex);
+        if (currentDir.files.find(oldName) != currentDir.files.end()) {
+            validateEntrynonExistence(currentDir, newName);
+            applyRenameEntry(currentDir.inode, oldName, newName);
+
+            logMutation(JournalOp::RenameEntry, {std::to_string(currentDir.inode), oldName, newName});
+            changes.publish(WatchOp::Rename, currentDir.inode, currentDir.files.find(newName)->second.inode, 0, 0, newName);
+            report(session, "Entry renamed successfully.");
+            return;
+        }
+    }
+
+    // Directory names are part of every path below them
+    WriteLock namespaceGuard(namespaceLock);
+    const Directory& currentDir = directory(session.currentDirectory);
+    if (currentDir.files.find(oldName) == currentDir.files.end() &&
+        currentDir.subdirectories.find(oldName) == currentDir.subdirectories.end()) {
+        throw FileSystemError(Status::NotFound, "File or directory not found!");
+    }
+    validateEntrynonExistence(currentDir, newName);
+
+    applyRenameEntry(currentDir.inode, oldName, newName);
+
+    logMutation(JournalOp::RenameEntry, {std::to_string(currentDir.inode), oldName, newName});
+    auto renamedFile = currentDir.files.find(newName);
+    InodeId renamed = renamedFile != currentDir.files.end() ? renamedFile->second.inode : currentDir.subdirectories.find(newName)->second;
+    changes.publish(WatchOp::Rename, currentDir.inode, renamed, 0, 0, newName);
+    report(session, "Entry renamed successfully.");
+}
+
+    void appendFile(Session& session, const std::string& name, std::string_view content) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        File& file = findFile(currentDir, name);
+        WriteLock fileGuard(file.lock.mutex);
+        appendContent(currentDir, file, content);
+        report(session, "Content appended to file successfully.");
+    }
+
+    void truncateFile(Session& session, const std::string& name, std::uint64_t size) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        File& file = findFile(currentDir, name);
+        WriteLock fileGuard(file.lock.mutex);
+        resizeContent(currentDir, file, size);
+        report(session, "File truncated successfully.");
+    }
+
+    void fallocateFile(Session& session, const std::string& name, std::uint64_t size) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& currentDir = directory(session.currentDirectory);
+        ReadLock directoryGuard(currentDir.lock.mutex);
+        File& file = findFile(currentDir, name);
+        WriteLock fileGuard(file.lock.mutex);
+        reserveContent(currentDir, file, size);
+        report(session, "File space allocated successfully.");
+    }
+
+    // Shares identical full blocks of file content, keeping one copy of
+    // each. Blocks are matched by hash and confirmed byte by byte. The pass
+    // shuts out every other command, like a checkpoint; later writes to a
+    // shared block copy it first.
+    void deduplicate(Session& session) {
+        WriteLock namespaceGuard(namespaceLock);
+        std::unordered_map<std::uint64_t, std::uint64_t> seen;  // Content hash -> first block with that content
+        std::vector<char> block(BlockDevice::BLOCK_SIZE);
+        std::vector<char> candidate(BlockDevice::BLOCK_SIZE);
+        std::uint64_t scanned = 0;
+        std::uint64_t deduped = 0;
+        std::uint64_t changedFiles = 0;
+
+        for (auto& entry : directoryStructure) {
+            Directory& dir = entry.second;
+            for (auto& fileEntry : dir.files) {
+                File& file = fileEntry.second;
+                std::vector<std::uint64_t> blocks = expandExtents(file.extents);
+                std::uint64_t fullBlocks = file.contentSize / BlockDevice::BLOCK_SIZE;
+                bool changed = false;
+                for (std::uint64_t logical = 0; logical < fullBlocks; ++logical) {
+                    if (blocks[logical] == Extent::HOLE) {
+                        continue;
+                    }
+                    blockCache.read({{blocks[logical], 1}}, 0, block.data(), block.size());
+                    ++scanned;
+                    auto match = seen.emplace(hashBlock(block.data()), blocks[logical]);
+                    if (match.second || match.first->second == blocks[logical]) {
+                        continue;
+                    }
+                    blockCache.read({{match.first->second, 1}}, 0, candidate.data(), candidate.size());
+                    if (std::memcmp(block.data(), candidate.data(), block.size()) == 0) {
+                        blocks[logical] = match.first->second;
+                        changed = true;
+                        ++deduped;
+                    }
+                }
+
+                if (changed) {
+                    ExtentList extents = compactExtents(blocks);
+                    std::string name(fileEntry.first);
+                    applyRemapBlocks(dir.inode, name, extents);
+                    logMutation(JournalOp::RemapBlocks, {std::to_string(dir.inode), name, encodeExtents(extents)});
+                    ++changedFiles;
+                }
+            }
+        }
+
+        stats.add(Stats::Counter::DedupedBlocks, deduped);
+        *session.out << "Deduplicated " << deduped << " of " << scanned << " blocks in " << changedFiles << " files ("
+                     << deduped * BlockDevice::BLOCK_SIZE << " bytes saved).\n";
+    }
+
+    // Verifies everything kept with a checksum: the image on disk, and every
+    // allocated block against the checksum file, read in chunks spread over
+    // all cores. Dirty cached blocks are written out first, so the device
+    // holds what the files refer to. Like dedup, it shuts out every other
+    // command while it runs. Fails after the report when anything is corrupt.
+    void scrub(Session& session) {
+        WriteLock namespaceGuard(namespaceLock);
+        blockCache.flush();
+        auto started = std::chrono::steady_clock::now();
+
+        std::string imageState;
+        bool imageOk = verifyImage(imagePath, imageState);
+
+        std::vector<ScrubChunk> chunks;
+        std::uint64_t verified = 0;
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            for (std::uint64_t block = 0; block < blockAllocator.capacity(); ++block) {
+                if (blockAllocator.isAllocated(block)) {
+                    verified += blockDevice.hasChecksum(block) ? 1 : 0;
+                    addScrubBlock(chunks, block);
+                }
+            }
+        }
+        std::size_t threads;
+        std::vector<std::uint64_t> corrupt = scrubChunks(blockDevice, chunks, threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        // Live files using the corrupt blocks; the others belong to snapshots only
+        std::map<std::uint64_t, std::vector<std::string>> users;
+        if (!corrupt.empty()) {
+            for (const auto& entry : directoryStructure) {
+                const Directory& dir = entry.second;
+                for (const auto& fileEntry : dir.files) {
+                    for (const Extent& extent : fileEntry.second.extents) {
+                        if (extent.hole()) {
+                            continue;
+                        }
+                        for (auto it = std::lower_bound(corrupt.begin(), corrupt.end(), extent.start);
+                             it != corrupt.end() && *it < extent.start + extent.length; ++it) {
+                            users[*it].push_back(childPath(pathOf(dir.inode), fileEntry.first));
+                        }
+                    }
+                }
+            }
+        }
+
+        stats.add(Stats::Counter::ScrubbedBlocks, verified);
+        stats.add(Stats::Counter::CorruptBlocks, corrupt.size());
+        std::ostream& out = *session.out;
+        printScrubSummary(out, imageState, verified, corrupt.size(), seconds, threads);
+        for (std::uint64_t block : corrupt) {
+            out << "Corrupt block " << block << ":";
+            auto found = users.find(block);
+            if (found == users.end()) {
+                out << " held by snapshots only";
+            } else {
+                std::sort(found->second.begin(), found->second.end(), pathLess);
+                for (const std::string& path : found->second) {
+                    out << ' ' << path;
+                }
+            }
+            out << "\n";
+        }
+
+        if (!imageOk || !corrupt.empty()) {
+            throw FileSystemError(Status::Corrupted, "Scrub found corrupt data!");
+        }
+    }
+
+    // Scrubs storage that cannot be loaded, such as an image with a checksum
+    // mismatch: checks the image and every block that has a checksum,
+    // without building the tree, so corrupt blocks are listed by number
+    // only. Nothing is written. Returns whether everything is intact.
+    static bool scrubStorage(const FileSystemOptions& options, std::ostream& out) {
+        auto started = std::chrono::steady_clock::now();
+        std::string imageState;
+        bool imageOk = verifyImage(options.storagePath + ".dat", imageState);
+
+        std::string sumsPath = options.storagePath + ".sums";
+        struct stat st;
+        std::uint64_t blocks = ::stat(sumsPath.c_str(), &st) == 0 ? static_cast<std::uint64_t>(st.st_size) / sizeof(std::uint64_t) : 0;
+        BlockDevice device(options.storagePath + ".blocks", sumsPath);
+        device.setCapacity(blocks);
+        std::vector<ScrubChunk> chunks;
+        std::uint64_t verified = 0;
+        for (std::uint64_t block = 0; block < blocks; ++block) {
+            if (device.hasChecksum(block)) {
+                ++verified;
+                addScrubBlock(chunks, block);
+            }
+        }
+        std::size_t threads;
+        std::vector<std::uint64_t> corrupt = scrubChunks(device, chunks, threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        printScrubSummary(out, imageState, verified, corrupt.size(), seconds, threads);
+        for (std::uint64_t block : corrupt) {
+            out << "Corrupt block " << block << "\n";
+        }
+        return imageOk && corrupt.empty();
+    }
+
+    // Checks the saved image against the checksums in its header. state
+    // describes the outcome; legacy images have nothing to check.
+    static bool verifyImage(const std::string& imagePath, std::string& state) {
+        image::MappedImage map(imagePath);
+        if (!map.valid()) {
+            state = "not saved yet";
+            return true;
+        }
+        image::ImageHeader header = {};
+        std::memcpy(&header, map.data(), std::min(map.size(), sizeof(header)));
+        if (header.magic == image::COMPRESSED_MAGIC) {
+            try {
+                map.adopt(decompressImage(map, header));
+            } catch (const std::exception& ex) {
+                state = std::string("cannot be decompressed (") + ex.what() + ")";
+                return false;
+            }
+            header.magic = image::MAGIC;
+        }
+        if (header.magic != image::MAGIC) {
+            if (!image::isLegacyImage(map.data(), map.size())) {
+                state = "unrecognised header";
+                return false;
+            }
+            state = "written by an older version, without checksums";
+            return true;
+        }
+        if (header.version != image::VERSION || header.headerSize != sizeof(header)) {
+            state = "unsupported version or corrupt header";
+            return false;
+        }
+
+        std::vector<std::string> corrupt = map.corruptRegions(header);
+        if (corrupt.empty()) {
+            state = "OK";
+            return true;
+        }
+        state = "checksum mismatch in the";
+        for (std::size_t i = 0; i < corrupt.size(); ++i) {
+            state += (i == 0 ? " " : ", ") + corrupt[i];
+        }
+        return false;
+    }
+
+    // Run of contiguous blocks scrub reads and verifies as one task.
+    struct ScrubChunk {
+        std::uint64_t start;
+        std::uint64_t count;
+    };
+
+    static void addScrubBlock(std::vector<ScrubChunk>& chunks, std::uint64_t block) {
+        if (!chunks.empty() && chunks.back().start + chunks.back().count == block && chunks.back().count < SCRUB_CHUNK_BLOCKS) {
+            ++chunks.back().count;
+        } else {
+            chunks.push_back({block, 1});
+        }
+    }
+
+    // Verifies chunks on all cores and returns the corrupt blocks in order.
+    static std::vector<std::uint64_t> scrubChunks(const BlockDevice& device, const std::vector<ScrubChunk>& chunks, std::size_t& threads) {
+        using Pool = WorkStealingPool<ScrubChunk>;
+        Pool pool(std::min(Pool::hardwareThreads(), std::max<std::size_t>(1, chunks.size())));
+        std::vector<std::vector<std::uint64_t>> bad(pool.threads());
+        std::vector<std::vector<char>> buffers(pool.threads());
+        pool.run(chunks, [&](typename Pool::Worker& worker, ScrubChunk& chunk) {
+            std::vector<std::uint64_t> found = device.scrubBlocks(chunk.start, chunk.count, buffers[worker.id()]);
+            bad[worker.id()].insert(bad[worker.id()].end(), found.begin(), found.end());
+        });
+        std::vector<std::uint64_t> corrupt;
+        for (const auto& found : bad) {
+            corrupt.insert(corrupt.end(), found.begin(), found.end());
+        }
+        std::sort(corrupt.begin(), corrupt.end());
+        threads = pool.threads();
+        return corrupt;
+    }
+
+    static void printScrubSummary(std::ostream& out, const std::string& imageState, std::uint64_t verified, std::size_t corrupt,
+                                  double seconds, std::size_t threads) {
+        out << "Image: " << imageState << "\n";
+        char line[128];
+        std::snprintf(line, sizeof(line), "Blocks: %llu verified, %zu corrupt, in %.3f s on %zu threads (%.1f MiB/s)\n",
+                      static_cast<unsigned long long>(verified), corrupt, seconds, threads,
+                      verified * BlockDevice::BLOCK_SIZE / (1024.0 * 1024.0) / std::max(seconds, 1e-9));
+        out << line;
+    }
+
+    // Snapshots share their metadata with the live tree and with each other.
+    // Creating one takes constant time; a directory is copied when it first
+    // changes afterwards, and file blocks when the live file is written.
+    void createSnapshot(Session& session, const std::string& name) {
+        validateSnapshotName(name);
+        WriteLock namespaceGuard(namespaceLock);
+        if (snapshots.count(name)) {
+            throw FileSystemError(Status::AlreadyExists, "Snapshot already exists!");
+        }
+        std::int64_t createdAt = static_cast<std::int64_t>(std::time(nullptr));
+        applyCreateSnapshot(name, createdAt);
+
+        logMutation(JournalOp::CreateSnapshot, {name}, createdAt);
+        report(session, "Snapshot created successfully.");
+    }
+
+    void listSnapshots(Session& session) {
+        WriteLock namespaceGuard(namespaceLock);
+        materializeSnapshots();
+        std::ostream& out = *session.out;
+        out << "Snapshots:\n";
+        for (const auto& entry : snapshots) {
+            const Snapshot& snapshot = entry.second;
+            std::size_t files = 0;
+            for (const DirectoryVersionPtr& dir : snapshot.directories) {
+                files += dir->files.size();
+            }
+            char created[32];
+            std::time_t time = static_cast<std::time_t>(snapshot.createdAt);
+            std::tm local;
+            std::strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime_r(&time, &local));
+            out << "- " << snapshot.name << " (" << created << ", " << snapshot.directories.size() << " directories, " << files << " files)\n";
+        }
+    }
+
+    // Replaces the whole tree with the snapshot, which stays available.
+    // Sessions in a directory the snapshot lacks move to the root.
+    void restoreSnapshot(Session& session, const std::string& name) {
+        validateSnapshotName(name);
+        WriteLock namespaceGuard(namespaceLock);
+        findSnapshot(name);
+        applyRestoreSnapshot(name);
+        if (!directoryStructure.count(session.currentDirectory)) {
+            session.currentDirectory = ROOT_INODE;
+        }
+
+        logMutation(JournalOp::RestoreSnapshot, {name});
+        changes.publish(WatchOp::Restore, ROOT_INODE, ROOT_INODE, 0, 0, name);
+        report(session, "Snapshot restored successfully.");
+    }
+
+    void deleteSnapshot(Session& session, const std::string& name) {
+        validateSnapshotName(name);
+        WriteLock namespaceGuard(namespaceLock);
+        findSnapshot(name);
+        applyDeleteSnapshot(name);
+
+        logMutation(JournalOp::DeleteSnapshot, {name});
+        report(session, "Snapshot deleted successfully.");
+    }
+
+    // Library API for programs that link the file system in. Paths are
+    // absolute or relative to the root. Calls print nothing and report
+    // failures as a Status rather than an exception. Content is read and
+    // written through handles, which reach their file without a path lookup.
+    // Every call is safe to make from several threads at once.
+    Status create(std::string_view path, Permissions permissions, std::uint64_t size) {
+        return call(Command::CreateFile, [&]() {
+            if (permissions.bits > (Permissions::READ | Permissions::WRITE | Permissions::EXECUTE)) {
+                throw std::invalid_argument("Invalid permissions! Use r, w and x, or an octal digit.");
+            }
+            validateFileSize(size);
+            std::string name;
+            ReadLock namespaceGuard(namespaceLock);
+            Directory& dir = directory(resolveParent(path, name));
+            validateFileName(name);
+            WriteLock directoryGuard(dir.lock.mutex);
+            addNewFile(dir, name, permissions, size);
+        });
+    }
+
+    Status mkdir(std::string_view path) {
+        return call(Command::MakeDirectory, [&]() {
+            std::string name;
+            ReadLock namespaceGuard(namespaceLock);
+            Directory& parent = directory(resolveParent(path, name));
+            validateDirectoryName(name);
+            WriteLock directoryGuard(parent.lock.mutex);
+            makeDirectory(parent, name);
+        });
+    }
+
+    // Deletes a file. Its open handles stay open but report BadHandle.
+    Status remove(std::string_view path) {
+        return call(Command::DeleteFile, [&]() {
+            std::string name;
+            ReadLock namespaceGuard(namespaceLock);
+            Directory& dir = directory(resolveParent(path, name));
+            WriteLock directoryGuard(dir.lock.mutex);
+            removeFile(dir, name);
+        });
+    }
+
+    Status open(std::string_view path, FileHandle& handle) {
+        return call(Command::Unknown, [&]() {
+            std::string name;
+            ReadLock namespaceGuard(namespaceLock);
+            Directory& dir = directory(resolveParent(path, name));
+            ReadLock directoryGuard(dir.lock.mutex);
+            File& file = findFile(dir, name);
+            WriteLock handleGuard(handleLock);
+            handle.id = nextHandle++;
+            openFiles.emplace(handle.id, OpenFile{dir.inode, file.inode, &file});
+            handlesByInode.emplace(file.inode, handle.id);
+        });
+    }
+
+    Status close(FileHandle handle) {
+        WriteLock handleGuard(handleLock);
+        auto entry = openFiles.find(handle.id);
+        if (entry == openFiles.end()) {
+            return Status::BadHandle;
+        }
+        auto range = handlesByInode.equal_range(entry->second.inode);
+        for (auto bound = range.first; bound != range.second; ++bound) {
+            if (bound->second == handle.id) {
+                handlesByInode.erase(bound);
+                break;
+            }
+        }
+        openFiles.erase(entry);
+        return Status::Ok;
+    }
+
+    // Reads up to length bytes at offset; the range is cut off at the end of
+    // the content.
+    Status read(FileHandle handle, std::uint64_t offset, std::uint64_t length, std::string& content) {
+        return call(Command::ReadFile, [&]() {
+            withHandle<ReadLock>(handle, [&](const Directory&, File& file) {
+                if (offset > file.contentSize) {
+                    throw std::invalid_argument("Offset is past the end of the file!");
+                }
+                content.resize(std::min<std::uint64_t>(length, file.contentSize - offset));
+                blockCache.read(file.extents, offset, &content[0], content.size());
+            });
+        });
+    }
+
+    // Overwrites the bytes at offset, as writefile --at does.
+    Status write(FileHandle handle, std::uint64_t offset, std::string_view content) {
+        return call(Command::WriteFile, [&]() {
+            withHandle<WriteLock>(handle, [&](const Directory& dir, File& file) { writeAt(dir, file, offset, content); });
+        });
+    }
+
+    // Replaces the whole content, as writefile does.
+    Status replace(FileHandle handle, std::string_view content) {
+        return call(Command::WriteFile, [&]() {
+            withHandle<WriteLock>(handle, [&](const Directory& dir, File& file) { replaceContent(dir, file, content); });
+        });
+    }
+
+    Status append(FileHandle handle, std::string_view content) {
+        return call(Command::AppendFile, [&]() {
+            withHandle<WriteLock>(handle, [&](const Directory& dir, File& file) { appendContent(dir, file, content); });
+        });
+    }
+
+    Status truncate(FileHandle handle, std::uint64_t size) {
+        return call(Command::Truncate, [&]() {
+            withHandle<WriteLock>(handle, [&](const Directory& dir, File& file) { resizeContent(dir, file, size); });
+        });
+    }
+
+    Status allocate(FileHandle handle, std::uint64_t size) {
+        return call(Command::Fallocate, [&]() {
+            withHandle<WriteLock>(handle, [&](const Directory& dir, File& file) { reserveContent(dir, file, size); });
+        });
+    }
+
+    Status stat(FileHandle handle, FileStat& result) {
+        return call(Command::Unknown, [&]() {
+            withHandle<ReadLock>(handle, [&](const Directory&, File& file) { result = statFile(file); });
+        });
+    }
+
+    // Stats every path, files and directories alike, under one hold of the
+    // namespace. A run of paths in the same directory resolves and locks it
+    // once. Each result carries its own status; the call returns the first
+    // failure, or Ok.
+    Status stat(const std::vector<std::string>& paths, std::vector<FileStat>& results) {
+        results.assign(paths.size(), FileStat());
+        Status first = Status::Ok;
+        {
+            ReadLock namespaceGuard(namespaceLock);
+            std::string parentPath;
+            std::string name;
+            const Directory* dir = nullptr;
+            ReadLock directoryGuard;
+            for (std::size_t i = 0; i < paths.size(); ++i) {
+                FileStat& result = results[i];
+                result.status = statusOf([&]() {
+                    std::string parent = splitPath(paths[i], name);
+                    if (!dir || parent != parentPath) {
+                        // Locked one at a time: resolving takes directory locks of its own
+                        dir = nullptr;
+                        directoryGuard = ReadLock();
+                        const Directory& next = directory(resolveDirectory(Session(), parent));
+                        directoryGuard = ReadLock(next.lock.mutex);
+                        dir = &next;
+                        parentPath = std::move(parent);
+                    }
+                    auto file = dir->files.find(name);
+                    if (file != dir->files.end()) {
+                        ReadLock fileGuard(file->second.lock.mutex);
+                        result = statFile(file->second);
+                        return;
+                    }
+                    auto subdir = dir->subdirectories.find(name);
+                    if (name.empty() || subdir == dir->subdirectories.end()) {
+                        throw FileSystemError(Status::NotFound, "File or directory not found!");
+                    }
+                    result.directory = true;
+                    result.inode = subdir->second;
+                });
+                if (first == Status::Ok) {
+                    first = result.status;
+                }
+            }
+        }
+        return first;
+    }
+
+    // Lists a page of the directory at path with the metadata of every
+    // entry, in the order and range ls takes. A full page may be followed by
+    // more entries; the name of its last entry as options.after lists them.
+    Status readdir(std::string_view path, std::vector<DirectoryEntry>& entries, const ListOptions& options = ListOptions()) {
+        entries.clear();
+        return call(Command::List, [&]() {
+            ReadLock namespaceGuard(namespaceLock);
+            const Directory& dir = directory(resolveDirectory(Session(), "/" + std::string(path)));
+            ReadLock directoryGuard(dir.lock.mutex);
+            forEachListed(dir, options, [&](std::string_view name, const File* file) {
+                DirectoryEntry entry;
+                entry.name = std::string(name);
+                if (file) {
+                    ReadLock fileGuard(file->lock.mutex);
+                    entry.stat = statFile(*file);
+                } else {
+                    entry.stat.directory = true;
+                    entry.stat.inode = dir.subdirectories.find(name)->second;
+                }
+                entries.push_back(std::move(entry));
+            });
+        });
+    }
+
+    // Starts watching the directory at path: its entries being created,
+    // written, deleted or renamed, subdirectories moving in or out, the
+    // directory itself changing, and restores of the whole tree. Only
+    // changes made from now on are reported.
+    Status watch(std::string_view path, Watcher& watcher) {
+        return call(Command::Watch, [&]() {
+            ReadLock namespaceGuard(namespaceLock);
+            watcher.directory = resolveDirectory(Session(), "/" + std::string(path));
+            watcher.cursor = changes.head();
+            watcher.lost = 0;
+        });
+    }
+
+    // Appends up to max changes seen by watcher to events, waiting up to wait
+    // for the first one. Takes no locks, so a watcher never holds up changes.
+    // When it fell too far behind, watcher.lost counts the changes to any
+    // directory that were overwritten before it got to them, and readEvents
+    // returns at once with those that are left.
+    Status readEvents(Watcher& watcher, std::vector<WatchEvent>& events, std::size_t max = 1024,
+                      std::chrono::milliseconds wait = std::chrono::milliseconds(0)) {
+        return call(Command::Unknown, [&]() {
+            collectEvents(watcher, events, max, std::chrono::steady_clock::now() + wait);
+        });
+    }
+
+private:
+    static bool concerns(const Watcher& watcher, const WatchEvent& event) {
+        return event.directory == watcher.directory || event.inode == watcher.directory || event.from == watcher.directory ||
+               event.op == WatchOp::Restore;
+    }
+
+    // Moves up to max changes that concern watcher from the ring to events.
+    // While there are none it sleeps, a little longer each time, until
+    // deadline; publishing never has to wake anyone up.
+    void collectEvents(Watcher& watcher, std::vector<WatchEvent>& events, std::size_t max,
+                       std::chrono::steady_clock::time_point deadline) const {
+        std::size_t start = events.size();
+        std::vector<WatchEvent> batch;
+        std::chrono::milliseconds pause(1);
+        watcher.lost = 0;
+        while (events.size() - start < max) {
+            batch.clear();
+            watcher.lost += changes.read(watcher.cursor, max - (events.size() - start), batch);
+            for (WatchEvent& event : batch) {
+                if (concerns(watcher, event)) {
+                    events.push_back(std::move(event));
+                }
+            }
+            if (!batch.empty()) {
+                continue;
+            }
+
+            // Caught up with the producers
+            auto now = std::chrono::steady_clock::now();
+            if (events.size() > start || watcher.lost > 0 || now >= deadline) {
+                break;
+            }
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(pause, deadline - now));
+            pause = std::min(pause * 2, WATCH_POLL_MAX);
+        }
+    }
+
+    // Runs a library call: counts it under command unless that is Unknown,
+    // turns its exceptions into a Status, and runs a checkpoint that came due
+    // once the call has released its locks.
+    template <typename Operation>
+    Status call(Command command, Operation operation) {
+        std::uint64_t start = Stats::now();
+        Status status = statusOf(operation);
+        if (command != Command::Unknown) {
+            stats.recordCommand(command, start, status != Status::Ok);
+        }
+        if (checkpointDue.exchange(false)) {
+            Status saved = statusOf([this]() { checkpoint(); });
+            status = status == Status::Ok ? saved : status;
+        }
+        return status;
+    }
+
+    // Running out of memory is not a Status; it still throws.
+    template <typename Operation>
+    static Status statusOf(Operation operation) {
+        try {
+            operation();
+            return Status::Ok;
+        } catch (const FileSystemError& ex) {
+            return ex.status();
+        } catch (const std::invalid_argument&) {
+            return Status::InvalidArgument;
+        } catch (const std::bad_alloc&) {
+            throw;
+        } catch (const std::exception&) {
+            return Status::IoError;
+        }
+    }
+
+    // Runs operation on the file behind handle, holding its directory shared
+    // and the file with FileGuard. The handle is looked up again once the
+    // directory is held, since a delete may have run in between; while it is
+    // held none can.
+    template <typename FileGuard, typename Operation>
+    void withHandle(FileHandle handle, Operation operation) {
+        ReadLock namespaceGuard(namespaceLock);
+        Directory& dir = directory(openFile(handle).directory);
+        ReadLock directoryGuard(dir.lock.mutex);
+        File& file = *openFile(handle).file;
+        FileGuard fileGuard(file.lock.mutex);
+        operation(dir, file);
+    }
+
+    OpenFile openFile(FileHandle handle) {
+        ReadLock handleGuard(handleLock);
+        auto entry = openFiles.find(handle.id);
+        if (entry == openFiles.end()) {
+            throw FileSystemError(Status::BadHandle, "Invalid file handle!");
+        }
+        if (!entry->second.file) {
+            throw FileSystemError(Status::BadHandle, "The file of the handle was deleted!");
+        }
+        return entry->second;
+    }
+
+    // Handles of a deleted file stay open until closed but report BadHandle.
+    void dropHandles(InodeId inode) {
+        WriteLock handleGuard(handleLock);
+        auto range = handlesByInode.equal_range(inode);
+        for (auto bound = range.first; bound != range.second; ++bound) {
+            openFiles.at(bound->second).file = nullptr;
+        }
+        handlesByInode.erase(range.first, range.second);
+    }
+
+    // Points the open handles at the files of a tree that replaced the old
+    // one, matching them by inode. Caller holds namespaceLock exclusively.
+    void rebindHandles() {
+        WriteLock handleGuard(handleLock);
+        if (openFiles.empty()) {
+            return;
+        }
+        std::unordered_map<InodeId, OpenFile> files;
+        for (auto& entry : directoryStructure) {
+            for (auto& fileEntry : entry.second.files) {
+                files.emplace(fileEntry.second.inode, OpenFile{entry.first, fileEntry.second.inode, &fileEntry.second});
+            }
+        }
+        handlesByInode.clear();
+        for (auto& entry : openFiles) {
+            auto match = entry.second.file ? files.find(entry.second.inode) : files.end();
+            if (match == files.end()) {
+                entry.second.file = nullptr;
+                continue;
+            }
+            entry.second = match->second;
+            handlesByInode.emplace(entry.second.inode, entry.first);
+        }
+    }
+
+    // Splits a library path into the absolute path of its directory and the
+    // name in it.
+    static std::string splitPath(std::string_view path, std::string& name) {
+        std::size_t slash = path.rfind('/');
+        if (slash == std::string_view::npos) {
+            name = std::string(path);
+            return "/";
+        }
+        name = std::string(path.substr(slash + 1));
+        return "/" + std::string(path.substr(0, slash));
+    }
+
+    InodeId resolveParent(std::string_view path, std::string& name) {
+        return resolveDirectory(Session(), splitPath(path, name));
+    }
+
+    // State changes shared by the commands above and journal replay. They assume
+    // the arguments were already validated and the caller holds the locks the
+    // change needs; replay runs before any other thread exists.
+    void applyCreateFile(InodeId dir, InodeId inode, const std::string& name, const std::string& permissions, std::uint64_t size,
+                         const ExtentList& extents) {
+        File newFile;
+        newFile.inode = inode;
+        newFile.name = Name(name);
+        newFile.permissions = Permissions::parseStored(permissions);
+        newFile.fileSize = size;
+        newFile.extents = extents;
+
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            for (const Extent& extent : extents) {
+                claimExtent(extent);
+            }
+        }
+        Directory& parent = directory(dir);
+        directoryChanged(parent);
+        addFile(parent, std::move(newFile));
+        advanceInode(inode);
+    }
+
+    // Writes and appends put their data in the blocks before logging, so only
+    // the resulting content size needs to be replayed. The index entry of the
+    // file is rebuilt from the blocks once replay is done.
+    void applyContentSize(InodeId dir, const std::string& name, std::size_t size) {
+        Directory& parent = directory(dir);
+        File& file = findFile(parent, name);
+        fileChanged(parent, file);
+        file.contentSize = size;
+        staleContent.insert(file.inode);
+    }
+
+    // Points a file at a new set of blocks. New owners are added before the
+    // old ones are dropped, so a block in both sets is never freed.
+    void applyRemapBlocks(InodeId dir, const std::string& name, const ExtentList& extents) {
+        Directory& parent = directory(dir);
+        File& file = findFile(parent, name);
+        fileChanged(parent, file);
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        for (const Extent& extent : extents) {
+            claimExtent(extent);
+        }
+        for (const Extent& extent : file.extents) {
+            releaseExtent(extent);
+        }
+        file.extents = extents;
+    }
+
+    void applyDeleteFile(InodeId dir, const std::string& name) {
+        Directory& parent = directory(dir);
+        auto entry = parent.files.find(name);
+        if (entry == parent.files.end()) {
+            throw FileSystemError(Status::NotFound, "File or directory not found!");
+        }
+        fileChanged(parent, entry->second);
+        parent.index.removeFile(entry->second);
+        {
+            std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+            contentIndex.remove(entry->second.inode);
+        }
+        ExtentList extents = std::move(entry->second.extents);
+        dropHandles(entry->second.inode);
+        parent.files.erase(entry);
+        deallocateFileBlocks(extents);
+    }
+
+    void applyCreateDirectory(InodeId parent, InodeId inode, const std::string& name) {
+        Directory newDir;
+        newDir.inode = inode;
+        newDir.parent = parent;
+        newDir.name = Name(name);
+        newDir.born = snapshotEpoch;
+        newDir.captured.value = snapshotEpoch;
+        {
+            WriteLock tableGuard(tableLock);
+            directoryStructure[inode] = newDir;
+        }
+
+        addSubdirectory(directory(parent), newDir);
+        advanceInode(inode);
+    }
+
+    void applyMoveDirectory(InodeId source, InodeId destination) {
+        Directory& sourceDir = directory(source);
+        directoryChanged(sourceDir);
+
+        Directory& oldParent = directory(sourceDir.parent);
+        oldParent.subdirectories.erase(sourceDir.name);
+        oldParent.index.removeDirectory(sourceDir.name);
+        addSubdirectory(directory(destination), sourceDir);
+        sourceDir.parent = destination;
+
+        namespaceChanged();
+    }
+
+    void applyRenameEntry(InodeId dir, const std::string& oldName, const std::string& newName) {
+        Directory& parent = directory(dir);
+
+        auto fileEntry = parent.files.find(oldName);
+        if (fileEntry != parent.files.end()) {
+            directoryChanged(parent);
+            auto node = parent.files.extract(fileEntry);
+            parent.index.removeFile(node.mapped());
+            node.mapped().name = Name(newName);
+            node.key() = node.mapped().name;
+            parent.index.addFile(node.mapped());
+            parent.files.insert(std::move(node));
+        } else {
+            auto node = parent.subdirectories.extract(oldName);
+            if (node.empty()) {
+                throw FileSystemError(Status::NotFound, "File or directory not found!");
+            }
+            parent.index.removeDirectory(oldName);
+            Directory& child = directory(node.mapped());
+            directoryChanged(child);
+            child.name = Name(newName);
+            node.key() = child.name;
+            parent.index.addDirectory(child.name);
+            parent.subdirectories.insert(std::move(node));
+            namespaceChanged();
+        }
+    }
+
+    // Only starts an open snapshot; directories give it their state through
+    // captureForSnapshots. Caller holds namespaceLock exclusively.
+    void applyCreateSnapshot(const std::string& name, std::int64_t createdAt) {
+        Snapshot snapshot;
+        snapshot.name = name;
+        snapshot.createdAt = createdAt;
+        snapshot.epoch = snapshotEpoch++;
+        snapshot.open = true;
+        snapshots[name] = std::move(snapshot);
+        ++openSnapshots;
+    }
+
+    void applyDeleteSnapshot(const std::string& name) {
+        auto snapshot = snapshots.find(name);
+        if (snapshot != snapshots.end() && snapshot->second.open && --openSnapshots == 0) {
+            for (auto& entry : directoryStructure) {
+                entry.second.history.clear();
+            }
+        }
+        snapshots.erase(name);
+        dropStaleVersions();
+    }
+
+    // Gathers the directories of every open snapshot: the state a directory
+    // kept when it first changed after the snapshot, or its state now when it
+    // has not changed since. Caller holds namespaceLock exclusively.
+    void materializeSnapshots() {
+        if (openSnapshots == 0) {
+            return;
+        }
+        for (auto& entry : directoryStructure) {
+            Directory& dir = entry.second;
+            for (auto& snapshotEntry : snapshots) {
+                Snapshot& snapshot = snapshotEntry.second;
+                if (!snapshot.open || dir.born > snapshot.epoch) {
+                    continue;
+                }
+                auto kept = std::find_if(dir.history.begin(), dir.history.end(),
+                                         [&](const auto& state) { return state.first >= snapshot.epoch; });
+                snapshot.directories.push_back(kept != dir.history.end() ? kept->second : freezeDirectory(dir));
+            }
+            dir.history.clear();
+        }
+        for (auto& snapshotEntry : snapshots) {
+            snapshotEntry.second.open = false;
+        }
+        openSnapshots = 0;
+    }
+
+    // The restored files take their own reference to every block before the
+    // current files give theirs up, so blocks in both trees stay allocated.
+    void applyRestoreSnapshot(const std::string& name) {
+        materializeSnapshots();  // The directories holding open snapshots' states are replaced
+        const Snapshot& snapshot = findSnapshot(name);
+        std::unordered_map<InodeId, Directory> restored;
+        for (const DirectoryVersionPtr& version : snapshot.directories) {
+            Directory& dir = restored[version->inode];
+            dir.inode = version->inode;
+            dir.parent = version->parent;
+            dir.name = Name(version->name);
+            dir.frozen = version;
+            dir.changed.value = false;
+            dir.files.reserve(version->files.size());
+            for (const auto& fileEntry : version->files) {
+                const FileVersion& fileVersion = *fileEntry.second;
+                File file;
+                file.inode = fileVersion.inode;
+                file.name = Name(fileEntry.first);
+                file.permissions = fileVersion.permissions;
+                file.fileSize = fileVersion.fileSize;
+                file.contentSize = fileVersion.contentSize;
+                file.extents = fileVersion.extents;
+                file.frozen = fileEntry.second;
+                addFile(dir, std::move(file));
+            }
+        }
+        for (auto& entry : restored) {
+            if (entry.first != ROOT_INODE) {
+                addSubdirectory(restored.at(entry.second.parent), entry.second);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            for (const auto& entry : restored) {
+                for (const auto& fileEntry : entry.second.files) {
+                    for (const Extent& extent : fileEntry.second.extents) {
+                        claimExtent(extent);
+                    }
+                }
+            }
+        }
+
+        // Blocks held by a snapshot are copied before they are written, so a
+        // restored file with the blocks and size of the live file of the same
+        // inode has its content too; the other index entries are rebuilt.
+        std::unordered_map<InodeId, const File*> live;
+        for (const auto& entry : directoryStructure) {
+            for (const auto& fileEntry : entry.second.files) {
+                live[fileEntry.second.inode] = &fileEntry.second;
+            }
+        }
+        for (const auto& entry : restored) {
+            for (const auto& fileEntry : entry.second.files) {
+                const File& file = fileEntry.second;
+                auto match = live.find(file.inode);
+                if (match != live.end() && match->second->contentSize == file.contentSize &&
+                    std::equal(file.extents.begin(), file.extents.end(), match->second->extents.begin(), match->second->extents.end(),
+                               [](const Extent& a, const Extent& b) { return a.start == b.start && a.length == b.length; })) {
+                    live.erase(match);
+                } else {
+                    staleContent.insert(file.inode);
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> indexGuard(contentIndexLock);
+            for (const auto& entry : live) {
+                contentIndex.remove(entry.first);
+            }
+        }
+
+        for (auto& entry : directoryStructure) {
+            for (auto& fileEntry : entry.second.files) {
+                fileChanged(entry.second, fileEntry.second);
+                deallocateFileBlocks(fileEntry.second.extents);
+            }
+        }
+
+        directoryStructure.swap(restored);
+        namespaceChanged();
+        rebindHandles();
+        if (!directoryStructure.count(console.currentDirectory)) {
+            console.currentDirectory = ROOT_INODE;
+        }
+        indexStaleContent();
+    }
+
+    void applyRecord(const JournalRecord& record) {
+        const std::vector<std::string>& f = record.fields;
+        switch (record.op) {
+            case JournalOp::CreateFile:
+                applyCreateFile(parseInode(f.at(0)), parseInode(f.at(1)), f.at(2), f.at(3), static_cast<std::uint64_t>(record.value), decodeExtents(f.at(4)));
+                break;
+            case JournalOp::WriteFile: applyContentSize(parseInode(f.at(0)), f.at(1), static_cast<std::size_t>(record.value)); break;
+            case JournalOp::DeleteFile: applyDeleteFile(parseInode(f.at(0)), f.at(1)); break;
+            case JournalOp::CreateDirectory: applyCreateDirectory(parseInode(f.at(0)), parseInode(f.at(1)), f.at(2)); break;
+            case JournalOp::MoveDirectory: applyMoveDirectory(parseInode(f.at(0)), parseInode(f.at(1))); break;
+            case JournalOp::RenameEntry: applyRenameEntry(parseInode(f.at(0)), f.at(1), f.at(2)); break;
+            case JournalOp::AppendFile: applyContentSize(parseInode(f.at(0)), f.at(1), static_cast<std::size_t>(record.value)); break;
+            case JournalOp::RemapBlocks: applyRemapBlocks(parseInode(f.at(0)), f.at(1), decodeExtents(f.at(2))); break;
+            case JournalOp::CreateSnapshot: applyCreateSnapshot(f.at(0), record.value); break;
+            case JournalOp::DeleteSnapshot: applyDeleteSnapshot(f.at(0)); break;
+            case JournalOp::RestoreSnapshot: applyRestoreSnapshot(f.at(0)); break;
+            default: throw std::runtime_error("Unknown journal record!");
+        }
+    }
+
+    static InodeId parseInode(const std::string& field) {
+        return std::stoull(field);
+    }
+
+    // Inodes handed out live are already below nextInode; replay moves it past
+    // every inode it recreates.
+    void advanceInode(InodeId inode) {
+        if (nextInode.load() <= inode) {
+            nextInode = inode + 1;
+        }
+    }
+
+    // Records a mutation that has already been applied in memory. The image is
+    // only rewritten once the journal grows past its checkpoint threshold.
+    // Callers still hold the locks of the change, so records of conflicting
+    // mutations reach the journal in the order they were applied.
+    void logMutation(JournalOp op, std::initializer_list<std::string> fields, std::int64_t value = 0) {
+        journal.append(op, fields, value);
+        if (!transaction && journal.needsCheckpoint()) {
+            checkpointDue = true;
+        }
+    }
+
+    // Directories are never erased while commands run, so the reference stays
+    // valid after the table lock is released.
+    Directory& directory(InodeId inode) {
+        ReadLock tableGuard(tableLock);
+        auto entry = directoryStructure.find(inode);
+        if (entry == directoryStructure.end()) {
+            throw FileSystemError(Status::NotFound, "Directory not found!");
+        }
+        return entry->second;
     }
 
-    void runCLI() {
-        std::cout << "Welcome to the CLI File System!\n";
-        printHelp();
+    File& findFile(Directory& dir, const std::string& name) {
+        auto entry = dir.files.find(name);
+        if (entry == dir.files.end()) {
+            throw FileSystemError(Status::NotFound, "File or directory not found!");
+        }
+        return entry->second;
+    }
 
-        std::string command;
-        while (true) {
-            std::cout << "\n";
-            std::cout << currentDirectory << "> ";
-            std::getline(std::cin, command);
+    // Resolves an absolute or relative directory path such as "a/b/../c".
+    // Absolute paths are cached, so repeated lookups cost one hash probe;
+    // otherwise each component costs one child-map probe. Relative paths start
+    // at the session's directory and are not cached, since the same text means
+    // something else in every session.
+    InodeId resolveDirectory(const Session& session, const std::string& path) {
+        if (path.empty() || path[0] != '/') {
+            return walkPath(session.currentDirectory, path);
+        }
 
-            if (command.empty()) {
-                continue;
+        std::string absolute = normalizePath(path);
+        {
+            ReadLock cacheGuard(dentryLock);
+            auto cached = dentryCache.find(absolute);
+            if (cached != dentryCache.end()) {
+                return cached->second;
             }
+        }
 
-            std::vector<std::string> tokens = tokenizeCommand(command);
-            std::string mainCommand = tokens[0];
+        InodeId inode = walkPath(ROOT_INODE, absolute);
+        WriteLock cacheGuard(dentryLock);
+        if (dentryCache.size() >= DENTRY_CACHE_LIMIT) {
+            dentryCache.clear();
+        }
+        dentryCache.emplace(absolute, inode);
+        return inode;
+    }
 
-            try {
-                if (mainCommand == "cd") {
-                    if (tokens.size() < 2) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: cd <directory>");
-                    }
-                    changeDirectory(tokens[1]);
-                } else if (mainCommand == "createfile") {
-                    if (tokens.size() < 4) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: createfile <name> <permissions> <size>");
-                    }
-                    std::string name = tokens[1];
-                    std::string permissions = tokens[2];
-                    int size = std::stoi(tokens[3]);
-                    createFile(name, permissions, size);
-                } else if (mainCommand == "writefile") {
-                    if (tokens.size() < 3) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: writefile <name> <content>");
-                    }
-                    std::string name = tokens[1];
-                    std::string content;
-                    for (size_t i = 2; i < tokens.size(); ++i) {
-                        content += tokens[i];
-                        if (i < tokens.size() - 1) {
-                            content += ' '; // Add a space between tokens
-                        }
-                    }
-                    writeFile(name, content);
-                } else if (mainCommand == "readfile") {
-                    if (tokens.size() < 2) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: readfile <name>");
-                    }
-                    std::string name = tokens[1];
-                    readFile(name);
-                } else if (mainCommand == "deletefile") {
-                    if (tokens.size() < 2) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: deletefile <name>");
-                    }
-                    std::string name = tokens[1];
-                    deleteFile(name);
-                } else if (mainCommand == "ls") {
-                    listDirectory();
-                } else if (mainCommand == "mkdir") {
-                    if (tokens.size() < 2) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: mkdir <name>");
-                    }
-                    std::string name = tokens[1];
-                    createDirectory(name);
-                } else if (mainCommand == "mv") {
-                    if (tokens.size() < 3) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: mv <source> <destination>");
-                    }
-                    std::string source = tokens[1];
-                    std::string destination = tokens[2];
-                    moveDirectory(source, destination);
-                } else if (mainCommand == "rename") {
-                    if (tokens.size() < 3) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: rename <old name> <new name>");
-                    }
-                    std::string oldName = tokens[1];
-                    std::string newName = tokens[2];
-                    renameEntry(oldName, newName);
-                } else if (mainCommand == "appendfile") {
-                    if (tokens.size() < 3) {
-                        throw std::invalid_argument("Invalid command syntax! Usage: appendfile <name> <content>");
-                    }
-                    std::string name = tokens[1];
-                    std::string content = tokens[2];
-                    appendFile(name, content);
-                } else if (mainCommand == "help") {
-                    printHelp();
-                } else if (mainCommand == "exit") {
-                    break;
-                } else {
-                    throw std::invalid_argument("Invalid command! Type 'help' to see the available commands.");
+    // Follows the components of path down from inode; ".." moves to the parent
+    // and the root is its own parent.
+    InodeId walkPath(InodeId inode, const std::string& path) {
+        std::size_t start = 0;
+        while (start < path.size()) {
+            std::size_t end = path.find('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+
+            std::string component = path.substr(start, end - start);
+            if (component == "..") {
+                inode = directory(inode).parent;
+            } else if (!component.empty() && component != ".") {
+                const Directory& dir = directory(inode);
+                ReadLock directoryGuard(dir.lock.mutex);
+                auto child = dir.subdirectories.find(component);
+                if (child == dir.subdirectories.end()) {
+                    throw FileSystemError(Status::NotFound, "Directory not found!");
                 }
-            } catch (const std::exception& ex) {
-                std::cerr << "Error: " << ex.what() << "\n";
+                inode = child->second;
             }
+            start = end + 1;
         }
+        return inode;
     }
 
-private:
-    void createFile(const std::string& name, const std::string& permissions, int size) {
-        validateFileName(name);
-        validateFileSize(size);
-
-        Directory& currentDir = directoryStructure[currentDirectory];
+    // Turns an absolute path into one without "." and ".." components.
+    static std::string normalizePath(const std::string& path) {
+        std::vector<std::string> components;
+        std::size_t start = 0;
+        while (start <= path.size()) {
+            std::size_t end = path.find('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            std::string component = path.substr(start, end - start);
+            if (component == "..") {
+                if (!components.empty()) {
+                    components.pop_back();
+                }
+            } else if (!component.empty() && component != ".") {
+                components.push_back(component);
+            }
+            start = end + 1;
+        }
 
-        // Check if the file already exists in the current directory
-        if (currentDir.files.find(name) != currentDir.files.end()) {
-            throw std::invalid_argument("File already exists in the current directory!");
+        std::string absolute;
+        for (const std::string& component : components) {
+            absolute += '/';
+            absolute += component;
         }
+        return absolute.empty() ? "/" : absolute;
+    }
 
-        // Check if the maximum number of files has been reached
-        if (currentDir.files.size() >= MAX_FILES) {
-            throw std::runtime_error("Maximum number of files in the directory reached!");
+    // Visits the tree below root on a work-stealing pool sized by the number
+    // of directories. summarize runs with each directory held shared and
+    // returns its result; the results come back sorted by path, parents
+    // first, whatever order the workers ran in. Caller holds namespaceLock
+    // shared, which keeps the shape of the tree fixed.
+    template <typename Result, typename Summarize>
+    std::vector<std::pair<std::string, Result>> walkTree(InodeId root, Summarize summarize) {
+        struct Item {
+            InodeId inode;
+            std::string path;
+        };
+        std::size_t directories;
+        {
+            ReadLock tableGuard(tableLock);
+            directories = directoryStructure.size();
         }
+        using Pool = WorkStealingPool<Item>;
+        Pool pool(std::min(Pool::hardwareThreads(), 1 + directories / DIRECTORIES_PER_WALK_THREAD));
 
-        File newFile;
-        newFile.name = name;
-        newFile.permissions = permissions;
-        newFile.fileSize = size;
+        std::vector<std::vector<std::pair<std::string, Result>>> results(pool.threads());
+        pool.run({{root, pathOf(root)}}, [&](typename Pool::Worker& worker, Item& item) {
+            const Directory& dir = directory(item.inode);
+            ReadLock directoryGuard(dir.lock.mutex);
+            for (const auto& subdir : dir.subdirectories) {
+                worker.spawn({subdir.second, childPath(item.path, subdir.first)});
+            }
+            Result result = summarize(dir, item.path);
+            results[worker.id()].emplace_back(std::move(item.path), std::move(result));
+        });
 
-        allocateFileBlocks(newFile, size);
-        currentDir.files[name] = newFile;
+        std::vector<std::pair<std::string, Result>> merged = std::move(results[0]);
+        for (std::size_t i = 1; i < results.size(); ++i) {
+            std::move(results[i].begin(), results[i].end(), std::back_inserter(merged));
+        }
+        std::sort(merged.begin(), merged.end(), [](const auto& a, const auto& b) { return pathLess(a.first, b.first); });
+        return merged;
+    }
 
-        saveFileSystem();
-        std::cout << "File created successfully.\n";
+    // Prints the paths gathered by a tree walk in path order.
+    static void printPaths(Session& session, std::vector<std::pair<std::string, std::vector<std::string>>>& found) {
+        std::vector<std::string> paths;
+        for (auto& entry : found) {
+            std::move(entry.second.begin(), entry.second.end(), std::back_inserter(paths));
+        }
+        std::sort(paths.begin(), paths.end(), pathLess);
+        BufferedWriter out(*session.out);
+        for (const std::string& path : paths) {
+            out << path << '\n';
+        }
     }
 
-    void writeFile(const std::string& name, const std::string& content) {
-        validateEntryExistence(name);
+    // Orders paths component by component, so a directory comes right
+    // before everything below it.
+    static bool pathLess(std::string_view a, std::string_view b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+            unsigned char left = x == '/' ? 0 : static_cast<unsigned char>(x);
+            unsigned char right = y == '/' ? 0 : static_cast<unsigned char>(y);
+            return left < right;
+        });
+    }
 
-        File& file = directoryStructure[currentDirectory].files[name];
-        file.content = content;
+    static std::string childPath(std::string_view parent, std::string_view name) {
+        std::string path(parent);
+        if (path != "/") {
+            path += '/';
+        }
+        path.append(name.data(), name.size());
+        return path;
+    }
 
-        saveFileSystem();
-        std::cout << "File written successfully.\n";
+    static std::string_view parentPath(std::string_view path) {
+        std::size_t slash = path.rfind('/');
+        return slash == 0 ? path.substr(0, 1) : path.substr(0, slash);
     }
 
-    void readFile(const std::string& name) {
-        validateEntryExistence(name);
+    // Glob match with * and ?; a * that fails to match retries one
+    // character further instead of backtracking recursively.
+    static bool globMatch(std::string_view pattern, std::string_view name) {
+        std::size_t p = 0, n = 0;
+        std::size_t star = std::string_view::npos, resume = 0;
+        while (n < name.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+                ++p;
+                ++n;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+                star = p++;
+                resume = n;
+            } else if (star != std::string_view::npos) {
+                p = star + 1;
+                n = ++resume;
+            } else {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*') {
+            ++p;
+        }
+        return p == pattern.size();
+    }
 
-        const File& file = directoryStructure[currentDirectory].files[name];
-        std::cout << "File content:\n";
-        std::cout << file.content << std::endl;
+    // Inserts file under its own name, which the map key and the index view.
+    static File& addFile(Directory& dir, File file) {
+        std::string_view key = file.name;
+        File& added = dir.files.emplace(key, std::move(file)).first->second;
+        dir.index.addFile(added);
+        return added;
     }
 
-    void deleteFile(const std::string& name) {
-        validateEntryExistence(name);
+    static void addSubdirectory(Directory& parent, const Directory& child) {
+        parent.subdirectories.emplace(child.name, child.inode);
+        parent.index.addDirectory(child.name);
+    }
 
-        File& file = directoryStructure[currentDirectory].files[name];
-        deallocateFileBlocks(file);
+    std::string pathOf(InodeId inode) {
+        std::vector<std::string_view> names;
+        while (inode != ROOT_INODE) {
+            const Directory& dir = directory(inode);
+            names.push_back(dir.name);
+            inode = dir.parent;
+        }
 
-        directoryStructure[currentDirectory].files.erase(name);
+        std::string path;
+        for (auto name = names.rbegin(); name != names.rend(); ++name) {
+            path += '/';
+            path += *name;
+        }
+        return path.empty() ? "/" : path;
+    }
 
-        saveFileSystem();
-        std::cout << "File deleted successfully.\n";
+    // Cached paths go stale whenever a directory changes name or parent.
+    void namespaceChanged() {
+        WriteLock cacheGuard(dentryLock);
+        dentryCache.clear();
     }
 
-    void listDirectory() {
-        const Directory& currentDir = directoryStructure[currentDirectory];
-        std::cout << "Directory: " << currentDirectory << std::endl;
+    static std::string encodeExtents(const ExtentList& extents) {
+        return std::string(reinterpret_cast<const char*>(extents.data()), extents.size() * sizeof(Extent));
+    }
+
+    static ExtentList decodeExtents(const std::string& encoded) {
+        std::vector<Extent> decoded(encoded.size() / sizeof(Extent));
+        std::memcpy(decoded.data(), encoded.data(), decoded.size() * sizeof(Extent));
+        ExtentList extents;
+        extents.assign(decoded.begin(), decoded.end());
+        return extents;
+    }
 
-        for (const auto& filePair : currentDir.files) {
-            const File& file = filePair.second;
-            std::cout << "- " << file.name << " [" << file.permissions << "]" << std::endl;
+    const Snapshot& findSnapshot(const std::string& name) {
+        auto entry = snapshots.find(name);
+        if (entry == snapshots.end()) {
+            throw FileSystemError(Status::NotFound, "Snapshot not found!");
         }
+        return entry->second;
+    }
 
-        for (const std::string& subdir : currentDir.subdirectories) {
-            std::cout << "> " << subdir << std::endl;
+    void validateSnapshotName(const std::string& name) {
+        if (name.empty()) {
+            throw std::invalid_argument("Snapshot name cannot be empty!");
+        }
+        if (transaction) {
+            throw std::runtime_error("Snapshots cannot be changed inside a transactional batch!");
         }
     }
 
-    void createDirectory(const std::string& name) {
-        validateDirectoryName(name);
-        validateEntrynonExistence(name);
+    FileVersionPtr freezeFile(const File& file) {
+        return FileVersionPtr(new FileVersion{file.inode, file.permissions, file.fileSize, file.contentSize, file.extents},
+                              VersionReleaser{this});
+    }
 
-        if (directoryStructure.size() >= MAX_DIRS) {
-            throw std::runtime_error("File system reached maximum directory limit!");
+    // Returns the frozen version of dir, refreezing it when it changed.
+    // Unchanged files keep their versions. Caller holds namespaceLock
+    // exclusively, or captureLock and dir at least shared.
+    DirectoryVersionPtr freezeDirectory(const Directory& dir) {
+        if (dir.frozen && !dir.changed.value.load()) {
+            return dir.frozen;
         }
+        std::shared_ptr<DirectoryVersion> version(new DirectoryVersion{dir.inode, dir.parent, dir.name.str(), {}});
+        version->files.reserve(dir.files.size());
+        for (const auto& entry : dir.files) {
+            const File& file = entry.second;
+            if (!file.frozen) {
+                file.frozen = freezeFile(file);
+            }
+            version->files.emplace_back(entry.first, file.frozen);
+        }
+        dir.frozen = std::move(version);
+        dir.changed.value = false;
+        return dir.frozen;
+    }
 
-        Directory newDir;
-        directoryStructure[name] = newDir;
+    // Drops frozen versions that no snapshot holds or that no longer match the
+    // directory, then file versions only their file still holds, which gives
+    // back the block references of pinned ones. Caller holds namespaceLock
+    // exclusively.
+    void dropStaleVersions() {
+        for (auto& entry : directoryStructure) {
+            Directory& dir = entry.second;
+            if (dir.changed.value.load() || dir.frozen.use_count() == 1) {
+                dir.frozen.reset();
+                dir.changed.value = true;
+            }
+            for (auto& fileEntry : dir.files) {
+                if (fileEntry.second.frozen.use_count() == 1) {
+                    fileEntry.second.frozen.reset();
+                }
+            }
+        }
+    }
 
-        directoryStructure[currentDirectory].subdirectories.push_back(name);
+    // Called before a directory, its name or parent, or one of its files
+    // changes, holding the directory at least shared.
+    void directoryChanged(const Directory& dir) {
+        captureForSnapshots(dir);
+        dir.changed.value.store(true, std::memory_order_relaxed);
+    }
 
-        saveFileSystem();
-        std::cout << "Directory created successfully.\n";
+    // Keeps the state dir has now for the open snapshots taken since it last
+    // changed, before the caller changes it. Every change to dir or its files
+    // comes here first, so while one command captures dir, the others that
+    // would change it wait here without having touched it.
+    void captureForSnapshots(const Directory& dir) {
+        std::uint64_t epoch = snapshotEpoch;
+        if (dir.captured.value.load(std::memory_order_acquire) == epoch) {
+            return;
+        }
+        std::lock_guard<std::mutex> captureGuard(captureLock);
+        if (dir.captured.value.load(std::memory_order_relaxed) == epoch) {
+            return;
+        }
+        if (openSnapshots > 0) {
+            dir.history.emplace_back(epoch - 1, freezeDirectory(dir));
+        }
+        dir.captured.value.store(epoch, std::memory_order_release);
     }
 
-    void moveDirectory(const std::string& source, const std::string& destination) {
-        validateDirectoryExistence(source);
-        validateEntrynonExistence(destination);
+    // Called before a file's blocks or size change, holding the file
+    // exclusively. When a snapshot still holds the file's frozen version,
+    // the version pins the blocks, and writes then copy them like any other
+    // shared block.
+    void fileChanged(const Directory& dir, File& file) {
+        directoryChanged(dir);
+        if (!file.frozen) {
+            return;
+        }
+        if (file.frozen.use_count() > 1 && !file.frozen->pinned) {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            for (const Extent& extent : file.frozen->extents) {
+                for (std::uint64_t block = extent.start; !extent.hole() && block < extent.start + extent.length; ++block) {
+                    blockRefs.addOwner(block);
+                }
+            }
+            file.frozen->pinned = true;
+            sharingActive = true;
+            if (transaction) {
+                transaction->pinned.push_back(file.frozen);
+            }
+        }
+        file.frozen.reset();
+    }
 
-        if (source == destination) {
-            throw std::invalid_argument("Source and destination directories are the same!");
+    void releaseVersion(const FileVersion& version) {
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        for (const Extent& extent : version.extents) {
+            releaseExtent(extent);
         }
+    }
 
-        if (isSubdirectory(destination, source)) {
-            throw std::invalid_argument("Cannot move directory inside its subdirectory!");
+    void allocateFileBlocks(File& file, std::uint64_t size) {
+        std::uint64_t start = Stats::now();
+        std::uint64_t requiredBlocks = (size + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE;
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+
+        if (requiredBlocks > blockAllocator.freeBlocks()) {
+            throw FileSystemError(Status::NoSpace, "Insufficient storage space to allocate file blocks!");
         }
 
-        Directory& sourceDir = directoryStructure[source];
-        Directory& destDir = directoryStructure[destination];
+        ExtentList freeExtents = findFreeBlocks(requiredBlocks);
 
-        destDir.subdirectories.push_back(source);
-        sourceDir.subdirectories.erase(
-            std::remove(sourceDir.subdirectories.begin(), sourceDir.subdirectories.end(), source),
-            sourceDir.subdirectories.end()
-        );
+        if (freeExtents.empty() && requiredBlocks > 0) {
+            throw FileSystemError(Status::NoSpace, "File size exceeds available space!");
+        }
 
-        saveFileSystem();
-        std::cout << "Directory moved successfully.\n";
+        for (const Extent& extent : freeExtents) {
+            blockAllocator.reserve(extent);
+            file.extents.push_back(extent);
+        }
+        stats.add(Stats::Counter::BlocksAllocated, requiredBlocks);
+        stats.recordOperation(Stats::Operation::Allocate, start);
     }
 
-void renameEntry(const std::string& oldName, const std::string& newName) {
-    validateEntryExistence(oldName);
-    validateEntryExistence(newName);
+    void deallocateFileBlocks(const ExtentList& extents) {
+        std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+        for (const Extent& extent : extents) {
+            releaseExtent(extent);
+        }
+    }
 
-    if (newName.empty()) {
-        throw std::invalid_argument("New name cannot be empty!");
+    // Drops one owner of every block in extent and frees the blocks left
+    // without one; a hole has nothing to free. Caller holds allocatorLock.
+    void releaseExtent(const Extent& extent) {
+        if (extent.hole()) {
+            return;
+        }
+        if (blockRefs.empty()) {
+            freeExtent(extent);
+            return;
+        }
+        std::uint64_t run = extent.start;
+        std::uint64_t end = extent.start + extent.length;
+        for (std::uint64_t block = extent.start; block < end; ++block) {
+            if (!blockRefs.dropOwner(block)) {
+                if (block > run) {
+                    freeExtent({run, block - run});
+                }
+                run = block + 1;
+            }
+        }
+        if (end > run) {
+            freeExtent({run, end - run});
+        }
+        sharingActive = !blockRefs.empty();
     }
 
-    if (newName.find('/') != std::string::npos) {
-        throw std::invalid_argument("New name cannot contain '/' character!");
+    // Caller holds allocatorLock.
+    void freeExtent(const Extent& extent) {
+        for (std::uint64_t block = extent.start; !blockHashes.empty() && block < extent.start + extent.length; ++block) {
+            blockHashes.forget(block);
+        }
+        if (transaction) {
+            transaction->deferredFrees.push_back(extent);
+        } else {
+            blockAllocator.release(extent);
+            stats.add(Stats::Counter::BlocksFreed, extent.length);
+        }
     }
 
-    Directory& currentDir = directoryStructure[currentDirectory];
+    // Takes ownership of the blocks of a file being loaded or replayed. A
+    // block that another file already owns becomes shared with it. Caller
+    // holds allocatorLock.
+    void claimExtent(const Extent& extent) {
+        if (extent.hole()) {
+            return;
+        }
+        if (extent.start > blockAllocator.capacity() || extent.length > blockAllocator.capacity() - extent.start) {
+            throw std::runtime_error("Corrupt file system image!");
+        }
+        std::uint64_t run = extent.start;
+        std::uint64_t end = extent.start + extent.length;
+        for (std::uint64_t block = extent.start; block < end; ++block) {
+            if (blockAllocator.isAllocated(block)) {
+                if (block > run) {
+                    blockAllocator.reserve({run, block - run});
+                }
+                blockRefs.addOwner(block);
+                run = block + 1;
+            }
+        }
+        if (end > run) {
+            blockAllocator.reserve({run, end - run});
+        }
+        sharingActive = !blockRefs.empty();
+    }
 
-    if (currentDir.files.find(oldName) != currentDir.files.end()) {
-        File& file = currentDir.files[oldName];
-        file.name = newName;
-    } else {
-        for (std::string& subdir : currentDir.subdirectories) {
-            if (subdir == oldName) {
-                subdir = newName;
-                break;
+    // Gives a file its own copy of the shared blocks in a byte range before
+    // the range is written. The copies are made under the allocator lock, so
+    // no other owner can change a block while it is being copied. Caller
+    // holds the file exclusively.
+    void unshareBlocks(const Directory& dir, File& file, std::uint64_t offset, std::uint64_t length) {
+        if (length == 0 || !sharingActive.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::uint64_t first = offset / BlockDevice::BLOCK_SIZE;
+        std::uint64_t end = (offset + length + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE;
+        std::uint64_t copied;
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            std::vector<std::uint64_t> shared;  // Logical blocks to copy
+            forEachBlock(file.extents, first, end, [&](std::uint64_t logical, std::uint64_t physical) {
+                if (blockRefs.isShared(physical)) {
+                    shared.push_back(logical);
+                }
+            });
+            if (shared.empty()) {
+                return;
+            }
+            if (shared.size() > blockAllocator.freeBlocks()) {
+                throw FileSystemError(Status::NoSpace, "Insufficient storage space to copy shared blocks!");
+            }
+
+            std::vector<std::uint64_t> fresh = expandExtents(blockAllocator.allocate(shared.size()));
+            std::vector<std::uint64_t> blocks = expandExtents(file.extents);
+            std::vector<char> buffer(BlockDevice::BLOCK_SIZE);
+            for (std::size_t i = 0; i < shared.size(); ++i) {
+                std::uint64_t old = blocks[shared[i]];
+                blockCache.read({{old, 1}}, 0, buffer.data(), buffer.size());
+                blockCache.write({{fresh[i], 1}}, 0, buffer.data(), buffer.size());
+                blocks[shared[i]] = fresh[i];
+                blockRefs.dropOwner(old);
             }
+            file.extents = compactExtents(blocks);
+            sharingActive = !blockRefs.empty();
+            copied = shared.size();
         }
+
+        logBlocks(dir, file);
+        stats.add(Stats::Counter::BlocksAllocated, copied);
+        stats.add(Stats::Counter::CopiedOnWriteBlocks, copied);
     }
 
-    saveFileSystem();
-    std::cout << "Entry renamed successfully.\n";
-}
+    // Prefers one contiguous extent so sequential reads stay sequential on disk.
+    ExtentList findFreeBlocks(std::uint64_t numBlocks) {
+        std::uint64_t start = Stats::now();
+        ExtentList extents = blockAllocator.find(numBlocks);
+        stats.recordOperation(Stats::Operation::FindFreeBlocks, start);
+        return extents;
+    }
 
-    void appendFile(const std::string& name, const std::string& content) {
-        validateEntryExistence(name);
+    void saveFileSystem() {
+        std::uint64_t start = Stats::now();
+        materializeSnapshots();
+        // Lay out all tables first so every offset is known before writing
+        image::ImageHeader header = {};
+        std::vector<image::DirectoryRecord> directories;
+        std::vector<image::FileRecord> files;
+        std::vector<Extent> extents;
+        std::vector<image::SnapshotRecord> snapshotRecords;
+        std::vector<image::DirectoryRecord> snapshotDirectories;
+        std::vector<image::FileRecord> snapshotFiles;
+        std::string strings;
 
-        File& file = directoryStructure[currentDirectory].files[name];
-        int newSize = file.content.size() + content.size();
+        auto addString = [&strings](std::string_view value) {
+            image::StringRef ref = {strings.size(), value.size()};
+            strings += value;
+            return ref;
+        };
+        auto fileRecord = [&](std::string_view name, InodeId inode, Permissions permissions, std::uint64_t fileSize,
+                              std::uint64_t contentSize, const ExtentList& fileExtents) {
+            image::FileRecord record = {};
+            record.inode = inode;
+            record.name = addString(name);
+            record.permissions = addString(permissions.str());
+            record.fileSize = static_cast<std::int64_t>(fileSize);
+            record.contentSize = contentSize;
+            record.firstExtent = extents.size();
+            record.extentCount = fileExtents.size();
+            extents.insert(extents.end(), fileExtents.begin(), fileExtents.end());
+            return record;
+        };
 
-        if (newSize > file.fileSize) {
-            throw std::runtime_error("File size exceeded!");
+        for (const auto& entry : directoryStructure) {
+            const Directory& directory = entry.second;
+
+            image::DirectoryRecord record = {};
+            record.inode = directory.inode;
+            record.parent = directory.parent;
+            record.name = addString(directory.name);
+            record.firstFile = files.size();
+            record.fileCount = directory.files.size();
+            directories.push_back(record);
+
+            for (const auto& fileEntry : directory.files) {
+                const File& file_ = fileEntry.second;
+                files.push_back(fileRecord(fileEntry.first, file_.inode, file_.permissions, file_.fileSize, file_.contentSize, file_.extents));
+            }
         }
 
-        file.content += content;
+        // Versions shared between snapshots are written once per snapshot
+        for (const auto& entry : snapshots) {
+            const Snapshot& snapshot = entry.second;
+            image::SnapshotRecord record = {};
+            record.name = addString(snapshot.name);
+            record.createdAt = snapshot.createdAt;
+            record.firstDirectory = snapshotDirectories.size();
+            record.directoryCount = snapshot.directories.size();
+            snapshotRecords.push_back(record);
 
-        saveFileSystem();
-        std::cout << "Content appended to file successfully.\n";
-    }
+            for (const DirectoryVersionPtr& version : snapshot.directories) {
+                image::DirectoryRecord directoryRecord = {};
+                directoryRecord.inode = version->inode;
+                directoryRecord.parent = version->parent;
+                directoryRecord.name = addString(version->name);
+                directoryRecord.firstFile = snapshotFiles.size();
+                directoryRecord.fileCount = version->files.size();
+                snapshotDirectories.push_back(directoryRecord);
+                for (const auto& fileEntry : version->files) {
+                    const FileVersion& file_ = *fileEntry.second;
+                    snapshotFiles.push_back(fileRecord(fileEntry.first, file_.inode, file_.permissions, file_.fileSize, file_.contentSize, file_.extents));
+                }
+            }
+        }
 
-    void allocateFileBlocks(File& file, int size) {
-        int requiredBlocks = (size + 1023) / 1024;
+        checkpointLsn = journal.lastLsn();
+        header.magic = image::MAGIC;
+        header.version = image::VERSION;
+        header.headerSize = sizeof(header);
+        header.checkpointLsn = checkpointLsn;
+        header.currentDirectory = console.currentDirectory;
+        header.nextInode = nextInode;
+        header.directoryCount = directories.size();
+        header.directoryTableOffset = sizeof(header);
+        header.fileCount = files.size();
+        header.fileTableOffset = header.directoryTableOffset + directories.size() * sizeof(image::DirectoryRecord);
+        header.extentCount = extents.size();
+        header.extentTableOffset = header.fileTableOffset + files.size() * sizeof(image::FileRecord);
+        header.capacityBlocks = blockAllocator.capacity();
+        header.snapshotCount = snapshotRecords.size();
+        header.snapshotTableOffset = header.extentTableOffset + extents.size() * sizeof(Extent);
+        header.snapshotDirectoryCount = snapshotDirectories.size();
+        header.snapshotDirectoryTableOffset = header.snapshotTableOffset + snapshotRecords.size() * sizeof(image::SnapshotRecord);
+        header.snapshotFileCount = snapshotFiles.size();
+        header.snapshotFileTableOffset = header.snapshotDirectoryTableOffset + snapshotDirectories.size() * sizeof(image::DirectoryRecord);
+        header.stringsOffset = header.snapshotFileTableOffset + snapshotFiles.size() * sizeof(image::FileRecord);
+        header.stringsSize = strings.size();
+        header.directoryTableChecksum = crc32c::compute(directories.data(), directories.size() * sizeof(image::DirectoryRecord));
+        header.fileTableChecksum = crc32c::compute(files.data(), files.size() * sizeof(image::FileRecord));
+        header.extentTableChecksum = crc32c::compute(extents.data(), extents.size() * sizeof(Extent));
+        header.snapshotTableChecksum = crc32c::compute(snapshotRecords.data(), snapshotRecords.size() * sizeof(image::SnapshotRecord));
+        header.snapshotDirectoryTableChecksum =
+            crc32c::compute(snapshotDirectories.data(), snapshotDirectories.size() * sizeof(image::DirectoryRecord));
+        header.snapshotFileTableChecksum = crc32c::compute(snapshotFiles.data(), snapshotFiles.size() * sizeof(image::FileRecord));
+        header.stringsChecksum = crc32c::compute(strings.data(), strings.size());
+        header.headerChecksum = image::headerChecksum(header);
 
-        if (requiredBlocks > MAX_CAPACITY - diskBlockMap.count()) {
-            throw std::runtime_error("Insufficient storage space to allocate file blocks!");
+        // Write a fresh image next to the old one and swap it in, so a crash
+        // never leaves a half-written image behind.
+        std::string tempPath = imagePath + ".tmp";
+        std::ofstream file(tempPath, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Failed to save the file system to disk!");
         }
 
-        std::vector<int> freeBlocks = findFreeBlocks(requiredBlocks);
+        std::uint64_t savedBytes = header.stringsOffset + header.stringsSize;
+        std::uint64_t rawBytes = savedBytes;
+        if (compressImage) {
+            std::string body;
+            body.reserve(rawBytes - sizeof(header));
+            body.append(reinterpret_cast<const char*>(directories.data()), directories.size() * sizeof(image::DirectoryRecord));
+            body.append(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(image::FileRecord));
+            body.append(reinterpret_cast<const char*>(extents.data()), extents.size() * sizeof(Extent));
+            body.append(reinterpret_cast<const char*>(snapshotRecords.data()), snapshotRecords.size() * sizeof(image::SnapshotRecord));
+            body.append(reinterpret_cast<const char*>(snapshotDirectories.data()), snapshotDirectories.size() * sizeof(image::DirectoryRecord));
+            body.append(reinterpret_cast<const char*>(snapshotFiles.data()), snapshotFiles.size() * sizeof(image::FileRecord));
+            body += strings;
+            std::string compressed = codec::compress(body.data(), body.size());
 
-        if (freeBlocks.size() != requiredBlocks) {
-            throw std::invalid_argument("File size exceeds available space!");
+            image::ImageHeader stored = header;
+            stored.magic = image::COMPRESSED_MAGIC;
+            file.write(reinterpret_cast<const char*>(&stored), sizeof(stored));
+            file.write(compressed.data(), compressed.size());
+            savedBytes = sizeof(stored) + compressed.size();
+        } else {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(directories.data()), directories.size() * sizeof(image::DirectoryRecord));
+            file.write(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(image::FileRecord));
+            file.write(reinterpret_cast<const char*>(extents.data()), extents.size() * sizeof(Extent));
+            file.write(reinterpret_cast<const char*>(snapshotRecords.data()), snapshotRecords.size() * sizeof(image::SnapshotRecord));
+            file.write(reinterpret_cast<const char*>(snapshotDirectories.data()), snapshotDirectories.size() * sizeof(image::DirectoryRecord));
+            file.write(reinterpret_cast<const char*>(snapshotFiles.data()), snapshotFiles.size() * sizeof(image::FileRecord));
+            file.write(strings.data(), strings.size());
         }
 
-        for (int block : freeBlocks) {
-            file.blockIndices.push_back(block);
-            diskBlockMap.set(block);
+        file.close();
+        if (!file) {
+            throw std::runtime_error("Failed to save the file system to disk!");
         }
-    }
 
-    void deallocateFileBlocks(const File& file) {
-        for (int block : file.blockIndices) {
-            diskBlockMap.reset(block);
+        int fd = ::open(tempPath.c_str(), O_RDONLY);
+        if (fd < 0 || ::fsync(fd) != 0 || std::rename(tempPath.c_str(), imagePath.c_str()) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            throw std::runtime_error("Failed to save the file system to disk!");
+        }
+        ::close(fd);
+
+        // The index goes after the image it belongs to, so a crash in between
+        // leaves an index of an older checkpoint, which a load rebuilds
+        if (contentIndex.dirty()) {
+            contentIndex.save(contentIndexPath, checkpointLsn);
+        } else {
+            contentIndex.stamp(contentIndexPath, checkpointLsn);
         }
+
+        stats.add(Stats::Counter::SavedBytes, savedBytes);
+        stats.set(Stats::Counter::LastSaveBytes, savedBytes);
+        stats.set(Stats::Counter::LastSaveRawBytes, rawBytes);
+        stats.recordOperation(Stats::Operation::Save, start);
     }
 
-    std::vector<int> findFreeBlocks(int numBlocks) {
-        std::vector<int> freeBlocks;
-        int count = 0;
+    void loadFileSystem() {
+        std::uint64_t start = Stats::now();
+        loadImage();
+        blockDevice.setCapacity(blockAllocator.capacity());
+        bool indexed = contentIndex.load(contentIndexPath, checkpointLsn);
+
+        // Bring the image up to date with mutations logged since its checkpoint
+        journal.recover(checkpointLsn, [this](const JournalRecord& record) {
+            applyRecord(record);
+        });
 
-        for (int i = 0; i < diskBlockMap.size() && count < numBlocks; ++i) {
-            if (!diskBlockMap.test(i)) {
-                freeBlocks.push_back(i);
-                ++count;
+        // Without a saved index of this checkpoint, every file is indexed anew
+        if (!indexed) {
+            for (const auto& entry : directoryStructure) {
+                for (const auto& fileEntry : entry.second.files) {
+                    staleContent.insert(fileEntry.second.inode);
+                }
             }
         }
-
-        return freeBlocks;
+        indexStaleContent();
+        stats.recordOperation(Stats::Operation::Load, start);
     }
 
-    void saveFileSystem() {
-        std::ofstream file("filesystem.dat", std::ios::binary);
-        if (!file) {
-            throw std::runtime_error("Failed to save the file system to disk!");
+    void loadImage() {
+        image::MappedImage map(imagePath);
+        if (!map.valid()) {
+            initializeFileSystem();
+            return;
+        }
+
+        image::ImageHeader header = {};
+        std::memcpy(&header, map.data(), std::min(map.size(), sizeof(header)));
+        if (header.magic == image::COMPRESSED_MAGIC) {
+            map.adopt(decompressImage(map, header));
+            header.magic = image::MAGIC;
+        }
+        if (header.magic != image::MAGIC) {
+            if (!image::isLegacyImage(map.data(), map.size())) {
+                throw FileSystemError(Status::Corrupted, "Unrecognised header in the file system image!");
+            }
+            loadLegacyImage(map);
+            return;
+        }
+        // Only version 6 images have checksums, so no other version is trusted
+        if (header.version != image::VERSION || header.headerSize != sizeof(header)) {
+            throw FileSystemError(Status::Corrupted, "Unsupported version or corrupt header in the file system image!");
+        }
+        std::vector<std::string> corrupt = map.corruptRegions(header);
+        if (!corrupt.empty()) {
+            throw FileSystemError(Status::Corrupted, "Checksum mismatch in the " + corrupt.front() + " of the file system image!");
         }
 
-        // Save directory structure size
-        std::size_t directoryStructureSize = directoryStructure.size();
-        file.write(reinterpret_cast<const char*>(&directoryStructureSize), sizeof(directoryStructureSize));
+        // The image only holds metadata; file content stays in the block device until used
+        const image::DirectoryRecord* directories = map.at<image::DirectoryRecord>(header.directoryTableOffset, header.directoryCount);
+        const image::FileRecord* files = map.at<image::FileRecord>(header.fileTableOffset, header.fileCount);
+        const Extent* extents = map.at<Extent>(header.extentTableOffset, header.extentCount);
+        if (header.capacityBlocks > blockAllocator.capacity()) {
+            blockAllocator.resize(header.capacityBlocks);
+        }
 
-        // Save current directory
-        std::size_t currentDirectorySize = currentDirectory.size();
-        file.write(reinterpret_cast<const char*>(&currentDirectorySize), sizeof(currentDirectorySize));
-        file.write(currentDirectory.data(), currentDirectorySize);
+        for (std::uint64_t i = 0; i < header.directoryCount; ++i) {
+            const image::DirectoryRecord& record = directories[i];
+            if (record.firstFile > header.fileCount || record.fileCount > header.fileCount - record.firstFile) {
+                throw std::runtime_error("Corrupt file system image!");
+            }
 
-        // Save directory structure entries
-        for (const auto& entry : directoryStructure) {
-            const std::string& directoryName = entry.first;
-            const Directory& directory = entry.second;
+            Directory directory;
+            directory.inode = record.inode;
+            directory.parent = record.parent;
+            directory.name = Name(map.string(record.name, header.stringsOffset));
+            directory.files.reserve(record.fileCount);
+            for (std::uint64_t j = record.firstFile; j < record.firstFile + record.fileCount; ++j) {
+                const image::FileRecord& fileRecord = files[j];
+                if (fileRecord.firstExtent > header.extentCount || fileRecord.extentCount > header.extentCount - fileRecord.firstExtent) {
+                    throw std::runtime_error("Corrupt file system image!");
+                }
 
-            // Save directory name size and name
-            std::size_t directoryNameSize = directoryName.size();
-            file.write(reinterpret_cast<const char*>(&directoryNameSize), sizeof(directoryNameSize));
-            file.write(directoryName.data(), directoryNameSize);
+                File fileEntry;
+                fileEntry.inode = fileRecord.inode;
+                fileEntry.name = Name(map.string(fileRecord.name, header.stringsOffset));
+                fileEntry.permissions = Permissions::parseStored(map.string(fileRecord.permissions, header.stringsOffset));
+                fileEntry.fileSize = static_cast<std::uint64_t>(fileRecord.fileSize);
+                fileEntry.contentSize = fileRecord.contentSize;
+                std::uint64_t allocatedBlocks = 0;
+                for (std::uint64_t k = fileRecord.firstExtent; k < fileRecord.firstExtent + fileRecord.extentCount; ++k) {
+                    claimExtent(extents[k]);
+                    fileEntry.extents.push_back(extents[k]);
+                    allocatedBlocks += extents[k].length;
+                }
+                if (fileEntry.contentSize > allocatedBlocks * BlockDevice::BLOCK_SIZE) {
+                    throw std::runtime_error("Corrupt file system image!");
+                }
+                addFile(directory, std::move(fileEntry));
+            }
 
-            // Save file entries size
-            std::size_t filesSize = directory.files.size();
-            file.write(reinterpret_cast<const char*>(&filesSize), sizeof(filesSize));
+            directoryStructure[directory.inode] = std::move(directory);
+        }
 
-            // Save file entries
-            for (const auto& fileEntry : directory.files) {
-                const std::string& fileName = fileEntry.first;
-                const File& file_ = fileEntry.second;
+        // Rebuild the child maps from the parent inodes
+        for (auto& entry : directoryStructure) {
+            Directory& dir = entry.second;
+            auto parent = directoryStructure.find(dir.parent);
+            if (parent == directoryStructure.end()) {
+                throw std::runtime_error("Corrupt file system image!");
+            }
+            if (dir.inode != ROOT_INODE) {
+                addSubdirectory(parent->second, dir);
+            }
+        }
+        if (directoryStructure.find(ROOT_INODE) == directoryStructure.end()) {
+            throw std::runtime_error("Corrupt file system image!");
+        }
 
-                // Save file name size and name
-                std::size_t fileNameSize = fileName.size();
-                file.write(reinterpret_cast<const char*>(&fileNameSize), sizeof(fileNameSize));
-                file.write(fileName.data(), fileNameSize);
+        loadSnapshots(map, header, extents);
 
-                // Save file content size and content
-                std::size_t contentSize = file_.content.size();
-                file.write(reinterpret_cast<const char*>(&contentSize), sizeof(contentSize));
-                file.write(file_.content.data(), contentSize);
+        nextInode = header.nextInode;
+        console.currentDirectory = directoryStructure.count(header.currentDirectory) ? header.currentDirectory : ROOT_INODE;
+        checkpointLsn = header.checkpointLsn;
+    }
 
-                // Save file permissions size and permissions
-                std::size_t permissionsSize = file_.permissions.size();
-                file.write(reinterpret_cast<const char*>(&permissionsSize), sizeof(permissionsSize));
-                file.write(file_.permissions.data(), permissionsSize);
+    // Rebuilds the snapshots after the live tree. A version equal to a live
+    // file becomes the file's frozen version again, leaving the blocks to the
+    // file; any other version takes a reference to its blocks. Equal versions
+    // in several snapshots are shared again.
+    void loadSnapshots(const image::MappedImage& map, const image::ImageHeader& header, const Extent* extents) {
+        const image::SnapshotRecord* records = map.at<image::SnapshotRecord>(header.snapshotTableOffset, header.snapshotCount);
+        const image::DirectoryRecord* directories = map.at<image::DirectoryRecord>(header.snapshotDirectoryTableOffset, header.snapshotDirectoryCount);
+        const image::FileRecord* files = map.at<image::FileRecord>(header.snapshotFileTableOffset, header.snapshotFileCount);
+        auto sameExtents = [](const ExtentList& a, const ExtentList& b) {
+            return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const Extent& x, const Extent& y) {
+                return x.start == y.start && x.length == y.length;
+            });
+        };
+        auto sameVersion = [&](const FileVersion& version, const File& file) {
+            return version.inode == file.inode && version.permissions == file.permissions && version.fileSize == file.fileSize &&
+                   version.contentSize == file.contentSize && sameExtents(version.extents, file.extents);
+        };
 
-                // Save file size
-                file.write(reinterpret_cast<const char*>(&file_.fileSize), sizeof(file_.fileSize));
+        std::unordered_map<InodeId, File*> liveFiles;
+        for (auto& entry : directoryStructure) {
+            for (auto& fileEntry : entry.second.files) {
+                liveFiles[fileEntry.second.inode] = &fileEntry.second;
             }
         }
+        std::unordered_multimap<InodeId, FileVersionPtr> loaded;
 
-        file.close();
+        auto version = [&](const std::string& name, const image::FileRecord& record) {
+            if (record.firstExtent > header.extentCount || record.extentCount > header.extentCount - record.firstExtent) {
+                throw std::runtime_error("Corrupt file system image!");
+            }
+            File candidate;
+            candidate.inode = record.inode;
+            candidate.name = Name(name);
+            candidate.permissions = Permissions::parseStored(map.string(record.permissions, header.stringsOffset));
+            candidate.fileSize = static_cast<std::uint64_t>(record.fileSize);
+            candidate.contentSize = record.contentSize;
+            candidate.extents.assign(extents + record.firstExtent, extents + record.firstExtent + record.extentCount);
+
+            auto live = liveFiles.find(record.inode);
+            if (live != liveFiles.end() && live->second->name == name) {
+                File& file = *live->second;
+                if (!file.frozen && sameVersion(FileVersion{file.inode, file.permissions, file.fileSize, file.contentSize, file.extents}, candidate)) {
+                    file.frozen = freezeFile(file);
+                }
+                if (file.frozen && sameVersion(*file.frozen, candidate)) {
+                    return file.frozen;
+                }
+            }
+            auto range = loaded.equal_range(record.inode);
+            for (auto entry = range.first; entry != range.second; ++entry) {
+                if (sameVersion(*entry->second, candidate)) {
+                    return entry->second;
+                }
+            }
+
+            std::uint64_t allocatedBlocks = 0;
+            for (const Extent& extent : candidate.extents) {
+                claimExtent(extent);
+                allocatedBlocks += extent.length;
+            }
+            FileVersionPtr pinned = freezeFile(candidate);
+            pinned->pinned = true;
+            sharingActive = true;
+            loaded.emplace(record.inode, pinned);
+            if (candidate.contentSize > allocatedBlocks * BlockDevice::BLOCK_SIZE) {
+                throw std::runtime_error("Corrupt file system image!");
+            }
+            return pinned;
+        };
+
+        for (std::uint64_t i = 0; i < header.snapshotCount; ++i) {
+            const image::SnapshotRecord& record = records[i];
+            if (record.firstDirectory > header.snapshotDirectoryCount || record.directoryCount > header.snapshotDirectoryCount - record.firstDirectory) {
+                throw std::runtime_error("Corrupt file system image!");
+            }
+
+            Snapshot snapshot;
+            snapshot.name = map.string(record.name, header.stringsOffset);
+            snapshot.createdAt = record.createdAt;
+            for (std::uint64_t j = record.firstDirectory; j < record.firstDirectory + record.directoryCount; ++j) {
+                const image::DirectoryRecord& directoryRecord = directories[j];
+                if (directoryRecord.firstFile > header.snapshotFileCount || directoryRecord.fileCount > header.snapshotFileCount - directoryRecord.firstFile) {
+                    throw std::runtime_error("Corrupt file system image!");
+                }
+                std::shared_ptr<DirectoryVersion> directory(new DirectoryVersion{directoryRecord.inode, directoryRecord.parent, map.string(directoryRecord.name, header.stringsOffset), {}});
+                directory->files.reserve(directoryRecord.fileCount);
+                for (std::uint64_t k = directoryRecord.firstFile; k < directoryRecord.firstFile + directoryRecord.fileCount; ++k) {
+                    std::string name = map.string(files[k].name, header.stringsOffset);
+                    directory->files.emplace_back(name, version(name, files[k]));
+                }
+                snapshot.directories.push_back(std::move(directory));
+            }
+            snapshots[snapshot.name] = std::move(snapshot);
+        }
     }
 
-    void loadFileSystem() {
-        std::ifstream file("filesystem.dat", std::ios::binary);
-        if (!file) {
-            initializeFileSystem();
-            return;
+    // Rebuilds the uncompressed image: the header followed by the tables and
+    // strings the offsets in it refer to.
+    static std::string decompressImage(const image::MappedImage& map, const image::ImageHeader& header) {
+        std::uint64_t headerSize = header.headerSize;
+        if (headerSize != sizeof(header) || map.size() < headerSize) {
+            throw std::runtime_error("Corrupt file system image!");
+        }
+        std::uint64_t size = header.stringsOffset + header.stringsSize;
+        std::uint64_t compressedSize = map.size() - headerSize;
+        if (size < headerSize || header.stringsSize > size ||
+            (size - headerSize) / 255 > compressedSize + 1) {  // No codec stream expands that much
+            throw std::runtime_error("Corrupt file system image!");
         }
 
-        // Load directory structure size
+        std::string body = codec::decompress(map.data() + headerSize, compressedSize, size - headerSize);
+        image::ImageHeader plain = header;
+        plain.magic = image::MAGIC;
+        std::string bytes(reinterpret_cast<const char*>(&plain), headerSize);
+        return bytes + body;
+    }
+
+    // Reads images written before the versioned format existed. The layout
+    // was checked by isLegacyImage, but every field is still bounds checked.
+    void loadLegacyImage(const image::MappedImage& map) {
+        image::LegacyReader reader(map.data(), map.size());
+        auto need = [](bool read) {
+            if (!read) {
+                throw FileSystemError(Status::Corrupted, "Truncated field in the file system image!");
+            }
+        };
+
+        // Load directory structure size and current directory
         std::size_t directoryStructureSize;
-        file.read(reinterpret_cast<char*>(&directoryStructureSize), sizeof(directoryStructureSize));
+        std::string_view currentDirectoryName;
+        need(reader.read(directoryStructureSize));
+        need(reader.read(currentDirectoryName));
 
-        // Load current directory
-        std::size_t currentDirectorySize;
-        file.read(reinterpret_cast<char*>(&currentDirectorySize), sizeof(currentDirectorySize));
-        currentDirectory.resize(currentDirectorySize);
-        file.read(&currentDirectory[0], currentDirectorySize);
+        // Legacy images have a flat namespace; every directory besides "/" becomes a child of the root
+        initializeRoot();
 
         // Load directory structure entries
         for (std::size_t i = 0; i < directoryStructureSize; ++i) {
-            // Load directory name size and name
-            std::size_t directoryNameSize;
-            file.read(reinterpret_cast<char*>(&directoryNameSize), sizeof(directoryNameSize));
-            std::string directoryName(directoryNameSize, '\0');
-            file.read(&directoryName[0], directoryNameSize);
-
-            // Load file entries size
+            // Load directory name and file entries size
+            std::string_view directoryName;
             std::size_t filesSize;
-            file.read(reinterpret_cast<char*>(&filesSize), sizeof(filesSize));
+            need(reader.read(directoryName));
+            need(reader.read(filesSize));
 
             // Load file entries
-            Directory directory;
+            InodeId inode = ROOT_INODE;
+            if (directoryName != "/") {
+                inode = nextInode;
+                applyCreateDirectory(ROOT_INODE, inode, std::string(directoryName));
+            }
+            if (directoryName == currentDirectoryName) {
+                console.currentDirectory = inode;
+            }
+
+            Directory& directory = directoryStructure[inode];
             for (std::size_t j = 0; j < filesSize; ++j) {
-                // Load file name size and name
-                std::size_t fileNameSize;
-                file.read(reinterpret_cast<char*>(&fileNameSize), sizeof(fileNameSize));
-                std::string fileName(fileNameSize, '\0');
-                file.read(&fileName[0], fileNameSize);
-
-                // Load file content size and content
-                std::size_t contentSize;
-                file.read(reinterpret_cast<char*>(&contentSize), sizeof(contentSize));
-                std::string content(contentSize, '\0');
-                file.read(&content[0], contentSize);
-
-                // Load file permissions size and permissions
-                std::size_t permissionsSize;
-                file.read(reinterpret_cast<char*>(&permissionsSize), sizeof(permissionsSize));
-                std::string permissions(permissionsSize, '\0');
-                file.read(&permissions[0], permissionsSize);
-
-                // Load file size
+                // Load file name, content, permissions and size
+                std::string_view fileName, content, permissions;
                 int fileSize;
-                file.read(reinterpret_cast<char*>(&fileSize), sizeof(fileSize));
+                need(reader.read(fileName));
+                need(reader.read(content));
+                need(reader.read(permissions));
+                need(reader.read(fileSize));
 
-                // Create file entry and add it to the directory
+                // Create file entry and move its content into blocks
                 File fileEntry;
-                fileEntry.name = fileName;
-                fileEntry.content = content;
-                fileEntry.permissions = permissions;
+                fileEntry.inode = nextInode++;
+                fileEntry.name = Name(std::string(fileName));
+                fileEntry.permissions = Permissions::parseStored(std::string(permissions));
                 fileEntry.fileSize = fileSize;
-                directory.files[fileName] = fileEntry;
+                allocateFileBlocks(fileEntry, content.size());
+                blockCache.write(fileEntry.extents, 0, content.data(), content.size());
+                fileEntry.contentSize = content.size();
+                addFile(directory, std::move(fileEntry));
             }
-
-            // Add directory to the directory structure
-            directoryStructure[directoryName] = directory;
         }
 
-        file.close();
+        // Load the checkpoint position; images written before the journal existed have none
+        std::uint64_t magic = 0;
+        checkpointLsn = 0;
+        if (reader.read(magic) && magic == image::LEGACY_CHECKPOINT_MAGIC) {
+            need(reader.read(checkpointLsn));
+        }
     }
 
     void initializeFileSystem() {
+        initializeRoot();
+        saveFileSystem();
+    }
+
+    void initializeRoot() {
         directoryStructure.clear();
-        fileAllocationMap.clear();
-        diskBlockMap.reset();
+        dentryCache.clear();
 
         Directory root;
-        directoryStructure["/"] = root;
-        currentDirectory = "/";
+        root.inode = ROOT_INODE;
+        root.parent = ROOT_INODE;
+        directoryStructure[ROOT_INODE] = root;
+        console.currentDirectory = ROOT_INODE;
+        nextInode = ROOT_INODE + 1;
+    }
 
-        saveFileSystem();
+    // Prints the counters and histograms as text, "json" or "prometheus".
+    void printStats(Session& session, std::string_view format) {
+        StatsGauges gauges = collectGauges();
+        if (format.empty()) {
+            stats.writeText(*session.out, gauges);
+        } else if (format == "json") {
+            stats.writeJson(*session.out, gauges);
+        } else if (format == "prometheus") {
+            stats.writePrometheus(*session.out, gauges);
+        } else {
+            throw std::invalid_argument("Invalid command syntax! Usage: stats [json|prometheus]");
+        }
     }
 
-    void changeDirectory(const std::string& directory) {
-        if (directoryStructure.find(directory) == directoryStructure.end()) {
-            throw std::invalid_argument("Directory not found!");
+    // Walks the whole tree; only reports pay for it, not the commands.
+    StatsGauges collectGauges() {
+        StatsGauges gauges;
+        {
+            std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+            BlockAllocator::FreeSpace space = blockAllocator.freeSpace();
+            gauges.capacityBlocks = blockAllocator.capacity();
+            gauges.freeBlocks = blockAllocator.freeBlocks();
+            gauges.freeExtents = space.runs;
+            gauges.largestFreeExtent = space.largestRun;
+            gauges.sharedBlocks = blockRefs.sharedBlocks();
+            gauges.dedupSavedBlocks = blockRefs.savedBlocks();
         }
+        BufferCache::Counters cache = blockCache.counters();
+        gauges.cacheCapacityBlocks = cache.capacityBlocks;
+        gauges.cachedBlocks = cache.cachedBlocks;
+        gauges.dirtyBlocks = cache.dirtyBlocks;
+        gauges.cacheHits = cache.hits;
+        gauges.cacheMisses = cache.misses;
+        gauges.cacheEvictions = cache.evictions;
+        gauges.cacheWriteBacks = cache.writeBacks;
+        gauges.readAheadBlocks = cache.readAheadBlocks;
 
-        currentDirectory = directory;
-        std::cout << "Changed directory to: " << currentDirectory << std::endl;
+        ReadLock namespaceGuard(namespaceLock);
+        ReadLock tableGuard(tableLock);
+        gauges.directories = directoryStructure.size();
+        for (const auto& entry : directoryStructure) {
+            const Directory& dir = entry.second;
+            ReadLock directoryGuard(dir.lock.mutex);
+            gauges.files += dir.files.size();
+            for (const auto& fileEntry : dir.files) {
+                ReadLock fileGuard(fileEntry.second.lock.mutex);
+                gauges.contentBytes += fileEntry.second.contentSize;
+            }
+        }
+        return gauges;
     }
 
-    void printHelp() {
-        std::cout << "Available commands:\n";
-        std::cout << "- cd <directory>: Change directory\n";
-        std::cout << "- createfile <name> <permissions> <size>: Create a new file\n";
-        std::cout << "- writefile <name> <content>: Write content to a file\n";
-        std::cout << "- readfile <name>: Read content from a file\n";
-        std::cout << "- deletefile <name>: Delete a file\n";
-        std::cout << "- ls: List files and directories in the current directory\n";
-        std::cout << "- mkdir <name>: Create a new directory\n";
-        std::cout << "- mv <source> <destination>: Move a directory\n";
-        std::cout << "- rename <old name> <new name>: Rename a file or directory\n";
-        std::cout << "- appendfile <name> <content>: Append content to an existing file\n";
-        std::cout << "- help: Display available commands\n";
-        std::cout << "- exit: Exit the file system\n";
+    // Runs on the stats thread, so failures are reported instead of thrown.
+    void dumpStats(const std::string& path) {
+        try {
+            StatsGauges gauges = collectGauges();
+            std::string tempPath = path + ".tmp";
+            std::ofstream out(tempPath);
+            bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+            if (json) {
+                stats.writeJson(out, gauges);
+            } else {
+                stats.writePrometheus(out, gauges);
+            }
+            out.close();
+            if (!out || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+                throw std::runtime_error("Failed to write stats to " + path + "!");
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+        }
     }
 
-    std::vector<std::string> tokenizeCommand(const std::string& command) {
-        std::vector<std::string> tokens;
-        std::string token;
-        std::istringstream tokenStream(command);
-        while (std::getline(tokenStream, token, ' ')) {
-            tokens.push_back(token);
-        }
-        return tokens;
+    void printHelp(Session& session) {
+        std::ostream& out = *session.out;
+        out << "Available commands:\n";
+        out << "- cd <path>: Change directory (absolute or relative, '..' for the parent)\n";
+        out << "- createfile <name> <permissions> <size>: Create a new file\n";
+        out << "- writefile [--at <offset>] <name> <content>: Write content to a file, or overwrite part of it at offset; a gap past the end reads as zeros (quote content with \" or ' to keep leading or trailing spaces)\n";
+        out << "- readfile <name> [<offset> <length>]: Read the content of a file, or length bytes of it from offset\n";
+        out << "- deletefile <name>: Delete a file\n";
+        out << "- ls [--sort name|size|permissions] [--prefix <prefix>] [--limit <n>] [--after <name>]: List files and directories in the current directory, a page at a time\n";
+        out << "- find <pattern>: List paths below the current directory whose names match a pattern with * and ?\n";
+        out << "- du [<path>]: Show the content bytes and blocks of every directory, including its subdirectories\n";
+        out << "- tree [<path>]: Show the hierarchy of files and directories\n";
+        out << "- grep <term> [<path>]: List files below the current directory or path whose content contains term\n";
+        out << "- mkdir <name>: Create a new directory\n";
+        out << "- mv <source> <destination>: Move a directory into another directory\n";
+        out << "- rename <old name> <new name>: Rename a file or directory\n";
+        out << "- appendfile <name> <content>: Append content to an existing file\n";
+        out << "- truncate <name> <size>: Cut the content of a file to size and free the blocks past it, or extend it with zeros\n";
+        out << "- fallocate <name> <size>: Reserve blocks for the first size bytes of a file\n";
+        out << "- import <host path> <name>: Create a file with a copy of a file on the host\n";
+        out << "- export <name> <host path>: Copy the content of a file to a file on the host\n";
+        out << "- dedup: Store identical blocks of file content once\n";
+        out << "- scrub: Verify the checksums of the image and of every block, and list the files of corrupt blocks\n";
+        out << "- snapshot create|list|restore|delete [<name>]: Manage point-in-time copies of the whole file system\n";
+        out << "- watch [<path>] [--count <n>] [--timeout <seconds>]: Print changes to a directory as they happen, for 10 seconds by default\n";
+        out << "- stats [json|prometheus]: Show command counts, latencies, storage usage and buffer cache activity\n";
+        out << "- help: Display available commands\n";
+        out << "- exit: Exit the file system\n";
     }
 
     void validateFileName(const std::string& name) {
@@ -524,8 +4137,8 @@ void renameEntry(const std::string& oldName, const std::string& newName) {
         }
     }
 
-    void validateFileSize(int size) {
-        if (size <= 0) {
+    void validateFileSize(std::uint64_t size) {
+        if (size == 0) {
             throw std::invalid_argument("File size must be positive!");
         }
     }
@@ -539,40 +4152,22 @@ void renameEntry(const std::string& oldName, const std::string& newName) {
             throw std::invalid_argument("Directory name cannot contain '/' character!");
         }
     }
-    void validateEntrynonExistence(const std::string& name) {
-        if (directoryStructure.find(currentDirectory) == directoryStructure.end()) {
-            throw std::invalid_argument("Current directory does not exist!");
-        }
-
-        const Directory& currentDir = directoryStructure[currentDirectory];
-        if (currentDir.files.find(name) != currentDir.files.end()) {
-            throw std::invalid_argument("File or directory ");
-        }
-    }
-
-    void validateEntryExistence(const std::string& name) {
-        if (directoryStructure.find(currentDirectory) == directoryStructure.end()) {
-            throw std::invalid_argument("Current directory does not exist!");
-        }
-
-        const Directory& currentDir = directoryStructure[currentDirectory];
-        if (currentDir.files.find(name) == currentDir.files.end()) {
-            throw std::invalid_argument("File or directory not found!");
-        }
-    }
-
-    void validateDirectoryExistence(const std::string& name) {
-        if (directoryStructure.find(name) == directoryStructure.end()) {
-            throw std::invalid_argument("Directory not found!");
+    void validateEntrynonExistence(const Directory& dir, std::string_view name) {
+        if (dir.files.find(name) != dir.files.end() || dir.subdirectories.find(name) != dir.subdirectories.end()) {
+            throw FileSystemError(Status::AlreadyExists, "File or directory already exists!");
         }
     }
 
-    bool isSubdirectory(const std::string& source, const std::string& destination) {
-        for (const std::string& subdir : directoryStructure[destination].subdirectories) {
-            if (subdir == source || isSubdirectory(source, subdir)) {
+    // Walks parent pointers up from node; O(depth of node).
+    bool isAncestor(InodeId ancestor, InodeId node) {
+        while (true) {
+            if (node == ancestor) {
                 return true;
             }
+            if (node == ROOT_INODE) {
+                return false;
+            }
+            node = directory(node).parent;
         }
-        return false;
     }
 };
\ No newline at end of file
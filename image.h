@@ -0,0 +1,318 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "blockdevice.h"
+#include "crc32c.h"
+
+// Versioned on-disk image layout. Table offsets in the header are absolute byte
+// offsets into the image; string offsets are relative to the string region.
+// Every table is an array of fixed-size records so the image can be mapped and
+// walked in place. File content is not part of the image; it lives in the
+// block extents listed in the extent table.
+//
+//   ImageHeader
+//   DirectoryRecord[directoryCount] the hierarchy is rebuilt from parent inodes
+//   FileRecord[fileCount]           files of each directory are contiguous
+//   Extent[extentCount]             extents of each file are contiguous
+//   SnapshotRecord[snapshotCount]   directories of each snapshot are contiguous
+//   DirectoryRecord[snapshotDirectoryCount]
+//   FileRecord[snapshotFileCount]   snapshot files; their extents are in the extent table
+//   string region                   names and permissions
+//
+// Every table, the string region and the header itself have a CRC32C in
+// the header, checked at load. The header checksum is taken with its own
+// field zeroed and the plain magic, so a compressed image has the same one.
+//
+// A compressed image starts with COMPRESSED_MAGIC and a copy of the header,
+// followed by everything after the header compressed as one codec stream.
+// Offsets refer to the image once decompressed.
+namespace image {
+
+const std::uint64_t MAGIC = 0x00474d4953464d46ULL;  // "FMFSIMG\0"
+const std::uint64_t COMPRESSED_MAGIC = 0x005a4d4953464d46ULL;  // "FMFSIMZ\0"
+const std::uint32_t VERSION = 6;
+
+struct StringRef {
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+struct ImageHeader {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t headerSize;
+    std::uint64_t checkpointLsn;
+    std::uint64_t currentDirectory;
+    std::uint64_t nextInode;
+    std::uint64_t directoryCount;
+    std::uint64_t directoryTableOffset;
+    std::uint64_t fileCount;
+    std::uint64_t fileTableOffset;
+    std::uint64_t extentCount;
+    std::uint64_t extentTableOffset;
+    std::uint64_t capacityBlocks;
+    std::uint64_t stringsOffset;
+    std::uint64_t stringsSize;
+    std::uint64_t snapshotCount;
+    std::uint64_t snapshotTableOffset;
+    std::uint64_t snapshotDirectoryCount;
+    std::uint64_t snapshotDirectoryTableOffset;
+    std::uint64_t snapshotFileCount;
+    std::uint64_t snapshotFileTableOffset;
+    std::uint32_t directoryTableChecksum;
+    std::uint32_t fileTableChecksum;
+    std::uint32_t extentTableChecksum;
+    std::uint32_t snapshotTableChecksum;
+    std::uint32_t snapshotDirectoryTableChecksum;
+    std::uint32_t snapshotFileTableChecksum;
+    std::uint32_t stringsChecksum;
+    std::uint32_t headerChecksum;
+};
+
+struct DirectoryRecord {
+    std::uint64_t inode;
+    std::uint64_t parent;
+    StringRef name;
+    std::uint64_t firstFile;
+    std::uint64_t fileCount;
+};
+
+struct FileRecord {
+    std::uint64_t inode;
+    StringRef name;
+    StringRef permissions;
+    std::int64_t fileSize;
+    std::uint64_t contentSize;
+    std::uint64_t firstExtent;
+    std::uint64_t extentCount;
+};
+
+struct SnapshotRecord {
+    StringRef name;
+    std::int64_t createdAt;
+    std::uint64_t firstDirectory;  // Index into the snapshot directory table
+    std::uint64_t directoryCount;
+};
+
+// A checksummed region of the image.
+struct Region {
+    const char* name;
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::uint32_t ImageHeader::*checksum;
+};
+
+inline std::vector<Region> regions(const ImageHeader& header) {
+    return {
+        {"directory table", header.directoryTableOffset, header.directoryCount * sizeof(DirectoryRecord), &ImageHeader::directoryTableChecksum},
+        {"file table", header.fileTableOffset, header.fileCount * sizeof(FileRecord), &ImageHeader::fileTableChecksum},
+        {"extent table", header.extentTableOffset, header.extentCount * sizeof(Extent), &ImageHeader::extentTableChecksum},
+        {"snapshot table", header.snapshotTableOffset, header.snapshotCount * sizeof(SnapshotRecord), &ImageHeader::snapshotTableChecksum},
+        {"snapshot directory table", header.snapshotDirectoryTableOffset, header.snapshotDirectoryCount * sizeof(DirectoryRecord),
+         &ImageHeader::snapshotDirectoryTableChecksum},
+        {"snapshot file table", header.snapshotFileTableOffset, header.snapshotFileCount * sizeof(FileRecord), &ImageHeader::snapshotFileTableChecksum},
+        {"string region", header.stringsOffset, header.stringsSize, &ImageHeader::stringsChecksum},
+    };
+}
+
+inline std::uint32_t headerChecksum(ImageHeader header) {
+    header.magic = MAGIC;
+    header.headerChecksum = 0;
+    return crc32c::compute(&header, sizeof(header));
+}
+
+// Images written before the versioned format have no header: a count of
+// directories and the current directory, then every directory with its
+// files as length-prefixed fields, optionally followed by
+// LEGACY_CHECKPOINT_MAGIC and the checkpoint LSN.
+const std::uint64_t LEGACY_CHECKPOINT_MAGIC = 0x31544b4353464d46ULL;  // "FMFSCKT1"
+
+// Reads the fields of a legacy image in order. A field that would run past
+// the end of the image fails the read and leaves the reader where it was.
+class LegacyReader {
+public:
+    LegacyReader(const char* data, std::size_t size) : cursor(data), end(data + size) {}
+
+    template <typename T>
+    bool read(T& value) {
+        if (remaining() < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return true;
+    }
+
+    // A size_t length followed by that many bytes.
+    bool read(std::string_view& bytes) {
+        const char* start = cursor;
+        std::size_t size;
+        if (!read(size) || size > remaining()) {
+            cursor = start;
+            return false;
+        }
+        bytes = std::string_view(cursor, size);
+        cursor += size;
+        return true;
+    }
+
+    std::size_t remaining() const {
+        return static_cast<std::size_t>(end - cursor);
+    }
+
+private:
+    const char* cursor;
+    const char* end;
+};
+
+// Whether the whole of data is laid out as a legacy image. Legacy images
+// have no magic number, so a newer image whose header is damaged is only
+// told apart from one by its layout.
+inline bool isLegacyImage(const char* data, std::size_t size) {
+    LegacyReader reader(data, size);
+    std::size_t directories;
+    std::string_view text;
+    if (!reader.read(directories) || !reader.read(text)) {
+        return false;
+    }
+    for (std::size_t i = 0; i < directories; ++i) {  // Every directory takes at least 16 bytes, so a bad count fails fast
+        std::size_t files;
+        if (!reader.read(text) || !reader.read(files)) {
+            return false;
+        }
+        for (std::size_t j = 0; j < files; ++j) {
+            std::string_view name, content, permissions;
+            int fileSize;
+            if (!reader.read(name) || !reader.read(content) || !reader.read(permissions) || !reader.read(fileSize)) {
+                return false;
+            }
+        }
+    }
+    std::uint64_t magic, lsn;
+    return reader.remaining() == 0 ||
+           (reader.read(magic) && magic == LEGACY_CHECKPOINT_MAGIC && reader.read(lsn) && reader.remaining() == 0);
+}
+
+// Read-only mapping of a whole image file, or an image held in memory after
+// decompression.
+class MappedImage {
+public:
+    MappedImage() = default;
+
+    explicit MappedImage(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                base = static_cast<const char*>(addr);
+                length = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedImage() {
+        unmap();
+    }
+
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    MappedImage(MappedImage&& other) noexcept : base(other.base), length(other.length), owned(std::move(other.owned)) {
+        if (!owned.empty()) {
+            base = owned.data();
+        }
+        other.base = nullptr;
+        other.length = 0;
+    }
+
+    MappedImage& operator=(MappedImage&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            base = other.base;
+            length = other.length;
+            owned = std::move(other.owned);
+            if (!owned.empty()) {
+                base = owned.data();
+            }
+            other.base = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    // Replaces the mapping with an image held in memory.
+    void adopt(std::string bytes) {
+        unmap();
+        owned = std::move(bytes);
+        base = owned.data();
+        length = owned.size();
+    }
+
+    bool valid() const { return base != nullptr; }
+    const char* data() const { return base; }
+    std::size_t size() const { return length; }
+
+    bool contains(std::uint64_t offset, std::uint64_t size) const {
+        return offset <= length && size <= length - offset;
+    }
+
+    // Bounds-checked pointer to a table or region inside the image.
+    template <typename T>
+    const T* at(std::uint64_t offset, std::uint64_t count = 1) const {
+        if (count > length / sizeof(T) || !contains(offset, count * sizeof(T))) {
+            throw std::runtime_error("Corrupt file system image!");
+        }
+        return reinterpret_cast<const T*>(base + offset);
+    }
+
+    // Names of the parts of a version 6 image that fail their checksums;
+    // empty when all of them match.
+    std::vector<std::string> corruptRegions(const ImageHeader& header) const {
+        if (headerChecksum(header) != header.headerChecksum) {
+            return {"header"};  // The offsets of the other regions cannot be trusted
+        }
+        std::vector<std::string> corrupt;
+        for (const Region& region : regions(header)) {
+            if (region.size > length || !contains(region.offset, region.size) ||
+                crc32c::compute(base + region.offset, region.size) != header.*region.checksum) {
+                corrupt.push_back(region.name);
+            }
+        }
+        return corrupt;
+    }
+
+    // String references are relative to the string region at regionOffset.
+    std::string string(const StringRef& ref, std::uint64_t regionOffset) const {
+        return std::string(at<char>(regionOffset + ref.offset, ref.size), ref.size);
+    }
+
+private:
+    const char* base = nullptr;
+    std::size_t length = 0;
+    std::string owned;  // Backs base instead of a mapping once adopted
+
+    void unmap() {
+        if (base && owned.empty()) {
+            ::munmap(const_cast<char*>(base), length);
+        }
+        owned.clear();
+        base = nullptr;
+        length = 0;
+    }
+};
+
+} // namespace image
@@ -0,0 +1,493 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+
+// How hard a commit pushes journal records towards stable storage.
+enum class FsyncPolicy {
+    Always,   // fsync after every commit
+    Interval, // fsync at most once per fsyncInterval
+    Never     // leave write-back to the OS
+};
+
+struct JournalOptions {
+    std::size_t groupCommitRecords = 16;                   // Records buffered before they are written out together
+    std::chrono::milliseconds groupCommitWindow{10};       // A background flush writes a pending group once its oldest record is this old
+    FsyncPolicy fsyncPolicy = FsyncPolicy::Interval;
+    std::chrono::milliseconds fsyncInterval{50};           // Written records are synced at most this long after they reach the file
+    std::size_t checkpointBytes = 4 * 1024 * 1024;         // Journal size that triggers compaction into the image
+};
+
+enum class JournalOp : std::uint8_t {
+    CreateFile = 1,
+    WriteFile,
+    DeleteFile,
+    CreateDirectory,
+    MoveDirectory,
+    RenameEntry,
+    AppendFile,
+    RemapBlocks,
+    CreateSnapshot,
+    DeleteSnapshot,
+    RestoreSnapshot
+};
+
+struct JournalRecord {
+    std::uint64_t lsn = 0;
+    JournalOp op = JournalOp::CreateFile;
+    std::int64_t value = 0;
+    std::vector<std::string> fields;
+};
+
+// Append-only log of mutations kept next to the image. Each mutation adds one
+// small record; records are written in groups and compacted away by a checkpoint.
+// Appends may come from several threads: whichever thread commits writes out
+// every record pending at that moment, so concurrent writers share one write()
+// and one fsync. A background thread commits a group that stops growing once
+// its window has passed, and runs the fsync an Interval policy owes, so an
+// idle journal never keeps acknowledged records only in memory.
+//
+// On-disk record layout:
+//   u32 payload size | u32 checksum | payload
+// The checksum is the CRC32C of the payload.
+//   payload = u64 lsn | u8 op | i64 value | u8 field count | (u32 size, bytes)*
+class Journal {
+public:
+    Journal(const std::string& path, const JournalOptions& options)
+        : path(path), options(options) {}
+
+    ~Journal() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        try {
+            commit();
+        } catch (...) {
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Replays every intact record newer than checkpointLsn, then opens the
+    // journal for appending. A torn tail from a crash is cut off.
+    template <typename Apply>
+    void recover(std::uint64_t checkpointLsn, Apply apply) {
+        std::vector<char> data = readAll();
+        std::size_t offset = 0;
+        nextLsn = checkpointLsn + 1;
+
+        JournalRecord record;
+        while (decode(data, offset, record)) {
+            if (record.lsn > checkpointLsn) {
+                apply(record);
+                nextLsn = record.lsn + 1;
+            }
+        }
+
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open the journal!");
+        }
+        if (::ftruncate(fd, static_cast<off_t>(offset)) != 0 || ::lseek(fd, 0, SEEK_END) < 0) {
+            throw std::runtime_error("Failed to recover the journal!");
+        }
+        onDiskBytes = offset;
+        lastFsync = std::chrono::steady_clock::now();
+        if (!flusher.joinable()) {
+            flusher = std::thread([this]() { flushLoop(); });
+        }
+    }
+
+    // Position in the pending records that a later rollback() can return to.
+    struct Mark {
+        std::size_t bytes;
+        std::size_t records;
+        std::uint64_t nextLsn;
+    };
+
+    std::uint64_t append(JournalOp op, std::initializer_list<std::string> fields, std::int64_t value = 0) {
+        std::uint64_t lsn;
+        bool due;
+        bool started = false;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            rethrowFlushError();
+            lsn = nextLsn++;
+            encode(lsn, op, fields, value);
+            if (pendingRecords++ == 0) {
+                oldestPending = std::chrono::steady_clock::now();
+                started = !deferred;
+            }
+            due = !deferred && (pendingRecords >= options.groupCommitRecords ||
+                                std::chrono::steady_clock::now() - oldestPending >= options.groupCommitWindow);
+        }
+
+        if (due) {
+            commit();
+        } else if (started) {
+            wake.notify_one();  // The flusher sleeps until a group starts
+        }
+        return lsn;
+    }
+
+    // Writes all pending records with a single write() and applies the fsync policy.
+    void commit() {
+        // Records are taken while holding writeMutex, so groups reach the file in LSN order
+        std::lock_guard<std::mutex> writeGuard(writeMutex);
+        std::string group;
+        std::size_t groupRecords;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (pending.empty() || fd < 0) {
+                return;
+            }
+            if (torn) {
+                torn = !cutTornTail();
+                if (torn) {
+                    throw std::runtime_error("Failed to cut a torn group off the journal!");
+                }
+            }
+            group.swap(pending);
+            groupRecords = pendingRecords;
+            pendingRecords = 0;
+        }
+        try {
+            if (writeBarrier) {
+                writeBarrier();
+            }
+            writeGroup(group);
+        } catch (...) {
+            restoreGroup(group, groupRecords);
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            onDiskBytes += group.size();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (options.fsyncPolicy == FsyncPolicy::Always ||
+            (options.fsyncPolicy == FsyncPolicy::Interval && now - lastFsync >= options.fsyncInterval)) {
+            syncLocked();
+        } else if (options.fsyncPolicy == FsyncPolicy::Interval) {
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                unsynced = true;
+            }
+            wake.notify_one();
+        }
+    }
+
+    // While deferred, records only accumulate until the caller commits them,
+    // e.g. once per batch of commands.
+    void setDeferred(bool defer) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            deferred = defer;
+        }
+        wake.notify_one();
+    }
+
+    Mark mark() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return {pending.size(), pendingRecords, nextLsn};
+    }
+
+    // Drops records appended after mark; they must not have been committed yet.
+    void rollback(const Mark& position) {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (position.bytes > pending.size()) {
+            throw std::logic_error("Journal records were committed after the rollback mark!");
+        }
+        pending.resize(position.bytes);
+        pendingRecords = position.records;
+        nextLsn = position.nextLsn;
+    }
+
+    // Runs before a group of records is written, so data the records refer
+    // to has left any cache of the caller by the time they are on file.
+    void setWriteBarrier(std::function<void()> barrier) {
+        writeBarrier = std::move(barrier);
+    }
+
+    // Runs before every journal fsync, so data the records refer to reaches
+    // stable storage ahead of the records themselves.
+    void setSyncBarrier(std::function<void()> barrier) {
+        syncBarrier = std::move(barrier);
+    }
+
+    void sync() {
+        std::lock_guard<std::mutex> writeGuard(writeMutex);
+        syncLocked();
+    }
+
+    // Drops all records once the image holds everything up to lastLsn().
+    void reset() {
+        std::lock_guard<std::mutex> writeGuard(writeMutex);
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            pending.clear();
+            pendingRecords = 0;
+            onDiskBytes = 0;
+            torn = false;
+        }
+        if (fd >= 0) {
+            if (::ftruncate(fd, 0) != 0 || ::lseek(fd, 0, SEEK_SET) < 0) {
+                throw std::runtime_error("Failed to truncate the journal!");
+            }
+            syncLocked();
+        }
+    }
+
+    bool needsCheckpoint() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return onDiskBytes + pending.size() >= options.checkpointBytes;
+    }
+
+    std::uint64_t lastLsn() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return nextLsn - 1;
+    }
+
+private:
+    std::string path;
+    JournalOptions options;
+    int fd = -1;
+    std::uint64_t nextLsn = 1;
+    std::size_t onDiskBytes = 0;
+
+    mutable std::mutex mutex;  // Guards the pending records and the counters
+    std::mutex writeMutex;     // Serializes writes and fsyncs of the journal file
+    std::string pending;
+    std::size_t pendingRecords = 0;
+    std::chrono::steady_clock::time_point oldestPending;
+    std::chrono::steady_clock::time_point lastFsync;
+    std::function<void()> writeBarrier;
+    std::function<void()> syncBarrier;
+    bool deferred = false;
+
+    std::condition_variable wake;  // Tells the flusher that a group started, the mode changed or it has to stop
+    std::thread flusher;
+    bool stopping = false;
+    bool unsynced = false;          // Records were written since the last fsync
+    bool torn = false;              // Part of a failed group is still on file past onDiskBytes
+    std::exception_ptr flushError;  // Failure of a background commit, reported by the next append
+
+    // Caller holds writeMutex.
+    void writeGroup(const std::string& group) {
+        const char* data = group.data();
+        std::size_t remaining = group.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Failed to write the journal!");
+            }
+            data += written;
+            remaining -= static_cast<std::size_t>(written);
+        }
+    }
+
+    // Puts a group that failed to reach the file back ahead of the records
+    // appended meanwhile, so a later commit writes it again, and cuts what
+    // part of it was written off the file, since a torn record would hide
+    // every later group from recovery. Caller holds writeMutex.
+    void restoreGroup(std::string& group, std::size_t groupRecords) {
+        std::lock_guard<std::mutex> guard(mutex);
+        group.append(pending);
+        pending.swap(group);
+        pendingRecords += groupRecords;
+        oldestPending = std::chrono::steady_clock::now();  // The flusher retries once the window passes again
+        torn = !cutTornTail();
+    }
+
+    // Caller holds writeMutex and mutex.
+    bool cutTornTail() {
+        return ::ftruncate(fd, static_cast<off_t>(onDiskBytes)) == 0 &&
+               ::lseek(fd, static_cast<off_t>(onDiskBytes), SEEK_SET) >= 0;
+    }
+
+    // Caller holds writeMutex.
+    void syncLocked() {
+        if (syncBarrier) {
+            syncBarrier();
+        }
+        if (fd >= 0 && ::fdatasync(fd) != 0) {
+            throw std::runtime_error("Failed to sync the journal!");
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        lastFsync = std::chrono::steady_clock::now();
+        unsynced = false;
+    }
+
+    // Caller holds mutex.
+    void rethrowFlushError() {
+        if (flushError) {
+            std::exception_ptr error = flushError;
+            flushError = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Sleeps until the oldest pending record has waited its window, or an
+    // Interval fsync comes due, and does that work. Deferred records wait
+    // for their batch to commit them.
+    void flushLoop() {
+        std::unique_lock<std::mutex> guard(mutex);
+        while (!stopping) {
+            bool grouping = pendingRecords > 0 && !deferred;
+            auto commitAt = oldestPending + options.groupCommitWindow;
+            auto syncAt = lastFsync + options.fsyncInterval;
+            auto now = std::chrono::steady_clock::now();
+            bool commitDue = grouping && now >= commitAt;
+            bool syncDue = unsynced && now >= syncAt;
+            if (!commitDue && !syncDue) {
+                if (grouping && unsynced) {
+                    wake.wait_until(guard, std::min(commitAt, syncAt));
+                } else if (grouping) {
+                    wake.wait_until(guard, commitAt);
+                } else if (unsynced) {
+                    wake.wait_until(guard, syncAt);
+                } else {
+                    wake.wait(guard);
+                }
+                continue;
+            }
+
+            guard.unlock();
+            try {
+                if (commitDue) {
+                    commit();
+                }
+                if (syncDue) {
+                    sync();
+                }
+            } catch (...) {
+                guard.lock();
+                flushError = std::current_exception();
+                unsynced = false;  // Retrying a failed fsync at once would only fail again
+                continue;
+            }
+            guard.lock();
+        }
+    }
+
+    static std::uint32_t checksum(const char* data, std::size_t size) {
+        return crc32c::compute(data, size);
+    }
+
+    template <typename T>
+    void put(const T& value) {
+        pending.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void encode(std::uint64_t lsn, JournalOp op, std::initializer_list<std::string> fields, std::int64_t value) {
+        std::size_t start = pending.size();
+        put(std::uint32_t(0));
+        put(std::uint32_t(0));
+
+        put(lsn);
+        put(static_cast<std::uint8_t>(op));
+        put(value);
+        put(static_cast<std::uint8_t>(fields.size()));
+        for (const std::string& field : fields) {
+            put(static_cast<std::uint32_t>(field.size()));
+            pending.append(field);
+        }
+
+        std::uint32_t payloadSize = static_cast<std::uint32_t>(pending.size() - start - 8);
+        std::uint32_t sum = checksum(pending.data() + start + 8, payloadSize);
+        std::memcpy(&pending[start], &payloadSize, sizeof(payloadSize));
+        std::memcpy(&pending[start + 4], &sum, sizeof(sum));
+    }
+
+    static bool decode(const std::vector<char>& data, std::size_t& offset, JournalRecord& record) {
+        std::uint32_t payloadSize, sum;
+        if (data.size() - offset < 8) {
+            return false;
+        }
+        std::memcpy(&payloadSize, &data[offset], sizeof(payloadSize));
+        std::memcpy(&sum, &data[offset + 4], sizeof(sum));
+        if (data.size() - offset - 8 < payloadSize || checksum(&data[offset + 8], payloadSize) != sum) {
+            return false;
+        }
+
+        const char* cursor = &data[offset + 8];
+        const char* end = cursor + payloadSize;
+        auto get = [&](void* out, std::size_t size) {
+            if (static_cast<std::size_t>(end - cursor) < size) {
+                return false;
+            }
+            std::memcpy(out, cursor, size);
+            cursor += size;
+            return true;
+        };
+
+        std::uint8_t op, fieldCount;
+        if (!get(&record.lsn, sizeof(record.lsn)) || !get(&op, sizeof(op)) ||
+            !get(&record.value, sizeof(record.value)) || !get(&fieldCount, sizeof(fieldCount))) {
+            return false;
+        }
+        record.op = static_cast<JournalOp>(op);
+        record.fields.resize(fieldCount);
+        for (std::string& field : record.fields) {
+            std::uint32_t size;
+            if (!get(&size, sizeof(size)) || static_cast<std::size_t>(end - cursor) < size) {
+                return false;
+            }
+            field.assign(cursor, size);
+            cursor += size;
+        }
+
+        offset += 8 + payloadSize;
+        return true;
+    }
+
+    std::vector<char> readAll() const {
+        std::vector<char> data;
+        int in = ::open(path.c_str(), O_RDONLY);
+        if (in < 0) {
+            return data;
+        }
+        struct stat st;
+        if (::fstat(in, &st) == 0 && st.st_size > 0) {
+            data.resize(static_cast<std::size_t>(st.st_size));
+            std::size_t done = 0;
+            while (done < data.size()) {
+                ssize_t n = ::read(in, data.data() + done, data.size() - done);
+                if (n <= 0) {
+                    break;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            data.resize(done);
+        }
+        ::close(in);
+        return data;
+    }
+};
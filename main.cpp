@@ -1,6 +1,115 @@
 #include "fms.h"
-int main() {
-    FileSystem fileSystem;
-    fileSystem.runCLI();
-    return 0;
+#include "server.h"
+#include <cstring>
+#include <thread>
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--batch <script|->] [--sync-every <n>] [--transactional] [--quiet]\n"
+              << "       " << program << " --serve <socket> [--threads <n>]\n"
+              << "       " << program << " --scrub\n"
+              << "Any mode also takes [--stats-file <path>] [--stats-interval <seconds>] [--cache-mb <n>] [--read-ahead <blocks>] [--compress-image] [--dedup-writes]\n"
+              << "                    [--record <trace>] [--watch-to <file|socket>]\n";
+}
+
+// Loads the file system and runs the chosen mode. Returns the exit status.
+static int run(const FileSystemOptions& options, const BatchOptions& batchOptions, const char* script, const char* socketPath,
+               std::size_t threads) {
+    if (socketPath) {
+        FileSystem fileSystem(options);
+        FileSystemServer server(fileSystem, socketPath, threads);
+        std::cout << "Serving on " << socketPath << "\n";
+        server.run();
+        return 0;
+    }
+
+    if (!script) {
+        FileSystem fileSystem(options);
+        fileSystem.runCLI();
+        return 0;
+    }
+
+    // Let batch output accumulate in the stream buffer instead of going through stdio
+    std::ios::sync_with_stdio(false);
+    FileSystem fileSystem(options);
+    int failures;
+    if (std::strcmp(script, "-") == 0) {
+        failures = fileSystem.runBatch(std::cin, batchOptions);
+    } else {
+        std::ifstream input(script, std::ios::binary);
+        if (!input) {
+            std::cerr << "Error: Cannot open script " << script << "\n";
+            return 2;
+        }
+        failures = fileSystem.runBatch(input, batchOptions);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    FileSystemOptions options;
+    BatchOptions batchOptions;
+    const char* script = nullptr;
+    const char* socketPath = nullptr;
+    std::size_t threads = std::thread::hardware_concurrency();
+    bool scrubOnly = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (std::strcmp(argv[i], "--sync-every") == 0 && i + 1 < argc) {
+            batchOptions.syncEvery = std::stoul(argv[++i]);
+        } else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (std::strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            options.statsPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            options.statsInterval = std::chrono::seconds(std::stoul(argv[++i]));
+        } else if (std::strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            options.cache.capacityBytes = std::stoul(argv[++i]) * 1024 * 1024;
+        } else if (std::strcmp(argv[i], "--read-ahead") == 0 && i + 1 < argc) {
+            options.cache.readAheadBlocks = std::stoul(argv[++i]);
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            options.tracePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--watch-to") == 0 && i + 1 < argc) {
+            options.watchPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--compress-image") == 0) {
+            options.compressImage = true;
+        } else if (std::strcmp(argv[i], "--dedup-writes") == 0) {
+            options.dedupWrites = true;
+        } else if (std::strcmp(argv[i], "--scrub") == 0) {
+            scrubOnly = true;
+        } else if (std::strcmp(argv[i], "--transactional") == 0) {
+            batchOptions.transactional = true;
+        } else if (std::strcmp(argv[i], "--quiet") == 0) {
+            batchOptions.quiet = true;
+        } else {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Works without loading the image, so it also reports on one that fails to load
+    if (scrubOnly) {
+        try {
+            return FileSystem::scrubStorage(options, std::cout) ? 0 : 1;
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+            return 1;
+        }
+    }
+
+    try {
+        return run(options, batchOptions, script, socketPath, threads);
+    } catch (const FileSystemError& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        if (ex.status() == Status::Corrupted) {
+            std::cerr << "Run " << argv[0] << " --scrub to list the corrupt data.\n";
+        }
+        return 1;
+    } catch (const std::exception& ex) {
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
 }
\ No newline at end of file
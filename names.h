@@ -0,0 +1,134 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstddef>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstring>
+
+// Interned entry name. Equal names share one immutable, reference-counted
+// copy of their text, so a name costs a pointer wherever it is stored and the
+// directory maps and indexes can key on views of it: a view stays valid while
+// any Name refers to the text. Common names like "index.html" or "README"
+// are stored once however many directories hold them.
+class Name {
+public:
+    Name() = default;
+
+    explicit Name(std::string_view text) : entry(text.empty() ? nullptr : table().intern(text)) {}
+
+    Name(const Name& other) : entry(other.entry) {
+        if (entry) {
+            entry->refs.fetch_add(1, std::memory_order_relaxed);  // The other Name keeps it alive meanwhile
+        }
+    }
+
+    Name(Name&& other) noexcept : entry(other.entry) {
+        other.entry = nullptr;
+    }
+
+    Name& operator=(const Name& other) {
+        Name copy(other);
+        std::swap(entry, copy.entry);
+        return *this;
+    }
+
+    Name& operator=(Name&& other) noexcept {
+        std::swap(entry, other.entry);
+        return *this;
+    }
+
+    ~Name() {
+        if (entry) {
+            table().release(entry);
+        }
+    }
+
+    std::string_view view() const {
+        return entry ? std::string_view(entry->text, entry->size) : std::string_view();
+    }
+
+    operator std::string_view() const { return view(); }
+    std::string str() const { return std::string(view()); }
+
+    bool operator==(std::string_view other) const { return view() == other; }
+    bool operator!=(std::string_view other) const { return view() != other; }
+
+    // Distinct names currently interned and the bytes they take.
+    static std::size_t internedCount() { return table().count(); }
+    static std::size_t internedBytes() { return table().bytes(); }
+
+private:
+    struct Entry {
+        std::atomic<std::uint32_t> refs;
+        std::uint32_t size;
+        char text[1];  // size bytes follow the header
+
+        std::string_view view() const { return std::string_view(text, size); }
+    };
+
+    // Entries are created and freed under the mutex. Copies of a Name only
+    // add a reference, which is safe without it because the copied Name
+    // holds one too; dropping the last reference takes the mutex so intern
+    // cannot revive an entry that is being freed.
+    class Table {
+    public:
+        Entry* intern(std::string_view text) {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto found = entries.find(text);
+            if (found != entries.end()) {
+                found->second->refs.fetch_add(1, std::memory_order_relaxed);
+                return found->second;
+            }
+            void* memory = ::operator new(offsetof(Entry, text) + text.size());
+            Entry* entry = static_cast<Entry*>(memory);
+            new (&entry->refs) std::atomic<std::uint32_t>(1);
+            entry->size = static_cast<std::uint32_t>(text.size());
+            std::memcpy(entry->text, text.data(), text.size());
+            entries.emplace(entry->view(), entry);
+            textBytes += text.size();
+            return entry;
+        }
+
+        void release(Entry* entry) {
+            std::uint32_t refs = entry->refs.load(std::memory_order_relaxed);
+            while (refs > 1) {
+                if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+            std::lock_guard<std::mutex> guard(mutex);
+            if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                entries.erase(entry->view());
+                textBytes -= entry->size;
+                ::operator delete(entry);
+            }
+        }
+
+        std::size_t count() {
+            std::lock_guard<std::mutex> guard(mutex);
+            return entries.size();
+        }
+
+        std::size_t bytes() {
+            std::lock_guard<std::mutex> guard(mutex);
+            return entries.size() * offsetof(Entry, text) + textBytes;
+        }
+
+    private:
+        std::mutex mutex;
+        std::unordered_map<std::string_view, Entry*> entries;  // Keys view the text of their entry
+        std::size_t textBytes = 0;
+    };
+
+    // Never destroyed, so Names in static objects can outlive every other static.
+    static Table& table() {
+        static Table* instance = new Table;
+        return *instance;
+    }
+
+    Entry* entry = nullptr;
+};
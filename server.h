@@ -0,0 +1,358 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "fms.h"
+#include "threadpool.h"
+
+// Serves a file system to local clients over a Unix domain socket.
+//
+// Clients send one command per line, in the same syntax as the CLI. Each
+// command is answered with its output followed by a status line: "OK", or
+// "ERROR: <message>". Every connection is a session with its own working
+// directory.
+//
+// One thread waits for socket events with epoll and hands readable
+// connections to the thread pool. Connections are armed one-shot, so the
+// commands of one client run in order on one worker at a time, while
+// different clients run in parallel.
+//
+// A watch command does not hold a worker while it waits. The worker hands
+// the connection to the event loop, which sends it the changes every tick
+// without blocking, and gives it back to a worker once the watch is over to
+// run the commands that arrived meanwhile.
+class FileSystemServer {
+public:
+    static const std::size_t MAX_LINE_SIZE = 1024 * 1024;  // Longer commands close the connection
+    static const int SEND_TIMEOUT_MS = 5000;                // A client that takes no output for this long is dropped
+    static const int WATCH_TICK_MS = 10;                    // How often the event loop sends changes to watching clients
+    static const std::size_t WATCH_BACKLOG = 1024 * 1024;   // Unsent watch output past which changes are left in the ring
+
+    FileSystemServer(FileSystem& fileSystem, const std::string& socketPath, std::size_t threads)
+        : fileSystem(fileSystem), socketPath(socketPath), threads(threads) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::invalid_argument("Socket path is too long!");
+        }
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            throw std::runtime_error("Failed to create the server socket!");
+        }
+        ::unlink(socketPath.c_str());  // Left behind by a server that did not shut down cleanly
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+            ::close(listenFd);
+            throw std::runtime_error("Failed to listen on " + socketPath + "!");
+        }
+
+        epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            ::close(epollFd);
+            ::close(listenFd);
+            ::unlink(socketPath.c_str());
+            throw std::runtime_error("Failed to create the server event loop!");
+        }
+    }
+
+    ~FileSystemServer() {
+        for (auto& entry : connections) {
+            ::close(entry.first);
+        }
+        ::close(wakeFd);
+        ::close(epollFd);
+        ::close(listenFd);
+        ::unlink(socketPath.c_str());
+    }
+
+    FileSystemServer(const FileSystemServer&) = delete;
+    FileSystemServer& operator=(const FileSystemServer&) = delete;
+
+    // Serves clients until SIGINT or SIGTERM arrives. Commands that are
+    // already running finish before it returns.
+    void run() {
+        // Block the stop signals before the workers start, so only the signalfd sees them
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        int signalFd = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signalFd < 0) {
+            throw std::runtime_error("Failed to watch for stop signals!");
+        }
+
+        watch(listenFd, &listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(signalFd, &signalFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd, &wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+
+        {
+            ThreadPool pool(threads);
+            epoll_event events[64];
+            std::vector<Connection*> watching;  // Only the event loop touches these connections
+            bool stopping = false;
+            while (!stopping) {
+                int count = ::epoll_wait(epollFd, events, 64, watching.empty() ? -1 : WATCH_TICK_MS);
+                if (count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Failed to wait for clients!");
+                }
+
+                for (int i = 0; i < count; ++i) {
+                    void* source = events[i].data.ptr;
+                    if (source == &signalFd) {
+                        stopping = true;
+                    } else if (source == &listenFd) {
+                        acceptClients();
+                    } else if (source == &wakeFd) {
+                        std::uint64_t ignored;
+                        while (::read(wakeFd, &ignored, sizeof(ignored)) > 0) {
+                        }
+                        std::lock_guard<std::mutex> guard(watchLock);
+                        watching.insert(watching.end(), startedWatches.begin(), startedWatches.end());
+                        startedWatches.clear();
+                    } else {
+                        Connection* connection = static_cast<Connection*>(source);
+                        pool.submit([this, connection]() { serve(*connection); });
+                    }
+                }
+                sendWatches(pool, watching);
+            }
+        }
+        ::close(signalFd);
+    }
+
+private:
+    struct Connection {
+        int fd;
+        Session session;
+        std::string input;   // Received bytes not yet forming a complete line
+        std::string output;  // Replies waiting to be sent
+        std::mutex busy;     // Held by the worker serving it; orders the hand-off between workers
+    };
+
+    FileSystem& fileSystem;
+    std::string socketPath;
+    std::size_t threads;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;                         // Tells the event loop that startedWatches has entries
+    std::vector<Connection*> startedWatches;
+    std::mutex watchLock;                    // Guards startedWatches
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::mutex connectionsLock;
+    std::uint32_t nextSessionId = 1;  // Only the event loop thread accepts clients
+
+    void watch(int fd, void* source, std::uint32_t events, int operation) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.ptr = source;
+        if (::epoll_ctl(epollFd, operation, fd, &event) != 0) {
+            throw std::runtime_error("Failed to watch a socket!");
+        }
+    }
+
+    void acceptClients() {
+        while (true) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;  // No more pending clients, or a client that already went away
+            }
+
+            std::unique_ptr<Connection> connection(new Connection());
+            connection->fd = fd;
+            connection->session.id = nextSessionId++;
+            Connection* client = connection.get();
+            {
+                std::lock_guard<std::mutex> guard(connectionsLock);
+                connections[fd] = std::move(connection);
+            }
+            client->session.detachWatch = true;
+            watch(fd, client, EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, EPOLL_CTL_ADD);
+        }
+    }
+
+    // Runs on a worker: executes every complete line received so far, sends
+    // the replies and re-arms the connection, or closes it.
+    void serve(Connection& connection) {
+        std::unique_lock<std::mutex> busyGuard(connection.busy);
+        bool open = receive(connection);
+
+        std::size_t start = 0;
+        bool watching = false;
+        while (true) {
+            std::size_t newline = connection.input.find('\n', start);
+            if (newline == std::string::npos) {
+                break;
+            }
+            std::size_t end = newline > start && connection.input[newline - 1] == '\r' ? newline - 1 : newline;
+            bool keepRunning = execute(connection, connection.input.substr(start, end - start));
+            start = newline + 1;
+            if (!keepRunning) {
+                open = false;
+                break;
+            }
+            if (connection.session.watchRequest) {
+                watching = true;  // Later commands wait until the watch is over
+                break;
+            }
+        }
+        connection.input.erase(0, start);
+        if (connection.input.size() > MAX_LINE_SIZE) {
+            open = false;
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = &connection;
+        bool keep = send(connection) && open;
+        busyGuard.unlock();
+        if (keep && watching) {
+            startWatch(connection);
+        } else if (!keep || ::epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event) != 0) {
+            disconnect(connection);
+        }
+    }
+
+    // Hands a connection whose watch just started to the event loop. It is
+    // not armed for input until the watch is over.
+    void startWatch(Connection& connection) {
+        {
+            std::lock_guard<std::mutex> guard(watchLock);
+            startedWatches.push_back(&connection);
+        }
+        std::uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            throw std::runtime_error("Failed to wake the server event loop!");
+        }
+    }
+
+    // Runs on the event loop: sends every watching client the changes
+    // published since the last tick, as far as its socket takes them without
+    // blocking. While a client leaves too much unsent, its changes stay in
+    // the ring, and it is told how many it lost once it catches up. A
+    // finished watch goes back to a worker with its status line.
+    void sendWatches(ThreadPool& pool, std::vector<Connection*>& watching) {
+        for (std::size_t i = 0; i < watching.size();) {
+            Connection& connection = *watching[i];
+            WatchRequest& request = *connection.session.watchRequest;
+            bool running = connection.output.size() < WATCH_BACKLOG ? fileSystem.continueWatch(request, connection.output)
+                                                                   : std::chrono::steady_clock::now() < request.deadline;
+            bool alive = sendAvailable(connection);
+            if (alive && running) {
+                ++i;
+                continue;
+            }
+
+            watching[i] = watching.back();
+            watching.pop_back();
+            if (!alive) {
+                disconnect(connection);
+                continue;
+            }
+            connection.session.watchRequest.reset();
+            connection.output += "OK\n";
+            pool.submit([this, &connection]() { serve(connection); });
+        }
+    }
+
+    bool execute(Connection& connection, const std::string& command) {
+        std::ostringstream out;
+        connection.session.out = &out;
+        bool keepRunning = true;
+        try {
+            keepRunning = fileSystem.executeCommand(connection.session, command);
+            if (!connection.session.watchRequest) {
+                out << "OK\n";  // A watch reports its status once it is over
+            }
+        } catch (const std::exception& ex) {
+            out << "ERROR: " << ex.what() << '\n';
+        }
+        connection.output += out.str();
+        return keepRunning;
+    }
+
+    // Reads everything available. Returns false once the client hung up.
+    bool receive(Connection& connection) {
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t n = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection.input.append(buffer, static_cast<std::size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    // Sends all replies, waiting for the client to read them. Returns false
+    // once the client is gone or has not read anything for SEND_TIMEOUT_MS,
+    // so a client that stops reading cannot hold a worker forever.
+    bool send(Connection& connection) {
+        std::size_t done = 0;
+        while (done < connection.output.size()) {
+            ssize_t n = ::send(connection.fd, connection.output.data() + done, connection.output.size() - done, MSG_NOSIGNAL);
+            if (n > 0) {
+                done += static_cast<std::size_t>(n);
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                pollfd writable = {connection.fd, POLLOUT, 0};
+                int ready = ::poll(&writable, 1, SEND_TIMEOUT_MS);
+                if (ready == 0 || (ready < 0 && errno != EINTR)) {
+                    return false;
+                }
+            } else if (!(n < 0 && errno == EINTR)) {
+                return false;
+            }
+        }
+        connection.output.clear();
+        return true;
+    }
+
+    // Sends what the socket takes without blocking. Returns false once the
+    // client is gone.
+    bool sendAvailable(Connection& connection) {
+        std::size_t done = 0;
+        while (done < connection.output.size()) {
+            ssize_t n = ::send(connection.fd, connection.output.data() + done, connection.output.size() - done, MSG_NOSIGNAL);
+            if (n > 0) {
+                done += static_cast<std::size_t>(n);
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (!(n < 0 && errno == EINTR)) {
+                return false;
+            }
+        }
+        connection.output.erase(0, done);
+        return true;
+    }
+
+    void disconnect(Connection& connection) {
+        int fd = connection.fd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        std::lock_guard<std::mutex> guard(connectionsLock);
+        connections.erase(fd);
+        ::close(fd);
+    }
+};
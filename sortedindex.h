@@ -0,0 +1,142 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+
+// Sorted set of keys kept in leaves of at most MAX_LEAF sorted keys, with the
+// first key of every leaf in a separate array: a one-level B+-tree. A lookup
+// binary searches the first keys and then one leaf, an insert or erase shifts
+// at most one leaf, and a scan walks contiguous keys. Full leaves split in
+// half; empty leaves are dropped.
+template <typename Key, typename Less = std::less<Key>>
+class SortedIndex {
+public:
+    static const std::size_t MAX_LEAF = 256;
+
+    class Iterator {
+    public:
+        const Key& operator*() const { return (*leaves)[leaf][slot]; }
+        const Key* operator->() const { return &**this; }
+
+        Iterator& operator++() {
+            if (++slot == (*leaves)[leaf].size()) {
+                ++leaf;
+                slot = 0;
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return leaf == other.leaf && slot == other.slot; }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class SortedIndex;
+        const std::vector<std::vector<Key>>* leaves;
+        std::size_t leaf;
+        std::size_t slot;
+
+        Iterator(const std::vector<std::vector<Key>>* leaves, std::size_t leaf, std::size_t slot)
+            : leaves(leaves), leaf(leaf), slot(slot) {}
+    };
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    Iterator begin() const { return Iterator(&leaves, 0, 0); }
+    Iterator end() const { return Iterator(&leaves, leaves.size(), 0); }
+
+    // First key not less than key.
+    Iterator lowerBound(const Key& key) const {
+        return bound(key, [this](const std::vector<Key>& keys, const Key& k) {
+            return std::lower_bound(keys.begin(), keys.end(), k, less);
+        });
+    }
+
+    // First key greater than key.
+    Iterator upperBound(const Key& key) const {
+        return bound(key, [this](const std::vector<Key>& keys, const Key& k) {
+            return std::upper_bound(keys.begin(), keys.end(), k, less);
+        });
+    }
+
+    // Returns false if the key was already present.
+    bool insert(Key key) {
+        if (leaves.empty()) {
+            leaves.emplace_back();
+            firsts.emplace_back();
+        }
+        std::size_t leaf = leafFor(key);
+        std::vector<Key>& keys = leaves[leaf];
+        auto slot = std::lower_bound(keys.begin(), keys.end(), key, less);
+        if (slot != keys.end() && !less(key, *slot)) {
+            return false;
+        }
+        keys.insert(slot, std::move(key));
+        firsts[leaf] = keys.front();
+        ++count;
+
+        if (keys.size() > MAX_LEAF) {
+            std::vector<Key> upper(std::make_move_iterator(keys.begin() + keys.size() / 2), std::make_move_iterator(keys.end()));
+            keys.resize(keys.size() / 2);
+            firsts.insert(firsts.begin() + leaf + 1, upper.front());
+            leaves.insert(leaves.begin() + leaf + 1, std::move(upper));
+        }
+        return true;
+    }
+
+    // Returns false if the key was not present.
+    bool erase(const Key& key) {
+        if (leaves.empty()) {
+            return false;
+        }
+        std::size_t leaf = leafFor(key);
+        std::vector<Key>& keys = leaves[leaf];
+        auto slot = std::lower_bound(keys.begin(), keys.end(), key, less);
+        if (slot == keys.end() || less(key, *slot)) {
+            return false;
+        }
+        keys.erase(slot);
+        --count;
+
+        if (keys.empty()) {
+            leaves.erase(leaves.begin() + leaf);
+            firsts.erase(firsts.begin() + leaf);
+        } else {
+            firsts[leaf] = keys.front();
+        }
+        return true;
+    }
+
+    void clear() {
+        leaves.clear();
+        firsts.clear();
+        count = 0;
+    }
+
+private:
+    std::vector<std::vector<Key>> leaves;
+    std::vector<Key> firsts;  // First key of each leaf
+    std::size_t count = 0;
+    Less less;
+
+    // Leaf whose range holds key: the last one starting at or before it.
+    std::size_t leafFor(const Key& key) const {
+        auto next = std::upper_bound(firsts.begin(), firsts.end(), key, less);
+        return next == firsts.begin() ? 0 : static_cast<std::size_t>(next - firsts.begin()) - 1;
+    }
+
+    template <typename Search>
+    Iterator bound(const Key& key, Search search) const {
+        if (leaves.empty()) {
+            return end();
+        }
+        std::size_t leaf = leafFor(key);
+        const std::vector<Key>& keys = leaves[leaf];
+        std::size_t slot = static_cast<std::size_t>(search(keys, key) - keys.begin());
+        if (slot == keys.size()) {
+            return Iterator(&leaves, leaf + 1, 0);
+        }
+        return Iterator(&leaves, leaf, slot);
+    }
+};
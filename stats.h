@@ -0,0 +1,362 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include "commands.h"
+
+// Set FMS_STATS to 0 to compile the instrumentation out entirely.
+#ifndef FMS_STATS
+#define FMS_STATS 1
+#endif
+
+// Latency histogram with power-of-two buckets: bucket b counts samples in
+// [2^(b-1), 2^b) nanoseconds. Recording is three relaxed atomic adds.
+class LatencyHistogram {
+public:
+    static const int BUCKETS = 40;  // The last bucket also holds everything above 2^39 ns
+
+    void record(std::uint64_t nanoseconds) {
+        int bucket = nanoseconds == 0 ? 0 : 64 - __builtin_clzll(nanoseconds);
+        buckets[bucket < BUCKETS ? bucket : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+        samples.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    std::uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+    std::uint64_t sumNanoseconds() const { return sum.load(std::memory_order_relaxed); }
+    std::uint64_t bucket(int index) const { return buckets[index].load(std::memory_order_relaxed); }
+
+    static std::uint64_t upperBound(int index) { return 1ULL << index; }
+
+    // Estimates a percentile by interpolating inside the bucket that holds it.
+    double percentile(double fraction) const {
+        std::uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        double rank = fraction * total;
+        std::uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            std::uint64_t inBucket = bucket(i);
+            if (inBucket > 0 && seen + inBucket >= rank) {
+                double lower = i == 0 ? 0 : static_cast<double>(upperBound(i - 1));
+                return lower + (upperBound(i) - lower) * (rank - seen) / inBucket;
+            }
+            seen += inBucket;
+        }
+        return static_cast<double>(upperBound(BUCKETS - 1));
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKETS> buckets{};
+    std::atomic<std::uint64_t> samples{0};
+    std::atomic<std::uint64_t> sum{0};
+};
+
+// Values computed from the file system when a report is written rather than
+// tracked on every change.
+struct StatsGauges {
+    std::uint64_t capacityBlocks = 0;
+    std::uint64_t freeBlocks = 0;
+    std::uint64_t freeExtents = 0;        // Runs of free blocks
+    std::uint64_t largestFreeExtent = 0;  // Longest free run in blocks
+    std::uint64_t contentBytes = 0;       // File content stored in blocks
+    std::uint64_t files = 0;
+    std::uint64_t directories = 0;
+    std::uint64_t sharedBlocks = 0;       // Blocks with more than one owner
+    std::uint64_t dedupSavedBlocks = 0;   // Block references served by a shared block
+    std::uint64_t cacheCapacityBlocks = 0;
+    std::uint64_t cachedBlocks = 0;
+    std::uint64_t dirtyBlocks = 0;
+    std::uint64_t cacheHits = 0;
+    std::uint64_t cacheMisses = 0;
+    std::uint64_t cacheEvictions = 0;
+    std::uint64_t cacheWriteBacks = 0;
+    std::uint64_t readAheadBlocks = 0;
+
+    // Blocks the content would take without sharing, per block it takes.
+    double dedupRatio() const {
+        std::uint64_t used = capacityBlocks - freeBlocks;
+        return used == 0 ? 1.0 : static_cast<double>(used + dedupSavedBlocks) / used;
+    }
+
+    double cacheHitRatio() const {
+        std::uint64_t lookups = cacheHits + cacheMisses;
+        return lookups == 0 ? 0.0 : static_cast<double>(cacheHits) / lookups;
+    }
+
+    // Share of free space outside the longest free run: 0 when all free blocks are contiguous.
+    double fragmentation() const {
+        return freeBlocks == 0 ? 0.0 : 1.0 - static_cast<double>(largestFreeExtent) / freeBlocks;
+    }
+};
+
+// Counters and latency histograms for the hot paths. Every method is safe to
+// call from several threads, and all of them compile to nothing when
+// FMS_STATS is 0.
+class Stats {
+public:
+    static constexpr bool ENABLED = FMS_STATS != 0;
+
+    enum class Operation { Save, Load, Allocate, FindFreeBlocks, Count };
+    enum class Counter { SavedBytes, LastSaveBytes, LastSaveRawBytes, BlocksAllocated, BlocksFreed, DedupedBlocks, CopiedOnWriteBlocks, ScrubbedBlocks, CorruptBlocks, Count };
+
+    // Timestamp in nanoseconds for measuring a latency, or 0 when disabled.
+    static std::uint64_t now() {
+        if (!ENABLED) {
+            return 0;
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Unknown commands are counted together as "other".
+    void recordCommand(Command command, std::uint64_t start, bool failed) {
+        if (!ENABLED) {
+            return;
+        }
+        std::size_t index = static_cast<std::size_t>(command);
+        commands[index].latency.record(now() - start);
+        if (failed) {
+            commands[index].errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void recordOperation(Operation operation, std::uint64_t start) {
+        if (!ENABLED) {
+            return;
+        }
+        operations[static_cast<int>(operation)].record(now() - start);
+    }
+
+    void add(Counter counter, std::uint64_t value) {
+        if (!ENABLED) {
+            return;
+        }
+        counters[static_cast<int>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void set(Counter counter, std::uint64_t value) {
+        if (!ENABLED) {
+            return;
+        }
+        counters[static_cast<int>(counter)].store(value, std::memory_order_relaxed);
+    }
+
+    // Human-readable report for the stats command.
+    void writeText(std::ostream& out, const StatsGauges& gauges) const {
+        char line[160];
+        out << "Commands:\n";
+        forEachCommand([&](std::string_view name, const LatencyHistogram& latency, std::uint64_t errors) {
+            std::snprintf(line, sizeof(line), "  %-17.*s count %-10llu errors %-8llu p50 %10.2fus  p99 %10.2fus\n",
+                          static_cast<int>(name.size()), name.data(),
+                          static_cast<unsigned long long>(latency.count()), static_cast<unsigned long long>(errors),
+                          latency.percentile(0.50) / 1000, latency.percentile(0.99) / 1000);
+            out << line;
+        });
+        out << "Operations:\n";
+        forEachOperation([&](const char* name, const LatencyHistogram& latency) {
+            std::snprintf(line, sizeof(line), "  %-17s count %-10llu p50 %10.2fus  p99 %10.2fus\n", name,
+                          static_cast<unsigned long long>(latency.count()), latency.percentile(0.50) / 1000,
+                          latency.percentile(0.99) / 1000);
+            out << line;
+        });
+        out << "Saves: " << counter(Counter::LastSaveBytes) << " bytes last (" << counter(Counter::LastSaveRawBytes) << " uncompressed), "
+            << counter(Counter::SavedBytes) << " bytes total\n";
+        out << "Blocks: " << gauges.freeBlocks << " free of " << gauges.capacityBlocks << ", " << counter(Counter::BlocksAllocated)
+            << " allocated and " << counter(Counter::BlocksFreed) << " freed since start\n";
+        std::snprintf(line, sizeof(line), "Free space: %llu extents, largest %llu blocks, fragmentation %.1f%%\n",
+                      static_cast<unsigned long long>(gauges.freeExtents), static_cast<unsigned long long>(gauges.largestFreeExtent),
+                      gauges.fragmentation() * 100);
+        out << line;
+        out << "Content: " << gauges.contentBytes << " bytes in " << gauges.files << " files, " << gauges.directories << " directories\n";
+        std::snprintf(line, sizeof(line), "Dedup: %llu shared blocks stand in for %llu more, ratio %.2f, %llu deduplicated and %llu copied on write since start\n",
+                      static_cast<unsigned long long>(gauges.sharedBlocks), static_cast<unsigned long long>(gauges.dedupSavedBlocks),
+                      gauges.dedupRatio(), static_cast<unsigned long long>(counter(Counter::DedupedBlocks)),
+                      static_cast<unsigned long long>(counter(Counter::CopiedOnWriteBlocks)));
+        out << line;
+        out << "Scrub: " << counter(Counter::ScrubbedBlocks) << " blocks verified, " << counter(Counter::CorruptBlocks) << " corrupt since start\n";
+        std::snprintf(line, sizeof(line), "Cache: %llu of %llu blocks, %llu dirty, hit ratio %.1f%%\n",
+                      static_cast<unsigned long long>(gauges.cachedBlocks), static_cast<unsigned long long>(gauges.cacheCapacityBlocks),
+                      static_cast<unsigned long long>(gauges.dirtyBlocks), gauges.cacheHitRatio() * 100);
+        out << line;
+        out << "Cache traffic: " << gauges.cacheHits << " hits, " << gauges.cacheMisses << " misses, " << gauges.cacheEvictions
+            << " evictions, " << gauges.cacheWriteBacks << " write-backs, " << gauges.readAheadBlocks << " blocks read ahead\n";
+    }
+
+    void writeJson(std::ostream& out, const StatsGauges& gauges) const {
+        auto histogram = [&out](const LatencyHistogram& latency) {
+            out << "\"count\":" << latency.count() << ",\"sum_ns\":" << latency.sumNanoseconds() << ",\"p50_ns\":"
+                << static_cast<std::uint64_t>(latency.percentile(0.50)) << ",\"p99_ns\":" << static_cast<std::uint64_t>(latency.percentile(0.99));
+        };
+
+        out << "{\"commands\":{";
+        const char* separator = "";
+        forEachCommand([&](std::string_view name, const LatencyHistogram& latency, std::uint64_t errors) {
+            out << separator << '"' << name << "\":{";
+            histogram(latency);
+            out << ",\"errors\":" << errors << '}';
+            separator = ",";
+        });
+        out << "},\"operations\":{";
+        separator = "";
+        forEachOperation([&](const char* name, const LatencyHistogram& latency) {
+            out << separator << '"' << name << "\":{";
+            histogram(latency);
+            out << '}';
+            separator = ",";
+        });
+        out << "},\"counters\":{\"saved_bytes\":" << counter(Counter::SavedBytes) << ",\"last_save_bytes\":" << counter(Counter::LastSaveBytes)
+            << ",\"last_save_raw_bytes\":" << counter(Counter::LastSaveRawBytes) << ",\"blocks_allocated\":" << counter(Counter::BlocksAllocated)
+            << ",\"blocks_freed\":" << counter(Counter::BlocksFreed) << ",\"deduped_blocks\":" << counter(Counter::DedupedBlocks)
+            << ",\"copied_on_write_blocks\":" << counter(Counter::CopiedOnWriteBlocks) << ",\"scrubbed_blocks\":" << counter(Counter::ScrubbedBlocks)
+            << ",\"corrupt_blocks\":" << counter(Counter::CorruptBlocks)
+            << "},\"gauges\":{\"capacity_blocks\":" << gauges.capacityBlocks << ",\"free_blocks\":" << gauges.freeBlocks
+            << ",\"free_extents\":" << gauges.freeExtents << ",\"largest_free_extent\":" << gauges.largestFreeExtent
+            << ",\"fragmentation\":" << gauges.fragmentation() << ",\"content_bytes\":" << gauges.contentBytes << ",\"files\":" << gauges.files
+            << ",\"directories\":" << gauges.directories << ",\"shared_blocks\":" << gauges.sharedBlocks << ",\"dedup_saved_blocks\":"
+            << gauges.dedupSavedBlocks << ",\"dedup_ratio\":" << gauges.dedupRatio() << "},\"cache\":{\"capacity_blocks\":" << gauges.cacheCapacityBlocks
+            << ",\"cached_blocks\":" << gauges.cachedBlocks << ",\"dirty_blocks\":" << gauges.dirtyBlocks << ",\"hits\":" << gauges.cacheHits
+            << ",\"misses\":" << gauges.cacheMisses << ",\"evictions\":" << gauges.cacheEvictions << ",\"write_backs\":" << gauges.cacheWriteBacks
+            << ",\"read_ahead_blocks\":" << gauges.readAheadBlocks << "}}\n";
+    }
+
+    // Prometheus text exposition format.
+    void writePrometheus(std::ostream& out, const StatsGauges& gauges) const {
+        auto histogram = [&out](const char* metric, const char* label, std::string_view name, const LatencyHistogram& latency) {
+            // A fixed set of buckets from about 1us up; faster samples count towards the first
+            std::uint64_t cumulative = 0;
+            for (int i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+                cumulative += latency.bucket(i);
+                if (i < PROMETHEUS_FIRST_BUCKET) {
+                    continue;
+                }
+                out << metric << "_bucket{" << label << "=\"" << name << "\",le=\"" << LatencyHistogram::upperBound(i) / 1e9 << "\"} "
+                    << cumulative << '\n';
+            }
+            out << metric << "_bucket{" << label << "=\"" << name << "\",le=\"+Inf\"} " << latency.count() << '\n';
+            out << metric << "_sum{" << label << "=\"" << name << "\"} " << latency.sumNanoseconds() / 1e9 << '\n';
+            out << metric << "_count{" << label << "=\"" << name << "\"} " << latency.count() << '\n';
+        };
+
+        out << "# TYPE fms_command_latency_seconds histogram\n";
+        forEachCommand([&](std::string_view name, const LatencyHistogram& latency, std::uint64_t) {
+            histogram("fms_command_latency_seconds", "command", name, latency);
+        });
+        out << "# TYPE fms_command_errors_total counter\n";
+        forEachCommand([&](std::string_view name, const LatencyHistogram&, std::uint64_t errors) {
+            out << "fms_command_errors_total{command=\"" << name << "\"} " << errors << '\n';
+        });
+        out << "# TYPE fms_operation_latency_seconds histogram\n";
+        forEachOperation([&](const char* name, const LatencyHistogram& latency) {
+            histogram("fms_operation_latency_seconds", "operation", name, latency);
+        });
+
+        auto metric = [&out](const char* name, const char* type, auto value) {
+            out << "# TYPE " << name << ' ' << type << '\n' << name << ' ' << value << '\n';
+        };
+        metric("fms_saved_bytes_total", "counter", counter(Counter::SavedBytes));
+        metric("fms_last_save_bytes", "gauge", counter(Counter::LastSaveBytes));
+        metric("fms_last_save_raw_bytes", "gauge", counter(Counter::LastSaveRawBytes));
+        metric("fms_blocks_allocated_total", "counter", counter(Counter::BlocksAllocated));
+        metric("fms_blocks_freed_total", "counter", counter(Counter::BlocksFreed));
+        metric("fms_deduped_blocks_total", "counter", counter(Counter::DedupedBlocks));
+        metric("fms_copied_on_write_blocks_total", "counter", counter(Counter::CopiedOnWriteBlocks));
+        metric("fms_scrubbed_blocks_total", "counter", counter(Counter::ScrubbedBlocks));
+        metric("fms_corrupt_blocks_total", "counter", counter(Counter::CorruptBlocks));
+        metric("fms_capacity_blocks", "gauge", gauges.capacityBlocks);
+        metric("fms_free_blocks", "gauge", gauges.freeBlocks);
+        metric("fms_free_extents", "gauge", gauges.freeExtents);
+        metric("fms_largest_free_extent_blocks", "gauge", gauges.largestFreeExtent);
+        metric("fms_fragmentation_ratio", "gauge", gauges.fragmentation());
+        metric("fms_content_bytes", "gauge", gauges.contentBytes);
+        metric("fms_files", "gauge", gauges.files);
+        metric("fms_directories", "gauge", gauges.directories);
+        metric("fms_shared_blocks", "gauge", gauges.sharedBlocks);
+        metric("fms_dedup_saved_blocks", "gauge", gauges.dedupSavedBlocks);
+        metric("fms_dedup_ratio", "gauge", gauges.dedupRatio());
+        metric("fms_cache_capacity_blocks", "gauge", gauges.cacheCapacityBlocks);
+        metric("fms_cache_blocks", "gauge", gauges.cachedBlocks);
+        metric("fms_cache_dirty_blocks", "gauge", gauges.dirtyBlocks);
+        metric("fms_cache_hits_total", "counter", gauges.cacheHits);
+        metric("fms_cache_misses_total", "counter", gauges.cacheMisses);
+        metric("fms_cache_evictions_total", "counter", gauges.cacheEvictions);
+        metric("fms_cache_write_backs_total", "counter", gauges.cacheWriteBacks);
+        metric("fms_cache_read_ahead_blocks_total", "counter", gauges.readAheadBlocks);
+    }
+
+private:
+    struct CommandStats {
+        LatencyHistogram latency;
+        std::atomic<std::uint64_t> errors{0};
+    };
+
+    static const int PROMETHEUS_FIRST_BUCKET = 10;  // 2^10 ns
+    static constexpr const char* OPERATIONS[] = {"save", "load", "allocate", "find_free_blocks"};
+
+    std::array<CommandStats, COMMAND_COUNT + 1> commands;  // The last one counts unknown commands
+    std::array<LatencyHistogram, static_cast<int>(Operation::Count)> operations;
+    std::array<std::atomic<std::uint64_t>, static_cast<int>(Counter::Count)> counters{};
+
+    std::uint64_t counter(Counter which) const {
+        return counters[static_cast<int>(which)].load(std::memory_order_relaxed);
+    }
+
+    // Visits the commands that ran at least once.
+    template <typename Visit>
+    void forEachCommand(Visit visit) const {
+        for (std::size_t i = 0; i < commands.size(); ++i) {
+            if (commands[i].latency.count() > 0) {
+                std::string_view name = i < COMMAND_COUNT ? COMMAND_NAMES[i] : "other";
+                visit(name, commands[i].latency, commands[i].errors.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    template <typename Visit>
+    void forEachOperation(Visit visit) const {
+        for (int i = 0; i < static_cast<int>(Operation::Count); ++i) {
+            visit(OPERATIONS[i], operations[i]);
+        }
+    }
+};
+
+// Calls a function every interval on its own thread until destroyed.
+class PeriodicTask {
+public:
+    PeriodicTask(std::chrono::milliseconds interval, std::function<void()> task)
+        : worker([this, interval, task]() {
+              std::unique_lock<std::mutex> guard(mutex);
+              while (!wake.wait_for(guard, interval, [this]() { return stopping; })) {
+                  guard.unlock();
+                  task();
+                  guard.lock();
+              }
+          }) {}
+
+    ~PeriodicTask() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;  // Declared last so it starts after the other members exist
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// Outcome of a library call. The command line reports the message of the
+// error instead; both come from the same FileSystemError.
+enum class Status : std::uint8_t {
+    Ok,
+    NotFound,         // No file, directory or snapshot by that name
+    AlreadyExists,
+    InvalidArgument,  // Malformed name, size, offset or permissions
+    FileTooLarge,     // The change would pass the declared size of the file
+    NoSpace,          // Not enough free blocks
+    LimitReached,     // Too many files in the directory or directories in the file system
+    BadHandle,        // Never opened, closed, or its file was deleted
+    IoError,          // The storage failed
+    Corrupted,        // Stored data does not match its checksum
+};
+
+inline const char* statusMessage(Status status) {
+    switch (status) {
+        case Status::Ok: return "Success";
+        case Status::NotFound: return "Not found";
+        case Status::AlreadyExists: return "Already exists";
+        case Status::InvalidArgument: return "Invalid argument";
+        case Status::FileTooLarge: return "File size exceeded";
+        case Status::NoSpace: return "Insufficient storage space";
+        case Status::LimitReached: return "Limit reached";
+        case Status::BadHandle: return "Bad file handle";
+        case Status::IoError: return "I/O error";
+        case Status::Corrupted: return "Data corrupted";
+    }
+    return "Unknown status";
+}
+
+// Error that knows its Status. Other exceptions map to InvalidArgument when
+// they are std::invalid_argument and to IoError otherwise.
+class FileSystemError : public std::runtime_error {
+public:
+    FileSystemError(Status status, const std::string& message) : std::runtime_error(message), code(status) {}
+
+    Status status() const { return code; }
+
+private:
+    Status code;
+};
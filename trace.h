@@ -0,0 +1,165 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+// One command as it ran: when it started, on behalf of which session, how
+// long it took and whether it failed.
+struct TraceRecord {
+    std::uint64_t time = 0;     // Nanoseconds since recording started
+    std::uint32_t session = 0;  // 0 is the console; server connections count up from 1
+    std::uint64_t latency = 0;  // Nanoseconds the command took
+    bool failed = false;
+    std::string command;
+    std::string error;          // Message of a failed command
+};
+
+// Trace of commands in a compact binary form:
+//   u64 magic | record*
+//   record: varint zigzag time delta | varint session | varint latency |
+//           u8 failed | varint command size | command | [varint error size | error]
+// Times are deltas from the previous record. Records are written as commands
+// finish, so concurrent sessions can make a delta negative.
+class TraceWriter {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::uint64_t MAGIC = 0x3143525453464d46ULL;  // "FMFSTRC1"
+
+    explicit TraceWriter(const std::string& path) : out(path, std::ios::binary | std::ios::trunc), start(Clock::now()) {
+        if (!out) {
+            throw std::runtime_error("Failed to open the trace " + path + "!");
+        }
+        putFixed(MAGIC);
+    }
+
+    ~TraceWriter() {
+        std::lock_guard<std::mutex> guard(mutex);
+        flushLocked();
+    }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Nanoseconds since recording started; commands take it before they run.
+    std::uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    // Safe to call from several threads at once.
+    void record(std::uint32_t session, std::uint64_t time, std::string_view command, bool failed, std::string_view error) {
+        std::uint64_t latency = now() - time;
+        std::lock_guard<std::mutex> guard(mutex);
+        std::int64_t delta = static_cast<std::int64_t>(time - lastTime);
+        lastTime = time;
+        putVarint((static_cast<std::uint64_t>(delta) << 1) ^ static_cast<std::uint64_t>(delta >> 63));
+        putVarint(session);
+        putVarint(latency);
+        buffer.push_back(failed ? 1 : 0);
+        putString(command);
+        if (failed) {
+            putString(error);
+        }
+        if (buffer.size() >= FLUSH_SIZE) {
+            flushLocked();
+        }
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> guard(mutex);
+        flushLocked();
+    }
+
+private:
+    static const std::size_t FLUSH_SIZE = 64 * 1024;
+
+    std::ofstream out;
+    Clock::time_point start;
+    std::mutex mutex;
+    std::string buffer;
+    std::uint64_t lastTime = 0;
+
+    void putFixed(std::uint64_t value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void putVarint(std::uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    void putString(std::string_view text) {
+        putVarint(text.size());
+        buffer.append(text.data(), text.size());
+    }
+
+    void flushLocked() {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        out.flush();
+        buffer.clear();
+    }
+};
+
+// Reads a whole trace back. A record cut short at the end, as left by a
+// process that was killed while recording, is dropped.
+inline std::vector<TraceRecord> readTrace(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to open the trace " + path + "!");
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::uint64_t magic = 0;
+    if (data.size() < sizeof(magic) || (std::memcpy(&magic, data.data(), sizeof(magic)), magic != TraceWriter::MAGIC)) {
+        throw std::runtime_error("Not a command trace: " + path + "!");
+    }
+
+    std::size_t at = sizeof(magic);
+    auto varint = [&](std::uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64 && at < data.size(); shift += 7) {
+            unsigned char byte = static_cast<unsigned char>(data[at++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto text = [&](std::string& value) {
+        std::uint64_t size;
+        if (!varint(size) || size > data.size() - at) {
+            return false;
+        }
+        value.assign(data, at, size);
+        at += size;
+        return true;
+    };
+
+    std::vector<TraceRecord> records;
+    std::uint64_t time = 0;
+    while (at < data.size()) {
+        TraceRecord record;
+        std::uint64_t delta, session;
+        if (!varint(delta) || !varint(session) || !varint(record.latency) || at >= data.size()) {
+            break;
+        }
+        record.failed = data[at++] != 0;
+        if (!text(record.command) || (record.failed && !text(record.error))) {
+            break;
+        }
+        time += (delta >> 1) ^ (~(delta & 1) + 1);  // Undo the zigzag encoding; wraps back for negative deltas
+        record.time = time;
+        record.session = static_cast<std::uint32_t>(session);
+        records.push_back(std::move(record));
+    }
+    return records;
+}
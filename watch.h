@@ -0,0 +1,290 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Kinds of change reported to watchers.
+enum class WatchOp : std::uint8_t {
+    Create,         // A file was created or imported
+    Write,          // Content was replaced or overwritten in place
+    Append,
+    Truncate,
+    Delete,
+    MakeDirectory,
+    Move,           // A directory moved to another parent
+    Rename,         // name is the new name
+    Restore,        // The whole tree was replaced by a snapshot or a rolled back batch
+};
+
+inline const char* watchOpName(WatchOp op) {
+    switch (op) {
+        case WatchOp::Create: return "create";
+        case WatchOp::Write: return "write";
+        case WatchOp::Append: return "append";
+        case WatchOp::Truncate: return "truncate";
+        case WatchOp::Delete: return "delete";
+        case WatchOp::MakeDirectory: return "mkdir";
+        case WatchOp::Move: return "move";
+        case WatchOp::Rename: return "rename";
+        case WatchOp::Restore: return "restore";
+    }
+    return "unknown";
+}
+
+// One change as a watcher sees it.
+struct WatchEvent {
+    std::uint64_t sequence = 0;   // Position in the stream of all changes, without gaps
+    WatchOp op = WatchOp::Create;
+    std::uint64_t directory = 0;  // Directory holding the entry; for a move, its new parent
+    std::uint64_t inode = 0;      // The file or directory that changed
+    std::uint64_t from = 0;       // Old parent of a moved directory, otherwise 0
+    std::int64_t sizeDelta = 0;   // Change of the content size in bytes
+    std::string name;             // Name of the entry, cut to EventRing::NAME_BYTES
+};
+
+// Appends event as one line of text.
+inline void formatEvent(const WatchEvent& event, std::string& out) {
+    out += std::to_string(event.sequence);
+    out += ' ';
+    out += watchOpName(event.op);
+    out += ' ';
+    out += event.name;
+    out += " inode=" + std::to_string(event.inode) + " dir=" + std::to_string(event.directory);
+    if (event.op == WatchOp::Move) {
+        out += " from=" + std::to_string(event.from);
+    }
+    if (event.sizeDelta != 0) {
+        out += event.sizeDelta > 0 ? " size=+" : " size=";
+        out += std::to_string(event.sizeDelta);
+    }
+    out += '\n';
+}
+
+// Bounded ring of the latest changes, written by every mutation and read by
+// any number of watchers, each with its own cursor.
+//
+// Publishing takes a sequence number with one fetch_add and fills the slot
+// it maps to, guarded by a stamp in the slot, without locks or waiting on
+// readers. Readers check the stamp before and after copying a slot, so an
+// event overwritten while it is read is noticed rather than returned torn.
+// A reader that falls more than the capacity behind finds its next event
+// overwritten; it skips to the oldest event still held and learns how many
+// it lost. Producers never wait for readers, so a stalled watcher costs the
+// mutation path nothing.
+class EventRing {
+public:
+    static constexpr std::size_t NAME_BYTES = 80;  // Longer names are cut
+
+    explicit EventRing(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+    }
+
+    EventRing(const EventRing&) = delete;
+    EventRing& operator=(const EventRing&) = delete;
+
+    std::size_t capacity() const { return mask + 1; }
+
+    // Sequence number the next event will get; a cursor starting here sees
+    // only changes made from now on.
+    std::uint64_t head() const { return next.load(std::memory_order_acquire); }
+
+    void publish(WatchOp op, std::uint64_t directory, std::uint64_t inode, std::uint64_t from, std::int64_t sizeDelta,
+                 std::string_view name) {
+        std::uint64_t sequence = next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[sequence & mask];
+
+        // Claim the slot, unless a writer a full lap ahead already filled it
+        std::uint64_t stamp = slot.stamp.load(std::memory_order_relaxed);
+        for (;;) {
+            if (stamp == BUSY) {
+                std::this_thread::yield();
+                stamp = slot.stamp.load(std::memory_order_relaxed);
+            } else if (stamp > sequence + 1) {
+                return;  // Readers see this event as lost
+            } else if (slot.stamp.compare_exchange_weak(stamp, BUSY, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        // Keeps the stores below from becoming visible before BUSY, so a
+        // reader that copied them sees the stamp change when it checks again
+        std::atomic_thread_fence(std::memory_order_release);
+
+        std::size_t length = std::min(name.size(), NAME_BYTES);
+        slot.words[0].store(static_cast<std::uint64_t>(op) | length << 8, std::memory_order_relaxed);
+        slot.words[1].store(directory, std::memory_order_relaxed);
+        slot.words[2].store(inode, std::memory_order_relaxed);
+        slot.words[3].store(from, std::memory_order_relaxed);
+        slot.words[4].store(static_cast<std::uint64_t>(sizeDelta), std::memory_order_relaxed);
+        for (std::size_t i = 0; i * 8 < length; ++i) {
+            std::uint64_t word = 0;
+            std::memcpy(&word, name.data() + i * 8, std::min<std::size_t>(8, length - i * 8));
+            slot.words[NAME_WORD + i].store(word, std::memory_order_relaxed);
+        }
+        slot.stamp.store(sequence + 1, std::memory_order_release);
+    }
+
+    // Appends up to max events from cursor on to events and moves cursor past
+    // them. Stops early at an event not yet published. Returns the number of
+    // events that were overwritten before they could be read.
+    std::uint64_t read(std::uint64_t& cursor, std::size_t max, std::vector<WatchEvent>& events) const {
+        std::uint64_t lost = 0;
+        for (std::size_t taken = 0; taken < max;) {
+            const Slot& slot = slots[cursor & mask];
+            std::uint64_t stamp = slot.stamp.load(std::memory_order_acquire);
+            if (stamp == cursor + 1) {
+                WatchEvent event;
+                event.sequence = cursor;
+                std::uint64_t meta = slot.words[0].load(std::memory_order_relaxed);
+                event.op = static_cast<WatchOp>(meta & 0xff);
+                event.directory = slot.words[1].load(std::memory_order_relaxed);
+                event.inode = slot.words[2].load(std::memory_order_relaxed);
+                event.from = slot.words[3].load(std::memory_order_relaxed);
+                event.sizeDelta = static_cast<std::int64_t>(slot.words[4].load(std::memory_order_relaxed));
+                std::size_t length = std::min<std::size_t>(meta >> 8, NAME_BYTES);
+                event.name.resize(length);
+                for (std::size_t i = 0; i * 8 < length; ++i) {
+                    std::uint64_t word = slot.words[NAME_WORD + i].load(std::memory_order_relaxed);
+                    std::memcpy(&event.name[i * 8], &word, std::min<std::size_t>(8, length - i * 8));
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.stamp.load(std::memory_order_relaxed) == stamp) {
+                    events.push_back(std::move(event));
+                    ++cursor;
+                    ++taken;
+                    continue;
+                }
+            } else if ((stamp == BUSY || stamp < cursor + 1) && head() <= cursor + capacity()) {
+                break;  // Not published yet
+            }
+
+            // Overwritten: skip to the oldest event still held
+            std::uint64_t oldest = std::max(cursor + 1, head() - capacity());
+            lost += oldest - cursor;
+            cursor = oldest;
+        }
+        return lost;
+    }
+
+private:
+    static constexpr std::uint64_t BUSY = ~0ULL;  // Stamp of a slot being written
+    static const std::size_t NAME_WORD = 5;       // Index of the first word of the name
+
+    // One event in two cache lines. The stamp is 0 before the first write,
+    // BUSY during one and the sequence number plus one after it.
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> stamp{0};
+        std::atomic<std::uint64_t> words[NAME_WORD + NAME_BYTES / 8];
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask = 0;
+    alignas(64) std::atomic<std::uint64_t> next{0};
+};
+
+// Writes the events of a ring as lines to a file, or to a Unix domain
+// socket when the path names one, a batch at a time. Lost events show up
+// as a "lost <n>" line.
+class EventStream {
+public:
+    EventStream(const EventRing& ring, const std::string& path) : ring(ring), cursor(ring.head()) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) {
+                throw std::invalid_argument("Watch socket path is too long!");
+            }
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                close();
+                throw std::runtime_error("Cannot connect to " + path + "!");
+            }
+            socket = true;
+        } else {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("Cannot write " + path + "!");
+            }
+        }
+    }
+
+    ~EventStream() {
+        close();
+    }
+
+    EventStream(const EventStream&) = delete;
+    EventStream& operator=(const EventStream&) = delete;
+
+    // Writes out every event published so far. Once the other end goes
+    // away, later events are dropped.
+    void pump() {
+        std::vector<WatchEvent> events;
+        std::string text;
+        while (fd >= 0) {
+            events.clear();
+            text.clear();
+            std::uint64_t lost = ring.read(cursor, BATCH_EVENTS, events);
+            if (lost > 0) {
+                text += "lost " + std::to_string(lost) + "\n";
+            }
+            for (const WatchEvent& event : events) {
+                formatEvent(event, text);
+            }
+            if (text.empty()) {
+                break;
+            }
+            if (!send(text)) {
+                close();
+            }
+        }
+    }
+
+private:
+    static const std::size_t BATCH_EVENTS = 1024;  // Events formatted per write
+    const EventRing& ring;
+    std::uint64_t cursor;
+    int fd = -1;
+    bool socket = false;
+
+    bool send(const std::string& text) {
+        for (std::size_t done = 0; done < text.size();) {
+            ssize_t n = socket ? ::send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL)
+                               : ::write(fd, text.data() + done, text.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            done += static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+// Runs a job that discovers its own work, such as a tree walk, on a set of
+// threads. Every worker keeps a deque of items: it pushes the items it finds
+// at the back and takes its next item from the back, so it goes depth first
+// over data it just touched, while an idle worker steals the oldest item from
+// the front of another deque, which tends to be the largest piece left. The
+// calling thread is worker 0, so a pool of one thread runs inline.
+template <typename Item>
+class WorkStealingPool {
+public:
+    // Hands new items to the worker running the current visit.
+    class Worker {
+    public:
+        void spawn(Item item) {
+            pool.outstanding.fetch_add(1, std::memory_order_relaxed);
+            Queue& queue = *pool.queues[index];
+            std::lock_guard<std::mutex> guard(queue.mutex);
+            queue.items.push_back(std::move(item));
+        }
+
+        std::size_t id() const { return index; }
+
+    private:
+        friend class WorkStealingPool;
+        WorkStealingPool& pool;
+        std::size_t index;
+
+        Worker(WorkStealingPool& pool, std::size_t index) : pool(pool), index(index) {}
+    };
+
+    static std::size_t hardwareThreads() {
+        unsigned threads = std::thread::hardware_concurrency();
+        return threads == 0 ? 1 : threads;
+    }
+
+    explicit WorkStealingPool(std::size_t threads) {
+        if (threads == 0) {
+            threads = 1;
+        }
+        for (std::size_t i = 0; i < threads; ++i) {
+            queues.emplace_back(new Queue);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    std::size_t threads() const { return queues.size(); }
+
+    // Calls visit(worker, item) for every root and every item spawned by a
+    // visit, and returns once all of them are done. The first exception thrown
+    // by a visit stops the run and is rethrown here.
+    template <typename Visit>
+    void run(std::vector<Item> roots, Visit visit) {
+        outstanding = roots.size();
+        failed = false;
+        error = nullptr;
+        for (std::size_t i = 0; i < roots.size(); ++i) {
+            queues[i % queues.size()]->items.push_back(std::move(roots[i]));
+        }
+
+        std::vector<std::thread> helpers;
+        for (std::size_t i = 1; i < queues.size(); ++i) {
+            helpers.emplace_back([this, i, &visit]() { work(i, visit); });
+        }
+        work(0, visit);
+        for (std::thread& helper : helpers) {
+            helper.join();
+        }
+        for (auto& queue : queues) {
+            queue->items.clear();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<std::size_t> outstanding{0};  // Items pushed and not yet visited
+    std::atomic<bool> failed{false};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    template <typename Visit>
+    void work(std::size_t index, Visit& visit) {
+        Worker worker(*this, index);
+        Item item;
+        while (!failed.load(std::memory_order_relaxed)) {
+            if (!take(index, item)) {
+                if (outstanding.load(std::memory_order_acquire) == 0) {
+                    return;
+                }
+                std::this_thread::yield();  // Another worker may still spawn items
+                continue;
+            }
+
+            try {
+                visit(worker, item);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(errorMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+            outstanding.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    // Pops from the worker's own deque, or steals from the next non-empty one.
+    bool take(std::size_t index, Item& item) {
+        for (std::size_t i = 0; i < queues.size(); ++i) {
+            bool own = i == 0;
+            Queue& queue = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(queue.mutex);
+            if (queue.items.empty()) {
+                continue;
+            }
+            if (own) {
+                item = std::move(queue.items.back());
+                queue.items.pop_back();
+            } else {
+                item = std::move(queue.items.front());
+                queue.items.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+};